@@ -6,48 +6,299 @@
  *     be written from 1 to 0 but not the other way around)
  *   - block erase - the whole eraseblock will be erased (all bits set to 1)
  *   - chip erase - the whole chip will be erased (all bits set to 1)
+ *   - continuous read of any length (crossing page boundaries) and
+ *     scatter/gather read of multiple ranges in one request
+ *   - multi-page program, data are programmed page by page
  *   - get geometry can be used to fetch information about flash size and
  *     block sizes (page/erase block)
+ *   - every operation advances virtual time of the device according to
+ *     its timing model
+ *   - flash contents can be kept in memory or in a memory mapped image file
+ *     persisting across runs
+ *   - power loss after a given number of program/erase operations, the
+ *     interrupted program writes only a part of the data, the interrupted
+ *     erase clears only a part of the eraseblock
+ *   - asynchronous sector erase with busy status polling and a completion
+ *     callback, reads and programs of other banks (dual-bank parts) proceed
+ *     while an erase is in progress
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <assert.h>
 #include <malloc.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "flash_emulator.h"
 
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+
+static void flash_init_common(struct flash_dev *flash, uint32_t size) {
+	
+	flash->page_size = FLASH_EMU_PAGE_SIZE;
+	flash->sector_size = FLASH_EMU_SECTOR_SIZE;
+	flash->block_size = FLASH_EMU_BLOCK_SIZE;
+	flash->size = size;
+
+	flash->timing.cmd_ns = FLASH_EMU_CMD_NS;
+	flash->timing.byte_ns = FLASH_EMU_BYTE_NS;
+	flash->timing.page_program_us = FLASH_EMU_PAGE_PROGRAM_US;
+	flash->timing.sector_erase_us = FLASH_EMU_SECTOR_ERASE_US;
+	flash->timing.block_erase_us = FLASH_EMU_BLOCK_ERASE_US;
+	flash->timing.chip_erase_us = FLASH_EMU_CHIP_ERASE_US;
+	flash->time_ns = 0;
+
+	flash->strict = 1;
+	flash->bad_programs = 0;
+	flash->page_wraps = 0;
+
+	flash->fail_after = 0;
+	flash->fail_ops = 0;
+	flash->power_lost = 0;
+
+	flash->banks = 1;
+	flash->busy_bank = FLASH_BANK_NONE;
+	flash->busy_until_ns = 0;
+	flash->callback = NULL;
+	flash->callback_ctx = NULL;
+
+	flash->data = NULL;
+	flash->fd = -1;
+}
+
 
 /**
  * Inits virtual flash in memory and allocates required space for temporary
- * flash data storage.
+ * flash data storage. The flash is erased.
  * 
  * @param flash A flash device to initialize.
+ * @param size Size of the flash in bytes.
  * 
  * @return FLASH_INIT_OK on success or
  *         FLASH_INIT_FAILED otherwise.
  */
 int32_t flash_init(struct flash_dev *flash, uint32_t size) {
 	assert(flash != NULL);
-	
-	flash->page_size = FLASH_EMU_PAGE_SIZE;
-	flash->sector_size = FLASH_EMU_SECTOR_SIZE;
-	flash->block_size = FLASH_EMU_BLOCK_SIZE;
-	flash->size = size;
+
+	flash_init_common(flash, size);
 	
 	flash->data = malloc(flash->size);
 	if (flash->data == NULL) {
 		return FLASH_INIT_FAILED;
 	}
+	memset(flash->data, 0xff, flash->size);
 
 	return FLASH_INIT_OK;
 }
 
 
 /**
- * Frees all resources used by virtual flash device (this means all flash
- * data will be lost, data is not saved to any nonvolatile memory)
+ * Inits virtual flash backed by an image file mapped to memory. All changes
+ * are written to the file. The image is created if it does not exist and it
+ * is extended to the requested size, new space is erased.
+ *
+ * @param flash A flash device to initialize.
+ * @param path Path to the image file.
+ * @param size Size of the flash in bytes or 0 to use the size of an existing
+ *             image.
+ *
+ * @return FLASH_INIT_FILE_OK on success or
+ *         FLASH_INIT_FILE_FAILED otherwise.
+ */
+int32_t flash_init_file(struct flash_dev *flash, const char *path, uint32_t size) {
+	assert(flash != NULL);
+	assert(path != NULL);
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return FLASH_INIT_FILE_FAILED;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return FLASH_INIT_FILE_FAILED;
+	}
+	if (size == 0) {
+		if (st.st_size == 0 || (uint64_t)st.st_size > UINT32_MAX) {
+			close(fd);
+			return FLASH_INIT_FILE_FAILED;
+		}
+		size = st.st_size;
+	}
+	if ((uint64_t)st.st_size < size && ftruncate(fd, size) != 0) {
+		close(fd);
+		return FLASH_INIT_FILE_FAILED;
+	}
+
+	flash_init_common(flash, size);
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return FLASH_INIT_FILE_FAILED;
+	}
+	flash->data = data;
+	flash->fd = fd;
+
+	/* space added to the image is erased */
+	if ((uint64_t)st.st_size < size) {
+		memset(&(flash->data[st.st_size]), 0xff, size - st.st_size);
+	}
+
+	return FLASH_INIT_FILE_OK;
+}
+
+
+/**
+ * Replace the timing model of the flash device. Virtual time accumulated
+ * so far is kept.
+ *
+ * @param flash A flash device.
+ * @param timing New timing, all zeroes make the operations instant.
+ *
+ * @return FLASH_SET_TIMING_OK on success or
+ *         FLASH_SET_TIMING_FAILED otherwise.
+ */
+int32_t flash_set_timing(struct flash_dev *flash, const struct flash_timing *timing) {
+	assert(flash != NULL);
+	assert(timing != NULL);
+
+	flash->timing = *timing;
+
+	return FLASH_SET_TIMING_OK;
+}
+
+
+/**
+ * Arm or disarm power loss emulation. Counting of program and erase
+ * operations starts again and the power is restored.
+ *
+ * @param flash A flash device.
+ * @param fail_after Number of program/erase operations to complete before
+ *                   the power is lost or 0 to disable the emulation.
+ *
+ * @return FLASH_SET_POWER_FAIL_OK on success or
+ *         FLASH_SET_POWER_FAIL_FAILED otherwise.
+ */
+int32_t flash_set_power_fail(struct flash_dev *flash, uint32_t fail_after) {
+	assert(flash != NULL);
+
+	flash->fail_after = fail_after;
+	flash->fail_ops = 0;
+	flash->power_lost = 0;
+
+	return FLASH_SET_POWER_FAIL_OK;
+}
+
+
+/**
+ * Split the flash into independent banks. An erase in progress blocks only
+ * accesses to its own bank.
+ *
+ * @param flash A flash device.
+ * @param banks Number of banks, the flash must consist of whole blocks
+ *              in every bank.
+ *
+ * @return FLASH_SET_BANKS_OK on success or
+ *         FLASH_SET_BANKS_FAILED if the flash cannot be split.
+ */
+int32_t flash_set_banks(struct flash_dev *flash, uint32_t banks) {
+	assert(flash != NULL);
+
+	if (banks == 0 || (flash->size % (banks * flash->block_size)) != 0) {
+		return FLASH_SET_BANKS_FAILED;
+	}
+	flash->banks = banks;
+
+	return FLASH_SET_BANKS_OK;
+}
+
+
+/**
+ * Set a function called when an asynchronous erase completes. It is called
+ * from the flash call which noticed the completion (like from an interrupt
+ * handler on a real device), it must not access the flash.
+ *
+ * @param flash A flash device.
+ * @param callback Completion callback or NULL.
+ * @param ctx User context passed to the callback.
+ *
+ * @return FLASH_SET_CALLBACK_OK.
+ */
+int32_t flash_set_callback(struct flash_dev *flash, void (*callback)(struct flash_dev *flash, void *ctx), void *ctx) {
+	assert(flash != NULL);
+
+	flash->callback = callback;
+	flash->callback_ctx = ctx;
+
+	return FLASH_SET_CALLBACK_OK;
+}
+
+
+static uint32_t flash_bank(struct flash_dev *flash, uint32_t addr) {
+	return addr / (flash->size / flash->banks);
+}
+
+
+/* Finish the erase in progress if its time has elapsed. */
+static void flash_check_busy(struct flash_dev *flash) {
+	if (flash->busy_bank != FLASH_BANK_NONE && flash->time_ns >= flash->busy_until_ns) {
+		flash->busy_bank = FLASH_BANK_NONE;
+		if (flash->callback != NULL) {
+			flash->callback(flash, flash->callback_ctx);
+		}
+	}
+}
+
+
+/* Wait until the bank containing addr is not busy. */
+static void flash_wait(struct flash_dev *flash, uint32_t addr) {
+	if (flash->busy_bank != FLASH_BANK_NONE && flash->busy_bank == flash_bank(flash, addr) &&
+	    flash->time_ns < flash->busy_until_ns) {
+		flash->time_ns = flash->busy_until_ns;
+	}
+	flash_check_busy(flash);
+}
+
+
+/* Count a program/erase operation. Returns the length of the operation to
+ * be performed, less than len if it is interrupted by the power loss or 0 if
+ * the power was already lost. */
+static uint32_t flash_power_check(struct flash_dev *flash, uint32_t len) {
+	if (flash->power_lost) {
+		return 0;
+	}
+	if (flash->fail_after == 0) {
+		return len;
+	}
+	if (flash->fail_ops++ < flash->fail_after) {
+		return len;
+	}
+	flash->power_lost = 1;
+
+	return len / 2;
+}
+
+
+/* Account one bus transaction transferring len bytes and busy_us of
+ * internal operation. */
+static void flash_account(struct flash_dev *flash, uint32_t len, uint32_t busy_us) {
+	flash->time_ns += flash->timing.cmd_ns + (uint64_t)len * flash->timing.byte_ns + (uint64_t)busy_us * 1000;
+	flash_check_busy(flash);
+}
+
+
+/**
+ * Frees all resources used by virtual flash device. Data of a memory only
+ * flash are lost, an image file is synchronized and closed.
  * 
  * @param flash A flash device to free.
  * 
@@ -58,7 +309,20 @@ int32_t flash_free(struct flash_dev *flash) {
 	assert(flash != NULL);
 
 	assert(flash->data != NULL);
+	if (flash->fd >= 0) {
+		int32_t ret = FLASH_FREE_OK;
+		if (msync(flash->data, flash->size, MS_SYNC) != 0) {
+			ret = FLASH_FREE_FAILED;
+		}
+		munmap(flash->data, flash->size);
+		close(flash->fd);
+		flash->fd = -1;
+		flash->data = NULL;
+		flash->size = 0;
+		return ret;
+	}
 	free(flash->data);
+	flash->data = NULL;
 	flash->size = 0;
 
 	return FLASH_FREE_OK;
@@ -98,8 +362,18 @@ int32_t flash_get_info(struct flash_dev *flash, struct flash_info *info) {
  */
 int32_t flash_chip_erase(struct flash_dev *flash) {
 	assert(flash != NULL);
-	
-	memset(flash->data, 0xff, flash->size);
+
+	if (flash->busy_bank != FLASH_BANK_NONE) {
+		flash_wait(flash, flash->busy_bank * (flash->size / flash->banks));
+	}
+	uint32_t len = flash_power_check(flash, flash->size);
+	memset(flash->data, 0xff, len);
+	flash_account(flash, 0, flash->timing.chip_erase_us);
+	if (len < flash->size) {
+		return FLASH_CHIP_ERASE_FAILED;
+	}
+
+	return FLASH_CHIP_ERASE_OK;
 }
 
 
@@ -119,7 +393,13 @@ int32_t flash_block_erase(struct flash_dev *flash, const uint32_t addr) {
 	assert(addr < flash->size);
 	assert((addr % flash->block_size) == 0);
 	
-	memset(&(flash->data[addr]), 0xff, flash->block_size);
+	flash_wait(flash, addr);
+	uint32_t len = flash_power_check(flash, flash->block_size);
+	memset(&(flash->data[addr]), 0xff, len);
+	flash_account(flash, 0, flash->timing.block_erase_us);
+	if (len < flash->block_size) {
+		return FLASH_BLOCK_ERASE_FAILED;
+	}
 	
 	return FLASH_BLOCK_ERASE_OK;
 }
@@ -141,15 +421,77 @@ int32_t flash_sector_erase(struct flash_dev *flash, const uint32_t addr) {
 	assert(addr < flash->size);
 	assert((addr % flash->sector_size) == 0);
 
-	memset(&(flash->data[addr]), 0xff, flash->sector_size);
+	flash_wait(flash, addr);
+	uint32_t len = flash_power_check(flash, flash->sector_size);
+	memset(&(flash->data[addr]), 0xff, len);
+	flash_account(flash, 0, flash->timing.sector_erase_us);
+	if (len < flash->sector_size) {
+		return FLASH_SECTOR_ERASE_FAILED;
+	}
 	
 	return FLASH_SECTOR_ERASE_OK;
 }
 
 
+/**
+ * Start a sector erase and return without waiting for its completion. The
+ * bank containing the sector is busy until the erase completes, only one
+ * erase can be in progress at a time.
+ *
+ * @param flash A flash device to erase.
+ * @param addr Starting address of the sector to be erased.
+ *
+ * @return FLASH_SECTOR_ERASE_START_OK if the erase has been started or
+ *         FLASH_SECTOR_ERASE_START_FAILED otherwise.
+ */
+int32_t flash_sector_erase_start(struct flash_dev *flash, const uint32_t addr) {
+	assert(flash != NULL);
+
+	assert(addr < flash->size);
+	assert((addr % flash->sector_size) == 0);
+
+	if (flash->busy_bank != FLASH_BANK_NONE) {
+		flash_wait(flash, flash->busy_bank * (flash->size / flash->banks));
+	}
+	uint32_t len = flash_power_check(flash, flash->sector_size);
+	memset(&(flash->data[addr]), 0xff, len);
+	flash_account(flash, 0, 0);
+	flash->busy_bank = flash_bank(flash, addr);
+	flash->busy_until_ns = flash->time_ns + (uint64_t)flash->timing.sector_erase_us * 1000;
+	if (len < flash->sector_size) {
+		return FLASH_SECTOR_ERASE_START_FAILED;
+	}
+
+	return FLASH_SECTOR_ERASE_START_OK;
+}
+
+
+/**
+ * Read the busy status of the bank containing the address.
+ *
+ * @param flash A flash device.
+ * @param addr Any address in the bank.
+ *
+ * @return FLASH_POLL_IDLE if the bank can be accessed or
+ *         FLASH_POLL_BUSY if an erase is in progress.
+ */
+int32_t flash_poll(struct flash_dev *flash, const uint32_t addr) {
+	assert(flash != NULL);
+	assert(addr < flash->size);
+
+	flash_account(flash, 1, 0);
+	if (flash->busy_bank != FLASH_BANK_NONE && flash->busy_bank == flash_bank(flash, addr)) {
+		return FLASH_POLL_BUSY;
+	}
+
+	return FLASH_POLL_IDLE;
+}
+
+
 /**
  * Program data (turn 1's to 0's) in chunks of size up to the page size.
- * Data to be written cannot cross page boundaries.
+ * Data to be written cannot cross page boundaries, in non-strict mode the
+ * address wraps to the beginning of the page like on a real chip.
  * 
  * @param flash A flash to write bytes to.
  * @param addr Starting address.
@@ -165,15 +507,35 @@ int32_t flash_page_write(struct flash_dev *flash, const uint32_t addr, const uin
 	assert(len > 0);
 	assert(len <= flash->page_size);
 	assert((addr + len) <= flash->size);
-	assert((addr + len) <= ((addr / flash->page_size) * flash->page_size + flash->page_size));
 	assert(data != NULL);
 
-	for (uint32_t i = 0; i < len; i++) {
-		flash->data[addr + i] &= data[i];
-		if (flash->data[addr + i] != data[i]) {
-			printf("flash_emulator: bad write, erasing required, addr = %d, byte = %02x, new value = %02x\n", addr + i, flash->data[addr + i], data[i]);
+	uint32_t page = (addr / flash->page_size) * flash->page_size;
+	if ((addr + len) > (page + flash->page_size)) {
+		if (flash->strict) {
+			printf("flash_emulator: program crosses page boundary, addr = %d, len = %d\n", addr, len);
 		}
-		assert(flash->data[addr + i] == data[i]);
+		assert(!flash->strict);
+		flash->page_wraps++;
+	}
+
+	flash_wait(flash, addr);
+	uint32_t done = flash_power_check(flash, len);
+	uint32_t bad = 0;
+	for (uint32_t i = 0; i < done; i++) {
+		uint32_t a = page + (addr - page + i) % flash->page_size;
+		if ((flash->data[a] & data[i]) != data[i]) {
+			if (flash->strict) {
+				printf("flash_emulator: bad write, erasing required, addr = %d, byte = %02x, new value = %02x\n", a, flash->data[a], data[i]);
+			}
+			assert(!flash->strict);
+			bad = 1;
+		}
+		flash->data[a] &= data[i];
+	}
+	flash->bad_programs += bad;
+	flash_account(flash, len, flash->timing.page_program_us);
+	if (done < len) {
+		return FLASH_PAGE_WRITE_FAILED;
 	}
 
 	return FLASH_PAGE_WRITE_OK;
@@ -189,8 +551,102 @@ int32_t flash_page_read(struct flash_dev *flash, const uint32_t addr, uint8_t *d
 	assert((addr + len) <= ((addr / flash->page_size) * flash->page_size + flash->page_size));
 	assert(data != NULL);
 
+	flash_wait(flash, addr);
 	memcpy(data, &(flash->data[addr]), len);
+	flash_account(flash, len, 0);
 	
 	return FLASH_PAGE_READ_OK;
 	
 }
+
+
+/**
+ * Continuous read of data of any length. Reading can cross page boundaries
+ * (like fast read command of SPI NOR flash memories).
+ *
+ * @param flash A flash to read bytes from.
+ * @param addr Starting address.
+ * @param *data Buffer to store read data.
+ * @param len Length of data to be read.
+ *
+ * @return FLASH_READ_OK on success or
+ *         FLASH_READ_FAILED otherwise.
+ */
+int32_t flash_read(struct flash_dev *flash, const uint32_t addr, uint8_t *data, const uint32_t len) {
+	assert(flash != NULL);
+
+	assert(len > 0);
+	assert((addr + len) <= flash->size);
+	assert(data != NULL);
+
+	flash_wait(flash, addr);
+	flash_wait(flash, addr + len - 1);
+	memcpy(data, &(flash->data[addr]), len);
+	flash_account(flash, len, 0);
+
+	return FLASH_READ_OK;
+}
+
+
+/**
+ * Scatter/gather read. All ranges are read in a single request (like a
+ * controller executing a queue of read descriptors), the command overhead
+ * is accounted once for the whole vector.
+ *
+ * @param flash A flash to read bytes from.
+ * @param *iov Array of ranges to be read.
+ * @param count Number of ranges in the array.
+ *
+ * @return FLASH_READV_OK on success or
+ *         FLASH_READV_FAILED otherwise.
+ */
+int32_t flash_readv(struct flash_dev *flash, const struct flash_iovec *iov, const uint32_t count) {
+	assert(flash != NULL);
+	assert(iov != NULL);
+
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		assert(iov[i].len > 0);
+		assert((iov[i].addr + iov[i].len) <= flash->size);
+		assert(iov[i].data != NULL);
+
+		flash_wait(flash, iov[i].addr);
+		flash_wait(flash, iov[i].addr + iov[i].len - 1);
+		memcpy(iov[i].data, &(flash->data[iov[i].addr]), iov[i].len);
+		total += iov[i].len;
+	}
+	if (count > 0) {
+		flash_account(flash, total, 0);
+	}
+
+	return FLASH_READV_OK;
+}
+
+
+/**
+ * Program data of any length. Data are split at page boundaries and
+ * programmed page by page.
+ *
+ * @param flash A flash to write bytes to.
+ * @param addr Starting address.
+ * @param *data Pointer to data buffer to be written.
+ * @param len Length of data to be written.
+ *
+ * @return FLASH_PROGRAM_OK on success or
+ *         FLASH_PROGRAM_FAILED otherwise.
+ */
+int32_t flash_program(struct flash_dev *flash, const uint32_t addr, const uint8_t *data, const uint32_t len) {
+	assert(flash != NULL);
+	assert(data != NULL);
+
+	uint32_t done = 0;
+	while (done < len) {
+		uint32_t chunk = MIN(len - done, flash->page_size - (addr + done) % flash->page_size);
+		if (flash_page_write(flash, addr + done, &(data[done]), chunk) != FLASH_PAGE_WRITE_OK) {
+			return FLASH_PROGRAM_FAILED;
+		}
+		done += chunk;
+	}
+
+	return FLASH_PROGRAM_OK;
+}
@@ -7,6 +7,27 @@
 #define FLASH_EMU_SECTOR_SIZE 8192
 #define FLASH_EMU_BLOCK_SIZE 65536
 
+/* Default timing of a generic SPI NOR flash clocked at 50 MHz. */
+#define FLASH_EMU_CMD_NS 1000
+#define FLASH_EMU_BYTE_NS 160
+#define FLASH_EMU_PAGE_PROGRAM_US 700
+#define FLASH_EMU_SECTOR_ERASE_US 60000
+#define FLASH_EMU_BLOCK_ERASE_US 200000
+#define FLASH_EMU_CHIP_ERASE_US 10000000
+
+
+/* Cost model of the emulated flash. Every transaction takes cmd_ns for the
+ * command and address phase and byte_ns for each byte transferred, program
+ * and erase operations add their own busy time. */
+struct flash_timing {
+	uint32_t cmd_ns;
+	uint32_t byte_ns;
+	uint32_t page_program_us;
+	uint32_t sector_erase_us;
+	uint32_t block_erase_us;
+	uint32_t chip_erase_us;
+};
+
 
 struct flash_dev {
 	uint32_t page_size;
@@ -15,6 +36,47 @@ struct flash_dev {
 	uint32_t size;
 
 	uint8_t *data;
+
+	/* descriptor of the mapped image file, -1 if data are in memory only */
+	int fd;
+
+	/* timing model and virtual time spent by all operations so far */
+	struct flash_timing timing;
+	uint64_t time_ns;
+
+	/* Strict mode asserts on programming of a bit from 0 to 1 and on a
+	 * program crossing the page boundary. Otherwise they behave like on
+	 * a real chip (the bit stays 0, the address wraps to the beginning of
+	 * the page) and they are only counted. */
+	uint32_t strict;
+	uint32_t bad_programs;
+	uint32_t page_wraps;
+
+	/* Power loss emulation. The program or erase following fail_after
+	 * successful ones is interrupted and all later ones fail without
+	 * changing the contents. 0 disables it. */
+	uint32_t fail_after;
+	uint32_t fail_ops;
+	uint32_t power_lost;
+
+	/* Asynchronous erase. The flash is split into banks of equal size, the
+	 * bank being erased is busy until the virtual time reaches busy_until_ns.
+	 * Other banks can be accessed meanwhile, access to the busy bank waits
+	 * for the erase to complete. The callback is called on completion. */
+	uint32_t banks;
+	uint32_t busy_bank;
+	uint64_t busy_until_ns;
+	void (*callback)(struct flash_dev *flash, void *ctx);
+	void *callback_ctx;
+};
+#define FLASH_BANK_NONE 0xffffffff
+
+
+/* One element of a scatter/gather read request. */
+struct flash_iovec {
+	uint32_t addr;
+	uint8_t *data;
+	uint32_t len;
 };
 
 
@@ -31,6 +93,26 @@ int32_t flash_init(struct flash_dev *flash, uint32_t size);
 #define FLASH_INIT_OK 0
 #define FLASH_INIT_FAILED -1
 
+int32_t flash_init_file(struct flash_dev *flash, const char *path, uint32_t size);
+#define FLASH_INIT_FILE_OK 0
+#define FLASH_INIT_FILE_FAILED -1
+
+int32_t flash_set_timing(struct flash_dev *flash, const struct flash_timing *timing);
+#define FLASH_SET_TIMING_OK 0
+#define FLASH_SET_TIMING_FAILED -1
+
+int32_t flash_set_power_fail(struct flash_dev *flash, uint32_t fail_after);
+#define FLASH_SET_POWER_FAIL_OK 0
+#define FLASH_SET_POWER_FAIL_FAILED -1
+
+int32_t flash_set_banks(struct flash_dev *flash, uint32_t banks);
+#define FLASH_SET_BANKS_OK 0
+#define FLASH_SET_BANKS_FAILED -1
+
+int32_t flash_set_callback(struct flash_dev *flash, void (*callback)(struct flash_dev *flash, void *ctx), void *ctx);
+#define FLASH_SET_CALLBACK_OK 0
+#define FLASH_SET_CALLBACK_FAILED -1
+
 int32_t flash_free(struct flash_dev *flash);
 #define FLASH_FREE_OK 0
 #define FLASH_FREE_FAILED -1
@@ -51,6 +133,14 @@ int32_t flash_sector_erase(struct flash_dev *flash, const uint32_t addr);
 #define FLASH_SECTOR_ERASE_OK 0
 #define FLASH_SECTOR_ERASE_FAILED -1
 
+int32_t flash_sector_erase_start(struct flash_dev *flash, const uint32_t addr);
+#define FLASH_SECTOR_ERASE_START_OK 0
+#define FLASH_SECTOR_ERASE_START_FAILED -1
+
+int32_t flash_poll(struct flash_dev *flash, const uint32_t addr);
+#define FLASH_POLL_IDLE 0
+#define FLASH_POLL_BUSY 1
+
 int32_t flash_page_write(struct flash_dev *flash, const uint32_t addr, const uint8_t *data, const uint32_t len);
 #define FLASH_PAGE_WRITE_OK 0
 #define FLASH_PAGE_WRITE_FAILED -1
@@ -59,5 +149,17 @@ int32_t flash_page_read(struct flash_dev *flash, const uint32_t addr, uint8_t *d
 #define FLASH_PAGE_READ_OK 0
 #define FLASH_PAGE_READ_FAILED -1
 
+int32_t flash_read(struct flash_dev *flash, const uint32_t addr, uint8_t *data, const uint32_t len);
+#define FLASH_READ_OK 0
+#define FLASH_READ_FAILED -1
+
+int32_t flash_readv(struct flash_dev *flash, const struct flash_iovec *iov, const uint32_t count);
+#define FLASH_READV_OK 0
+#define FLASH_READV_FAILED -1
+
+int32_t flash_program(struct flash_dev *flash, const uint32_t addr, const uint8_t *data, const uint32_t len);
+#define FLASH_PROGRAM_OK 0
+#define FLASH_PROGRAM_FAILED -1
+
 
 #endif
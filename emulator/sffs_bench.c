@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+
+
+#include "flash_emulator.h"
+#include "sffs.h"
+
+
+/* Fixed seed, results are comparable between runs. */
+#define BENCH_SEED 12345
+
+/* Record size of the append log and random overwrite workloads. */
+#define BENCH_RECORD_SIZE 64
+
+/* Files used by the small file churn workload. */
+#define BENCH_SMALL_FILES 64
+#define BENCH_SMALL_FILE_ID 1000
+
+/* Files created before the filesystem is remounted. */
+#define BENCH_FILL_FILES 32
+#define BENCH_FILL_FILE_ID 2000
+
+#define BENCH_LOG_FILE_ID 10
+#define BENCH_RECORDS_FILE_ID 20
+
+
+struct bench_result {
+	const char *name;
+	uint32_t ops;
+	uint64_t time_us;
+	uint64_t flash_time_ns;
+	struct sffs_stats stats;
+};
+
+
+static uint64_t bench_time_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void bench_fill(uint8_t *data, uint32_t len) {
+	for (uint32_t i = 0; i < len; i++) {
+		data[i] = rand() % 256;
+	}
+}
+
+
+static void bench_print(uint32_t size, struct bench_result *r) {
+	double ops_s = 0.0;
+	if (r->time_us > 0) {
+		ops_s = (double)r->ops * 1000000.0 / (double)r->time_us;
+	}
+	double flash_ops_s = 0.0;
+	if (r->flash_time_ns > 0) {
+		flash_ops_s = (double)r->ops * 1000000000.0 / (double)r->flash_time_ns;
+	}
+	double wa = 0.0;
+	if (r->stats.user_write_bytes > 0) {
+		wa = (double)r->stats.flash_program_bytes / (double)r->stats.user_write_bytes;
+	}
+
+	printf("%6u KiB %-12s ops = %7u, ops/s = %10.0f, flash ops/s = %8.1f, flash/user = %6.2f, programs = %8u, erases = %6u, gc moves = %7u, reads = %8u\n",
+		size / 1024, r->name, r->ops, ops_s, flash_ops_s, wa, r->stats.flash_programs, r->stats.flash_erases,
+		r->stats.gc_moves, r->stats.flash_reads);
+}
+
+
+static int32_t bench_setup(struct flash_dev *fl, struct sffs *fs, uint32_t size) {
+	srand(BENCH_SEED);
+
+	if (flash_init(fl, size) != FLASH_INIT_OK) {
+		return -1;
+	}
+	sffs_init(fs);
+	sffs_format(fs, fl);
+	if (sffs_mount(fs, fl) != SFFS_MOUNT_OK) {
+		flash_free(fl);
+		return -1;
+	}
+	sffs_stats_reset(fs);
+	fl->time_ns = 0;
+
+	return 0;
+}
+
+
+static void bench_teardown(struct flash_dev *fl, struct sffs *fs) {
+	sffs_free(fs);
+	flash_free(fl);
+}
+
+
+/* Append records to a single file until it occupies a half of the flash,
+ * the file is removed and the log started again. */
+static int32_t bench_append_log(struct sffs *fs, uint32_t size, struct bench_result *r) {
+	uint8_t rec[BENCH_RECORD_SIZE];
+	uint32_t ops = size / BENCH_RECORD_SIZE;
+	uint32_t log_size = 0;
+	struct sffs_file f;
+
+	r->name = "append-log";
+	uint64_t start = bench_time_us();
+
+	for (uint32_t i = 0; i < ops; i++) {
+		if (log_size >= size / 2) {
+			sffs_file_remove(fs, BENCH_LOG_FILE_ID);
+			log_size = 0;
+		}
+		bench_fill(rec, sizeof(rec));
+		if (sffs_open_id(fs, &f, BENCH_LOG_FILE_ID, SFFS_APPEND) != SFFS_OPEN_ID_OK) {
+			return -1;
+		}
+		if (sffs_write(&f, rec, sizeof(rec)) != sizeof(rec)) {
+			sffs_close(&f);
+			return -1;
+		}
+		sffs_close(&f);
+		log_size += sizeof(rec);
+	}
+
+	r->time_us = bench_time_us() - start;
+	r->ops = ops;
+	r->flash_time_ns = fs->flash->time_ns;
+	r->stats = fs->stats;
+
+	return 0;
+}
+
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+/* The same as the append log with records of a sensor log appended to a
+ * compressed file. Timestamps increase, values change slowly. */
+static int32_t bench_append_compressed(struct sffs *fs, uint32_t size, struct bench_result *r) {
+	uint8_t rec[BENCH_RECORD_SIZE];
+	uint32_t ops = size / BENCH_RECORD_SIZE;
+	uint32_t log_size = 0;
+	struct sffs_file f;
+
+	r->name = "append-comp";
+	uint64_t start = bench_time_us();
+
+	memset(rec, 0, sizeof(rec));
+	for (uint32_t i = 0; i < ops; i++) {
+		if (log_size >= size / 2) {
+			sffs_file_remove(fs, BENCH_LOG_FILE_ID);
+			log_size = 0;
+		}
+		uint32_t t = i * 100;
+		memcpy(rec, &t, sizeof(t));
+		for (uint32_t j = sizeof(t); j < sizeof(rec); j += 4) {
+			rec[j] = rand() % 4;
+		}
+		if (sffs_open_id(fs, &f, BENCH_LOG_FILE_ID, SFFS_APPEND | SFFS_COMPRESS) != SFFS_OPEN_ID_OK) {
+			return -1;
+		}
+		if (sffs_write(&f, rec, sizeof(rec)) != sizeof(rec)) {
+			sffs_close(&f);
+			return -1;
+		}
+		sffs_close(&f);
+		log_size += sizeof(rec);
+	}
+
+	r->time_us = bench_time_us() - start;
+	r->ops = ops;
+	r->flash_time_ns = fs->flash->time_ns;
+	r->stats = fs->stats;
+
+	return 0;
+}
+#endif
+
+
+/* Overwrite records at random positions of a file filling a quarter of the
+ * flash. Each record is flushed separately. */
+static int32_t bench_random_overwrite(struct sffs *fs, uint32_t size, struct bench_result *r) {
+	uint8_t rec[BENCH_RECORD_SIZE];
+	uint32_t records = size / 4 / BENCH_RECORD_SIZE;
+	uint32_t ops = size / BENCH_RECORD_SIZE;
+	struct sffs_file f;
+
+	r->name = "rand-over";
+	if (sffs_open_id(fs, &f, BENCH_RECORDS_FILE_ID, SFFS_OVERWRITE) != SFFS_OPEN_ID_OK) {
+		return -1;
+	}
+	for (uint32_t i = 0; i < records; i++) {
+		bench_fill(rec, sizeof(rec));
+		sffs_write(&f, rec, sizeof(rec));
+	}
+	sffs_flush(&f);
+	sffs_stats_reset(fs);
+	fs->flash->time_ns = 0;
+
+	uint64_t start = bench_time_us();
+
+	for (uint32_t i = 0; i < ops; i++) {
+		bench_fill(rec, sizeof(rec));
+		if (sffs_seek(&f, (rand() % records) * BENCH_RECORD_SIZE) != SFFS_SEEK_OK) {
+			sffs_close(&f);
+			return -1;
+		}
+		if (sffs_write(&f, rec, sizeof(rec)) != sizeof(rec) || sffs_flush(&f) != SFFS_FLUSH_OK) {
+			sffs_close(&f);
+			return -1;
+		}
+	}
+	sffs_close(&f);
+
+	r->time_us = bench_time_us() - start;
+	r->ops = ops;
+	r->flash_time_ns = fs->flash->time_ns;
+	r->stats = fs->stats;
+
+	return 0;
+}
+
+
+/* Create, read back and remove small files of random size. */
+static int32_t bench_small_files(struct sffs *fs, uint32_t size, struct bench_result *r) {
+	uint8_t data[512];
+	uint32_t lens[BENCH_SMALL_FILES] = {0};
+	uint32_t ops = size / 256;
+	struct sffs_file f;
+
+	r->name = "small-files";
+	uint64_t start = bench_time_us();
+
+	for (uint32_t i = 0; i < ops; i++) {
+		uint32_t n = rand() % BENCH_SMALL_FILES;
+		uint32_t id = BENCH_SMALL_FILE_ID + n;
+
+		if (lens[n] == 0) {
+			lens[n] = rand() % sizeof(data) + 1;
+			bench_fill(data, lens[n]);
+			if (sffs_open_id(fs, &f, id, SFFS_OVERWRITE) != SFFS_OPEN_ID_OK) {
+				return -1;
+			}
+			if (sffs_write(&f, data, lens[n]) != (int32_t)lens[n]) {
+				sffs_close(&f);
+				return -1;
+			}
+			sffs_close(&f);
+		} else if (rand() % 2) {
+			if (sffs_open_id(fs, &f, id, SFFS_READ) != SFFS_OPEN_ID_OK) {
+				return -1;
+			}
+			if (sffs_read(&f, data, lens[n]) != (int32_t)lens[n]) {
+				sffs_close(&f);
+				return -1;
+			}
+			sffs_close(&f);
+		} else {
+			if (sffs_file_remove(fs, id) != SFFS_FILE_REMOVE_OK) {
+				return -1;
+			}
+			lens[n] = 0;
+		}
+	}
+
+	r->time_us = bench_time_us() - start;
+	r->ops = ops;
+	r->flash_time_ns = fs->flash->time_ns;
+	r->stats = fs->stats;
+
+	return 0;
+}
+
+
+/* Fill a half of the flash with files and rewrite them once to leave old
+ * pages behind. */
+static int32_t bench_fill_files(struct sffs *fs, uint32_t size) {
+	uint32_t len = size / 2 / BENCH_FILL_FILES;
+	uint8_t *data = malloc(len);
+	struct sffs_file f;
+
+	if (data == NULL) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < BENCH_FILL_FILES * 2; i++) {
+		bench_fill(data, len);
+		if (sffs_open_id(fs, &f, BENCH_FILL_FILE_ID + i % BENCH_FILL_FILES, SFFS_OVERWRITE) != SFFS_OPEN_ID_OK) {
+			free(data);
+			return -1;
+		}
+		sffs_write(&f, data, len);
+		sffs_close(&f);
+	}
+	free(data);
+
+	return 0;
+}
+
+
+/* Measure the time and reads needed to mount the flash. */
+static int32_t bench_mount(struct sffs *fs, struct flash_dev *fl, struct bench_result *r) {
+	r->name = "mount";
+	sffs_init(fs);
+	fl->time_ns = 0;
+	uint64_t start = bench_time_us();
+	if (sffs_mount(fs, fl) != SFFS_MOUNT_OK) {
+		return -1;
+	}
+	r->time_us = bench_time_us() - start;
+	r->flash_time_ns = fl->time_ns;
+	r->ops = 1;
+	r->stats = fs->stats;
+
+	printf("%6u KiB mount        time = %llu us, flash time = %llu us, sectors valid = %u, restored = %u, reads = %u, read bytes = %u\n",
+		fl->size / 1024, (unsigned long long)r->time_us, (unsigned long long)(r->flash_time_ns / 1000), fs->mount_info.sectors_valid,
+		fs->mount_info.sectors_restored, fs->mount_info.flash_reads, fs->mount_info.flash_read_bytes);
+
+	return 0;
+}
+
+
+static int32_t bench_run(uint32_t size) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct bench_result r;
+	int32_t ret = 0;
+
+	int32_t (*workloads[])(struct sffs *fs, uint32_t size, struct bench_result *r) = {
+		bench_append_log,
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+		bench_append_compressed,
+#endif
+		bench_random_overwrite,
+		bench_small_files,
+	};
+
+	for (uint32_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (bench_setup(&fl, &fs, size) != 0) {
+			printf("%6u KiB cannot mount\n", size / 1024);
+			return -1;
+		}
+		memset(&r, 0, sizeof(r));
+		if (workloads[i](&fs, size, &r) == 0) {
+			bench_print(size, &r);
+		} else {
+			printf("%6u KiB %-12s failed\n", size / 1024, r.name);
+			ret = -1;
+		}
+		bench_teardown(&fl, &fs);
+	}
+
+	if (bench_setup(&fl, &fs, size) != 0) {
+		printf("%6u KiB cannot mount\n", size / 1024);
+		return -1;
+	}
+	memset(&r, 0, sizeof(r));
+	if (bench_fill_files(&fs, size) != 0) {
+		printf("%6u KiB fill         failed\n", size / 1024);
+		bench_teardown(&fl, &fs);
+		return -1;
+	}
+	sffs_free(&fs);
+	if (bench_mount(&fs, &fl, &r) != 0) {
+		printf("%6u KiB mount        failed\n", size / 1024);
+		flash_free(&fl);
+		return -1;
+	}
+	bench_teardown(&fl, &fs);
+
+	return ret;
+}
+
+
+/* Format and fill a persistent image to be mounted by a later run. */
+static int32_t bench_image_fill(const char *path, uint32_t size) {
+	struct flash_dev fl;
+	struct sffs fs;
+
+	srand(BENCH_SEED);
+	if (flash_init_file(&fl, path, size) != FLASH_INIT_FILE_OK) {
+		printf("cannot open image %s\n", path);
+		return -1;
+	}
+	sffs_init(&fs);
+	sffs_format(&fs, &fl);
+	if (sffs_mount(&fs, &fl) != SFFS_MOUNT_OK || bench_fill_files(&fs, size) != 0) {
+		printf("cannot fill image %s\n", path);
+		bench_teardown(&fl, &fs);
+		return -1;
+	}
+	bench_teardown(&fl, &fs);
+
+	return 0;
+}
+
+
+/* Cold mount of an existing image, eg. created by bench_image_fill or
+ * captured from a device. */
+static int32_t bench_image_mount(const char *path) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct bench_result r;
+
+	if (flash_init_file(&fl, path, 0) != FLASH_INIT_FILE_OK) {
+		printf("cannot open image %s\n", path);
+		return -1;
+	}
+	memset(&r, 0, sizeof(r));
+	if (bench_mount(&fs, &fl, &r) != 0) {
+		printf("cannot mount image %s\n", path);
+		flash_free(&fl);
+		return -1;
+	}
+	bench_teardown(&fl, &fs);
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	uint32_t sizes[] = {256, 1024, 4096};
+	int ret = 0;
+
+	/* sffs_bench -f image size_kb, sffs_bench -m image */
+	if (argc == 4 && strcmp(argv[1], "-f") == 0) {
+		return bench_image_fill(argv[2], strtoul(argv[3], NULL, 10) * 1024) != 0;
+	}
+	if (argc == 3 && strcmp(argv[1], "-m") == 0) {
+		return bench_image_mount(argv[2]) != 0;
+	}
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			if (bench_run(strtoul(argv[i], NULL, 10) * 1024) != 0) {
+				ret = 1;
+			}
+		}
+	} else {
+		for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			if (bench_run(sizes[i] * 1024) != 0) {
+				ret = 1;
+			}
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,329 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+
+
+#include "flash_emulator.h"
+#include "sffs.h"
+
+
+/* Power loss test. A filesystem is aged by a seeded workload and a snapshot
+ * of the flash is taken. For every N the snapshot is restored, the workload
+ * continues until the power is lost after N program/erase operations, the
+ * flash is remounted and all files are verified. Each file fits a single
+ * block, therefore it must contain either the last completed version or the
+ * version being written when the power was lost. SFFS_OVERWRITE removes the
+ * old file first, the interrupted file may be missing too. */
+
+#define PF_SEED 4321
+#define PF_FILES 24
+#define PF_FILE_ID 100
+#define PF_MAX_LEN FLASH_EMU_PAGE_SIZE
+
+/* Operations run to age the filesystem before the snapshot is taken. */
+#define PF_AGE_OPS 2000
+
+/* Operations run with power loss armed and after every recovery. */
+#define PF_TEST_OPS 300
+#define PF_AFTER_OPS 50
+
+/* A checkpoint is written every PF_CHECKPOINT_OPS operations if the block
+ * index is enabled. */
+#define PF_CHECKPOINT_OPS 64
+
+
+struct pf_model {
+	/* committed version of every file, 0 if the file doesn't exist */
+	uint32_t version[PF_FILES];
+	uint32_t next_version;
+
+	/* file changed by the interrupted operation and its new version */
+	uint32_t pending_file;
+	uint32_t pending_version;
+};
+
+
+struct pf_result {
+	uint32_t runs;
+	uint32_t failed;
+	uint32_t pages_recovered;
+	uint32_t max_recovered;
+	uint32_t sectors_formatted;
+	uint64_t flash_time_ns;
+	uint64_t max_flash_time_ns;
+	uint64_t time_us;
+	uint64_t max_time_us;
+};
+
+
+static uint64_t pf_time_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Contents of a file version are generated from its number. */
+static uint32_t pf_generate(uint32_t version, uint8_t *data) {
+	uint32_t x = version * 2654435761u;
+	uint32_t len = version % PF_MAX_LEN + 1;
+
+	for (uint32_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+
+	return len;
+}
+
+
+/* Run one operation of the workload, file is rewritten or removed. Returns 0
+ * on success or -1 if the filesystem returned an error. */
+static int32_t pf_step(struct sffs *fs, struct pf_model *m, uint32_t step) {
+	uint32_t n = rand() % PF_FILES;
+	uint8_t data[PF_MAX_LEN];
+	struct sffs_file f;
+
+#if SFFS_INDEX_SIZE > 0
+	if ((step % PF_CHECKPOINT_OPS) == 0) {
+		m->pending_file = PF_FILES;
+		if (sffs_checkpoint(fs) != SFFS_CHECKPOINT_OK) {
+			return -1;
+		}
+	}
+#else
+	(void)step;
+#endif
+
+	m->pending_file = n;
+	if (m->version[n] != 0 && (rand() % 8) == 0) {
+		m->pending_version = 0;
+		if (sffs_file_remove(fs, PF_FILE_ID + n) != SFFS_FILE_REMOVE_OK) {
+			return -1;
+		}
+	} else {
+		m->pending_version = ++m->next_version;
+		uint32_t len = pf_generate(m->pending_version, data);
+		if (sffs_open_id(fs, &f, PF_FILE_ID + n, SFFS_OVERWRITE) != SFFS_OPEN_ID_OK) {
+			return -1;
+		}
+		if (sffs_write(&f, data, len) != (int32_t)len) {
+			sffs_close(&f);
+			return -1;
+		}
+		if (sffs_close(&f) != SFFS_CLOSE_OK) {
+			return -1;
+		}
+	}
+	/* some errors are not reported, the operation is not completed if the
+	 * power was lost during it */
+	if (fs->flash->power_lost) {
+		return -1;
+	}
+	m->version[n] = m->pending_version;
+	m->pending_file = PF_FILES;
+
+	return 0;
+}
+
+
+/* Check that a file contains the given version. */
+static int32_t pf_check_file(struct sffs *fs, uint32_t n, uint32_t version) {
+	uint8_t expected[PF_MAX_LEN];
+	uint8_t data[PF_MAX_LEN + 1];
+	struct sffs_file f;
+	uint32_t size;
+
+	if (version == 0) {
+		return (sffs_file_size(fs, PF_FILE_ID + n, &size) == SFFS_FILE_SIZE_OK && size == 0) ? 0 : -1;
+	}
+
+	uint32_t len = pf_generate(version, expected);
+	if (sffs_open_id(fs, &f, PF_FILE_ID + n, SFFS_READ) != SFFS_OPEN_ID_OK) {
+		return -1;
+	}
+	int32_t r = sffs_read(&f, data, sizeof(data));
+	sffs_close(&f);
+	if (r != (int32_t)len || memcmp(data, expected, len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Verify all files after a remount. The interrupted operation may or may not
+ * have been completed, the model is updated accordingly. */
+static int32_t pf_verify(struct sffs *fs, struct pf_model *m) {
+	for (uint32_t n = 0; n < PF_FILES; n++) {
+		if (pf_check_file(fs, n, m->version[n]) == 0) {
+			continue;
+		}
+		if (n == m->pending_file && pf_check_file(fs, n, m->pending_version) == 0) {
+			m->version[n] = m->pending_version;
+			continue;
+		}
+		if (n == m->pending_file && pf_check_file(fs, n, 0) == 0) {
+			m->version[n] = 0;
+			continue;
+		}
+		printf("file %u does not match version %u\n", n, m->version[n]);
+		return -1;
+	}
+	m->pending_file = PF_FILES;
+
+	return 0;
+}
+
+
+/* Single run with power lost after fail_after operations. Returns 1 if the
+ * workload completed without losing power, 0 if the recovery succeeded or -1
+ * on failure. */
+static int32_t pf_run(struct flash_dev *fl, const uint8_t *snapshot, const struct pf_model *aged, uint32_t fail_after, struct pf_result *res) {
+	struct sffs fs;
+	struct pf_model m = *aged;
+
+	memcpy(fl->data, snapshot, fl->size);
+	srand(PF_SEED + 1);
+
+	sffs_init(&fs);
+	if (sffs_mount(&fs, fl) != SFFS_MOUNT_OK) {
+		printf("N = %u: cannot mount the snapshot\n", fail_after);
+		return -1;
+	}
+	flash_set_power_fail(fl, fail_after);
+	for (uint32_t i = 0; i < PF_TEST_OPS && !fl->power_lost; i++) {
+		if (pf_step(&fs, &m, i) != 0 && !fl->power_lost) {
+			printf("N = %u: operation failed before the power loss\n", fail_after);
+			return -1;
+		}
+	}
+	if (!fl->power_lost) {
+		flash_set_power_fail(fl, 0);
+		return 1;
+	}
+	flash_set_power_fail(fl, 0);
+
+	/* Recovery is measured on the mount following the power loss. */
+	sffs_init(&fs);
+	fl->time_ns = 0;
+	uint64_t start = pf_time_us();
+	if (sffs_mount(&fs, fl) != SFFS_MOUNT_OK) {
+		printf("N = %u: cannot mount after the power loss\n", fail_after);
+		return -1;
+	}
+	uint64_t time_us = pf_time_us() - start;
+
+	res->runs++;
+	res->pages_recovered += fs.mount_info.pages_recovered;
+	res->sectors_formatted += fs.mount_info.sectors_formatted;
+	res->flash_time_ns += fl->time_ns;
+	res->time_us += time_us;
+	if (fs.mount_info.pages_recovered > res->max_recovered) {
+		res->max_recovered = fs.mount_info.pages_recovered;
+	}
+	if (fl->time_ns > res->max_flash_time_ns) {
+		res->max_flash_time_ns = fl->time_ns;
+	}
+	if (time_us > res->max_time_us) {
+		res->max_time_us = time_us;
+	}
+
+	if (pf_verify(&fs, &m) != 0) {
+		printf("N = %u: data lost after the power loss\n", fail_after);
+		return -1;
+	}
+
+	/* The filesystem must stay usable. */
+	for (uint32_t i = 0; i < PF_AFTER_OPS; i++) {
+		if (pf_step(&fs, &m, i + 1) != 0) {
+			printf("N = %u: operation failed after the recovery\n", fail_after);
+			return -1;
+		}
+	}
+	if (pf_verify(&fs, &m) != 0) {
+		printf("N = %u: data lost after the recovery\n", fail_after);
+		return -1;
+	}
+	sffs_free(&fs);
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	uint32_t size = 256;
+	uint32_t step = 1;
+
+	/* sffs_powerfail [size_kb [step]] */
+	if (argc > 1) {
+		size = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		step = strtoul(argv[2], NULL, 10);
+	}
+	if (size == 0 || step == 0) {
+		printf("usage: %s [size_kb [step]]\n", argv[0]);
+		return 1;
+	}
+
+	struct flash_dev fl;
+	struct sffs fs;
+	struct pf_model aged;
+	memset(&aged, 0, sizeof(aged));
+	aged.pending_file = PF_FILES;
+
+	if (flash_init(&fl, size * 1024) != FLASH_INIT_OK) {
+		return 1;
+	}
+	sffs_init(&fs);
+	sffs_format(&fs, &fl);
+	if (sffs_mount(&fs, &fl) != SFFS_MOUNT_OK) {
+		printf("cannot mount\n");
+		return 1;
+	}
+	srand(PF_SEED);
+	for (uint32_t i = 0; i < PF_AGE_OPS; i++) {
+		if (pf_step(&fs, &aged, i) != 0) {
+			printf("aging failed\n");
+			return 1;
+		}
+	}
+	sffs_free(&fs);
+
+	uint8_t *snapshot = malloc(fl.size);
+	if (snapshot == NULL) {
+		return 1;
+	}
+	memcpy(snapshot, fl.data, fl.size);
+
+	struct pf_result res;
+	memset(&res, 0, sizeof(res));
+	for (uint32_t n = 1; ; n += step) {
+		int32_t r = pf_run(&fl, snapshot, &aged, n, &res);
+		if (r < 0) {
+			res.failed++;
+		}
+		if (r > 0) {
+			break;
+		}
+	}
+
+	printf("runs = %u, failed = %u, pages recovered = %u (max %u), sectors formatted = %u\n",
+		res.runs, res.failed, res.pages_recovered, res.max_recovered, res.sectors_formatted);
+	if (res.runs > 0) {
+		printf("recovery mount: avg %llu us, max %llu us flash time; avg %llu us, max %llu us host time\n",
+			(unsigned long long)(res.flash_time_ns / res.runs / 1000), (unsigned long long)(res.max_flash_time_ns / 1000),
+			(unsigned long long)(res.time_us / res.runs), (unsigned long long)res.max_time_us);
+	}
+
+	free(snapshot);
+	flash_free(&fl);
+
+	return (res.failed > 0) ? 1 : 0;
+}
@@ -154,8 +154,8 @@ int main(int argc, char *argv[]) {
 	
 	flash_init(&fl, 1024 * 1024);
 	//~ flash_chip_erase(&fl);
-	sffs_format(&fl);
 	sffs_init(&fs);
+	sffs_format(&fs, &fl);
 	sffs_mount(&fs, &fl);
 	//~ sffs_debug_print(&fs);
 	
@@ -0,0 +1,1042 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#include "flash_emulator.h"
+#include "sffs.h"
+
+
+/* Focused tests of the public API. Every test formats its own flash, checks
+ * exact contents and sizes of the files and verifies them again after the
+ * flash is remounted. The program stops on the first failed check. */
+
+#define TEST_FLASH_SIZE (256 * 1024)
+#define TEST_FILE_ID 100
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+
+/* Arena used by tests which configure runtime structures themselves. */
+static uint64_t test_arena[64 * 1024 / sizeof(uint64_t)];
+
+static uint8_t test_data[64 * 1024];
+static uint8_t test_buf[64 * 1024];
+
+int tests_run = 0;
+
+
+static void fill_random(uint8_t *data, uint32_t len) {
+	for (uint32_t i = 0; i < len; i++) {
+		data[i] = rand() % 256;
+	}
+}
+
+
+static void init_arena(struct sffs *fs, uint32_t page_size) {
+	struct sffs_config config = {
+		.index_size = 1024,
+		.file_table_size = 64,
+		.cache_pages = 8,
+		.page_size = page_size,
+		.directory_size = 64,
+	};
+
+	CHECK(sffs_ram_size(&config) <= sizeof(test_arena));
+	CHECK(sffs_init_arena(fs, test_arena, sizeof(test_arena), &config) == SFFS_INIT_ARENA_OK);
+}
+
+
+static void mount_arena(struct sffs *fs, struct flash_dev *fl, uint32_t page_size) {
+	init_arena(fs, page_size);
+	CHECK(sffs_mount(fs, fl) == SFFS_MOUNT_OK);
+}
+
+
+/* Use static storage if it is available, the arena otherwise. */
+static void init(struct sffs *fs) {
+#if SFFS_STATIC_STORAGE
+	CHECK(sffs_init(fs) == SFFS_INIT_OK);
+#else
+	CHECK(sffs_init(fs) == SFFS_INIT_FAILED);
+	init_arena(fs, FLASH_EMU_PAGE_SIZE);
+#endif
+}
+
+
+static void mount(struct sffs *fs, struct flash_dev *fl) {
+	init(fs);
+	CHECK(sffs_mount(fs, fl) == SFFS_MOUNT_OK);
+}
+
+
+/* Write the file in chunks of random length. */
+static void write_file(struct sffs *fs, uint32_t file_id, uint32_t mode, const uint8_t *data, uint32_t len) {
+	struct sffs_file f;
+
+	CHECK(sffs_open_id(fs, &f, file_id, mode) == SFFS_OPEN_ID_OK);
+	while (len > 0) {
+		uint32_t chunk = rand() % 300 + 1;
+		if (chunk > len) {
+			chunk = len;
+		}
+		CHECK(sffs_write(&f, (unsigned char *)data, chunk) == (int32_t)chunk);
+		data += chunk;
+		len -= chunk;
+	}
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+}
+
+
+/* Read the whole file and compare it with the expected contents. */
+static void verify_file(struct sffs *fs, uint32_t file_id, const uint8_t *data, uint32_t len) {
+	struct sffs_file f;
+	uint32_t size;
+
+	CHECK(sffs_file_size(fs, file_id, &size) == SFFS_FILE_SIZE_OK);
+	CHECK(size == len);
+
+	CHECK(sffs_open_id(fs, &f, file_id, SFFS_READ) == SFFS_OPEN_ID_OK);
+	uint32_t pos = 0;
+	int32_t r;
+	while ((r = sffs_read(&f, test_buf + pos, rand() % 300 + 1)) > 0) {
+		pos += r;
+		CHECK(pos <= len);
+	}
+	CHECK(r == 0);
+	CHECK(pos == len);
+	CHECK(memcmp(test_buf, data, len) == 0);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+}
+
+
+/* Vectored read returns the same data as separate reads and it is charged
+ * a single command overhead. */
+static void test_flash_readv(void) {
+	struct flash_dev fl;
+	uint8_t a[100], b[300], c[10];
+	uint8_t ra[100], rb[300], rc[10];
+	struct flash_iovec iov[] = {
+		{ .addr = 1000, .data = a, .len = sizeof(a) },
+		{ .addr = 5000, .data = b, .len = sizeof(b) },
+		{ .addr = 70000, .data = c, .len = sizeof(c) },
+	};
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	fill_random(test_data, TEST_FLASH_SIZE / 4);
+	CHECK(flash_program(&fl, 0, test_data, TEST_FLASH_SIZE / 4) == FLASH_PROGRAM_OK);
+
+	uint64_t start = fl.time_ns;
+	CHECK(flash_read(&fl, 1000, ra, sizeof(ra)) == FLASH_READ_OK);
+	CHECK(flash_read(&fl, 5000, rb, sizeof(rb)) == FLASH_READ_OK);
+	CHECK(flash_read(&fl, 70000, rc, sizeof(rc)) == FLASH_READ_OK);
+	uint64_t separate = fl.time_ns - start;
+
+	start = fl.time_ns;
+	CHECK(flash_readv(&fl, iov, 3) == FLASH_READV_OK);
+	uint64_t vectored = fl.time_ns - start;
+
+	CHECK(memcmp(a, ra, sizeof(a)) == 0 && memcmp(a, &test_data[1000], sizeof(a)) == 0);
+	CHECK(memcmp(b, rb, sizeof(b)) == 0 && memcmp(b, &test_data[5000], sizeof(b)) == 0);
+	CHECK(memcmp(c, rc, sizeof(c)) == 0);
+	CHECK(vectored == fl.timing.cmd_ns + (sizeof(a) + sizeof(b) + sizeof(c)) * fl.timing.byte_ns);
+	CHECK(separate == vectored + 2 * fl.timing.cmd_ns);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Write-through crossing a page boundary updates both cached pages. */
+static void test_cached_write(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	uint8_t data[20];
+	uint8_t buf[2 * FLASH_EMU_PAGE_SIZE];
+	uint8_t expected[2 * FLASH_EMU_PAGE_SIZE];
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+
+	/* last two pages of the flash are erased, load them to the cache in
+	 * reverse order so their cached copies are not adjacent */
+	uint32_t addr = TEST_FLASH_SIZE - sizeof(buf);
+	CHECK(sffs_cached_read(&fs, addr + FLASH_EMU_PAGE_SIZE, buf, FLASH_EMU_PAGE_SIZE) == SFFS_CACHED_READ_OK);
+	CHECK(sffs_cached_read(&fs, addr, buf, FLASH_EMU_PAGE_SIZE) == SFFS_CACHED_READ_OK);
+
+	fill_random(data, sizeof(data));
+	uint32_t offset = FLASH_EMU_PAGE_SIZE - sizeof(data) / 2;
+	CHECK(sffs_cached_write(&fs, addr + offset, data, sizeof(data)) == SFFS_CACHED_WRITE_OK);
+
+	memset(expected, 0xff, sizeof(expected));
+	memcpy(&expected[offset], data, sizeof(data));
+	CHECK(flash_read(&fl, addr, buf, sizeof(buf)) == FLASH_READ_OK);
+	CHECK(memcmp(buf, expected, sizeof(buf)) == 0);
+	uint32_t hits = fs.stats.cache_hits;
+	CHECK(sffs_cached_read(&fs, addr, buf, sizeof(buf)) == SFFS_CACHED_READ_OK);
+	CHECK(memcmp(buf, expected, sizeof(buf)) == 0);
+#if SFFS_CACHE_PAGES > 0
+	CHECK(fs.stats.cache_hits == hits + 2);
+#else
+	(void)hits;
+#endif
+
+	sffs_free(&fs);
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Data of a log file, lines with a few varying fields compress well. */
+static void fill_log(uint8_t *data, uint32_t len) {
+	uint32_t pos = 0;
+	uint32_t line = 0;
+	while (pos < len) {
+		char buf[80];
+		int n = sprintf(buf, "%08u sensor %u temperature %d.%u C status ok\n", line * 1000, line % 4, 20 + rand() % 5, rand() % 10);
+		for (int i = 0; i < n && pos < len; i++) {
+			data[pos++] = buf[i];
+		}
+		line++;
+	}
+}
+
+
+/* Count pages of the file allocated on the flash. */
+static uint32_t file_pages(struct sffs *fs, uint32_t file_id) {
+	uint32_t pages = 0;
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		if (fs->sectors[sector].state == 0) {
+			continue;
+		}
+		for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
+			struct sffs_metadata_item item;
+			CHECK(sffs_get_page_metadata(fs, &(struct sffs_page){ .sector = sector, .page = i }, &item) == SFFS_GET_PAGE_METADATA_OK);
+			if (item.file_id == file_id && item.state == SFFS_PAGE_STATE_USED) {
+				pages++;
+			}
+		}
+	}
+
+	return pages;
+}
+
+
+/* Logical pages of two flash pages are read through the cache. */
+static void test_logical_page_cache(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	uint32_t len = 5000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init_arena(&fs, 2 * FLASH_EMU_PAGE_SIZE);
+	CHECK(sffs_format_geometry(&fs, &fl, "x", 1) == SFFS_FORMAT_OK);
+	mount_arena(&fs, &fl, 2 * FLASH_EMU_PAGE_SIZE);
+	CHECK(fs.page_size == 2 * FLASH_EMU_PAGE_SIZE);
+#if SFFS_CACHE_PAGES > 0
+	CHECK(fs.cache_enabled);
+#endif
+
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+#if SFFS_CACHE_PAGES > 0
+	CHECK(fs.stats.cache_hits > 0);
+#endif
+	sffs_free(&fs);
+
+	mount_arena(&fs, &fl, 2 * FLASH_EMU_PAGE_SIZE);
+#if SFFS_CACHE_PAGES > 0
+	CHECK(fs.cache_enabled);
+#endif
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Arena is checked and all runtime state is allocated from it. */
+static void test_init_arena(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	uint32_t len = 3000;
+	struct sffs_config config = {
+		.index_size = 1024,
+		.file_table_size = 64,
+		.cache_pages = 8,
+		.page_size = FLASH_EMU_PAGE_SIZE,
+		.directory_size = 64,
+	};
+	uint32_t size = sffs_ram_size(&config);
+
+	CHECK(size > 0 && size <= sizeof(test_arena));
+	CHECK(sffs_init_arena(&fs, test_arena, size - 1, &config) == SFFS_INIT_ARENA_FAILED);
+	CHECK(sffs_init_arena(&fs, (uint8_t *)test_arena + 1, size, &config) == SFFS_INIT_ARENA_FAILED);
+	config.index_size = 1000;
+	CHECK(sffs_init_arena(&fs, test_arena, size, &config) == SFFS_INIT_ARENA_FAILED);
+	config.index_size = 1024;
+
+	/* the arena is used exactly */
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	memset(test_arena, 0x5a, sizeof(test_arena));
+	CHECK(sffs_init_arena(&fs, test_arena, size, &config) == SFFS_INIT_ARENA_OK);
+	CHECK(sffs_mount(&fs, &fl) == SFFS_MOUNT_OK);
+#if SFFS_CACHE_PAGES > 0
+	CHECK(fs.cache_enabled);
+#endif
+
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	for (uint32_t i = size; i < sizeof(test_arena); i++) {
+		CHECK(((uint8_t *)test_arena)[i] == 0x5a);
+	}
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Labels are padded with zeroes, full length labels are not terminated. */
+static void test_label(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format_label(&fs, &fl, "abc") == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	CHECK(memcmp(fs.label, "abc\0\0\0\0\0", SFFS_LABEL_SIZE) == 0);
+	sffs_free(&fs);
+
+	init(&fs);
+	CHECK(sffs_format_label(&fs, &fl, "0123456789") == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	CHECK(memcmp(fs.label, "01234567", SFFS_LABEL_SIZE) == 0);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Master, checkpoint and directory files cannot be modified. */
+static void test_reserved_ids(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	uint32_t reserved[] = {0, SFFS_DIRECTORY_FILE_ID, SFFS_CHECKPOINT_FILE_ID};
+	uint32_t len = 1000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+	/* the checkpoint is written only if the block index is enabled */
+	int32_t checkpoint = sffs_checkpoint(&fs);
+
+	for (uint32_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+		CHECK(sffs_file_remove(&fs, reserved[i]) == SFFS_FILE_REMOVE_FAILED);
+		CHECK(sffs_open_id(&fs, &f, reserved[i], SFFS_OVERWRITE) == SFFS_OPEN_ID_FAILED);
+		CHECK(sffs_open_id(&fs, &f, reserved[i], SFFS_APPEND) == SFFS_OPEN_ID_FAILED);
+	}
+
+	/* nothing is removed if any of the IDs is reserved */
+	uint32_t ids[] = {TEST_FILE_ID, SFFS_CHECKPOINT_FILE_ID};
+	CHECK(sffs_remove_many(&fs, ids, 2) == SFFS_REMOVE_MANY_FAILED);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	CHECK(checkpoint != SFFS_CHECKPOINT_OK || fs.mount_info.sectors_restored > 0);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Sector with failed metadata program is not used until it is formatted
+ * again during mount. */
+static void test_sector_format_failure(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	uint32_t len = 2000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	CHECK(flash_set_power_fail(&fl, 1) == FLASH_SET_POWER_FAIL_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_FAILED);
+	CHECK(flash_set_power_fail(&fl, 0) == FLASH_SET_POWER_FAIL_OK);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+
+	mount(&fs, &fl);
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+
+	uint32_t sector = fs.sector_count - 1;
+	while (fs.sectors[sector].used > 0) {
+		sector--;
+	}
+	uint32_t free_pages = fs.free_pages;
+
+	/* the erase completes, the metadata program is interrupted */
+	CHECK(flash_set_power_fail(&fl, 1) == FLASH_SET_POWER_FAIL_OK);
+	CHECK(sffs_sector_format(&fs, sector) == SFFS_SECTOR_FORMAT_FAILED);
+	CHECK(flash_set_power_fail(&fl, 0) == FLASH_SET_POWER_FAIL_OK);
+	CHECK(fs.sectors[sector].state == 0);
+	CHECK(fs.free_pages == free_pages - fs.data_pages_per_sector);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	CHECK(fs.mount_info.sectors_formatted == 1);
+	CHECK(fs.sectors[sector].state == SFFS_SECTOR_STATE_ERASED);
+	CHECK(fs.free_pages == free_pages);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Read a range of an opened file and compare it with the expected data. */
+static void check_read(struct sffs_file *f, const uint8_t *data, uint32_t len) {
+	uint8_t buf[512];
+
+	CHECK(len <= sizeof(buf));
+	uint32_t pos = 0;
+	while (pos < len) {
+		int32_t r = sffs_read(f, buf + pos, len - pos);
+		CHECK(r > 0);
+		pos += r;
+	}
+	CHECK(memcmp(buf, data, len) == 0);
+}
+
+
+/* Absolute and relative seeks within a file, writes after a seek. */
+static void test_seek(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	uint8_t patch[150];
+	uint32_t len = 2000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_seek(&f, 700) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[700], 100);
+	CHECK(sffs_seek_from(&f, -50, SFFS_SEEK_CUR) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[750], 300);
+	CHECK(sffs_seek_from(&f, -10, SFFS_SEEK_END) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[len - 10], 10);
+	CHECK(sffs_read(&f, patch, sizeof(patch)) == 0);
+	CHECK(sffs_seek_from(&f, 3, SFFS_SEEK_SET) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[3], 1);
+
+	/* the position cannot leave the file, it is not changed then */
+	CHECK(sffs_seek(&f, len + 1) == SFFS_SEEK_FAILED);
+	CHECK(sffs_seek_from(&f, 1, SFFS_SEEK_END) == SFFS_SEEK_FAILED);
+	CHECK(sffs_seek_from(&f, -5, SFFS_SEEK_SET) == SFFS_SEEK_FAILED);
+	CHECK(sffs_seek_from(&f, -5, SFFS_SEEK_CUR) == SFFS_SEEK_FAILED);
+	CHECK(sffs_seek_from(&f, 0, 7) == SFFS_SEEK_FAILED);
+	check_read(&f, &test_data[4], 1);
+	CHECK(sffs_seek(&f, len) == SFFS_SEEK_OK);
+	CHECK(sffs_read(&f, patch, sizeof(patch)) == 0);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+
+	/* overwrite across a block boundary, then append at the end */
+	fill_random(patch, sizeof(patch));
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_APPEND) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_seek(&f, 200) == SFFS_SEEK_OK);
+	CHECK(sffs_write(&f, patch, sizeof(patch)) == sizeof(patch));
+	memcpy(&test_data[200], patch, sizeof(patch));
+	CHECK(sffs_seek_from(&f, 0, SFFS_SEEK_END) == SFFS_SEEK_OK);
+	CHECK(sffs_write(&f, patch, 50) == 50);
+	memcpy(&test_data[len], patch, 50);
+	len += 50;
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_seek_from(&f, -100, SFFS_SEEK_END) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[len - 100], 100);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Handle opened again without closing keeps its buffered data and it is
+ * linked to the list of opened files only once. */
+static void test_reopen(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	struct sffs_file g;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+
+	fill_random(test_data, 150);
+	CHECK(sffs_open_id(&fs, &g, TEST_FILE_ID + 1, SFFS_OVERWRITE) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_OVERWRITE) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_write(&f, test_data, 100) == 100);
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_APPEND) == SFFS_OPEN_ID_OK);
+	CHECK(fs.files == &f && f.next == &g && g.next == NULL);
+	CHECK(sffs_write(&f, &test_data[100], 50) == 50);
+	CHECK(sffs_sync(&fs) == SFFS_SYNC_OK);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	CHECK(fs.files == &g && g.next == NULL);
+	CHECK(sffs_close(&g) == SFFS_CLOSE_OK);
+	CHECK(fs.files == NULL);
+	verify_file(&fs, TEST_FILE_ID, test_data, 150);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, 150);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+#if SFFS_CACHE_PAGES > 0
+/* Zero-copy reads return whole blocks from the page cache, pinned pages
+ * keep their data until they are released. */
+static void test_read_span(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	struct sffs_span spans[SFFS_CACHE_PAGES];
+	uint8_t old[FLASH_EMU_PAGE_SIZE];
+	uint32_t len = 5000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+
+	for (int remount = 0; remount < 2; remount++) {
+		CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+		CHECK(sffs_seek(&f, 100) == SFFS_SEEK_OK);
+		uint32_t pos = 100;
+		int32_t r;
+		while ((r = sffs_read_span(&f, &spans[0])) == SFFS_READ_SPAN_OK) {
+			/* spans end at block boundaries */
+			CHECK(spans[0].len > 0 && spans[0].len <= fs.page_size);
+			CHECK((pos + spans[0].len) % fs.page_size == 0 || pos + spans[0].len == len);
+			CHECK(memcmp(spans[0].data, &test_data[pos], spans[0].len) == 0);
+			pos += spans[0].len;
+			CHECK(sffs_release_span(&f, &spans[0]) == SFFS_RELEASE_SPAN_OK);
+			CHECK(sffs_release_span(&f, &spans[0]) == SFFS_RELEASE_SPAN_FAILED);
+		}
+		CHECK(r == SFFS_READ_SPAN_EOF);
+		CHECK(pos == len);
+		CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+
+		sffs_free(&fs);
+		mount(&fs, &fl);
+	}
+
+	/* one cache page is always left unpinned */
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+	uint32_t held = 0;
+	while (held < fs.cache_pages - 1) {
+		CHECK(sffs_read_span(&f, &spans[held]) == SFFS_READ_SPAN_OK);
+		CHECK(memcmp(spans[held].data, &test_data[held * fs.page_size], spans[held].len) == 0);
+		held++;
+	}
+	CHECK(sffs_read_span(&f, &spans[held]) == SFFS_READ_SPAN_FAILED);
+	CHECK(sffs_release_span(&f, &spans[held - 1]) == SFFS_RELEASE_SPAN_OK);
+	held--;
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+
+	/* data of held spans survive rewriting of the file */
+	memcpy(old, spans[0].data, spans[0].len);
+	fill_random(test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE, test_data, len);
+	CHECK(memcmp(spans[0].data, old, spans[0].len) == 0);
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+	for (uint32_t i = 0; i < held; i++) {
+		CHECK(sffs_release_span(&f, &spans[i]) == SFFS_RELEASE_SPAN_OK);
+	}
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+#endif
+
+
+#define TEST_NAMES 20
+
+/* Length and offset of the test data of a named file. */
+#define NAME_LEN(i) (100 + (i) * 37)
+#define NAME_DATA(i) (&test_data[(i) * 500])
+
+static void test_name(char *name, uint32_t i) {
+	/* the last name has the maximum length */
+	if (i == TEST_NAMES - 1) {
+		memset(name, 'n', SFFS_NAME_SIZE);
+		name[SFFS_NAME_SIZE] = '\0';
+		return;
+	}
+	sprintf(name, "file-%u.dat", i);
+}
+
+
+/* Check that exactly the named files not removed yet are enumerated and
+ * that their contents match. */
+static void verify_names(struct sffs *fs, const uint8_t *removed) {
+	char name[SFFS_NAME_SIZE + 1];
+	char found[SFFS_NAME_SIZE + 1];
+	uint32_t seen[TEST_NAMES];
+	uint32_t file_id;
+
+	memset(seen, 0, sizeof(seen));
+	for (uint32_t i = 0; i < TEST_NAMES; i++) {
+		test_name(name, i);
+		if (removed[i]) {
+			CHECK(sffs_name_lookup(fs, name, &file_id) == SFFS_NAME_LOOKUP_NOT_FOUND);
+			continue;
+		}
+		CHECK(sffs_name_lookup(fs, name, &file_id) == SFFS_NAME_LOOKUP_OK);
+		CHECK(file_id >= SFFS_DIRECTORY_FIRST_ID && file_id < SFFS_DIRECTORY_FILE_ID);
+		verify_file(fs, file_id, NAME_DATA(i), NAME_LEN(i));
+	}
+
+	uint32_t pos = 0;
+	uint32_t count = 0;
+	int32_t r;
+	while ((r = sffs_dir_next(fs, &pos, &file_id, found, sizeof(found))) == SFFS_DIR_NEXT_OK) {
+		uint32_t i = 0;
+		while (i < TEST_NAMES) {
+			test_name(name, i);
+			if (strcmp(name, found) == 0) {
+				break;
+			}
+			i++;
+		}
+		CHECK(i < TEST_NAMES && !removed[i] && !seen[i]);
+		uint32_t id;
+		CHECK(sffs_name_lookup(fs, found, &id) == SFFS_NAME_LOOKUP_OK && id == file_id);
+		seen[i] = 1;
+		count++;
+	}
+	CHECK(r == SFFS_DIR_NEXT_END);
+
+	/* enumeration without names returns the same files */
+	pos = 0;
+	uint32_t ids = 0;
+	while (sffs_dir_next(fs, &pos, &file_id, NULL, 0) == SFFS_DIR_NEXT_OK) {
+		ids++;
+	}
+	CHECK(ids == count);
+	for (uint32_t i = 0; i < TEST_NAMES; i++) {
+		CHECK(seen[i] == !removed[i]);
+	}
+}
+
+
+/* Named files are created, looked up, enumerated and removed. */
+static void test_directory(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	char name[SFFS_NAME_SIZE + 2];
+	uint8_t removed[TEST_NAMES];
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_random(test_data, TEST_NAMES * 500);
+	memset(removed, 0, sizeof(removed));
+
+	for (uint32_t i = 0; i < TEST_NAMES; i++) {
+		test_name(name, i);
+		CHECK(sffs_open_name(&fs, &f, name, SFFS_OVERWRITE) == SFFS_OPEN_NAME_OK);
+		CHECK(sffs_write(&f, NAME_DATA(i), NAME_LEN(i)) == (int32_t)NAME_LEN(i));
+		CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	}
+	verify_names(&fs, removed);
+
+	/* invalid and missing names */
+	uint32_t file_id;
+	memset(name, 'x', SFFS_NAME_SIZE + 1);
+	name[SFFS_NAME_SIZE + 1] = '\0';
+	CHECK(sffs_open_name(&fs, &f, name, SFFS_OVERWRITE) == SFFS_OPEN_NAME_FAILED);
+	CHECK(sffs_open_name(&fs, &f, "", SFFS_OVERWRITE) == SFFS_OPEN_NAME_FAILED);
+	CHECK(sffs_name_lookup(&fs, name, &file_id) == SFFS_NAME_LOOKUP_FAILED);
+	CHECK(sffs_name_lookup(&fs, "missing", &file_id) == SFFS_NAME_LOOKUP_NOT_FOUND);
+	CHECK(sffs_open_name(&fs, &f, "missing", SFFS_READ) == SFFS_OPEN_NAME_FAILED);
+	CHECK(sffs_remove_name(&fs, "missing") == SFFS_REMOVE_NAME_FAILED);
+
+	/* removed files lose their data, the name can be created again */
+	for (uint32_t i = 0; i < TEST_NAMES; i += 3) {
+		test_name(name, i);
+		CHECK(sffs_name_lookup(&fs, name, &file_id) == SFFS_NAME_LOOKUP_OK);
+		CHECK(sffs_remove_name(&fs, name) == SFFS_REMOVE_NAME_OK);
+		uint32_t size;
+		CHECK(sffs_file_size(&fs, file_id, &size) != SFFS_FILE_SIZE_OK || size == 0);
+		removed[i] = 1;
+	}
+	verify_names(&fs, removed);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_names(&fs, removed);
+	test_name(name, 0);
+	CHECK(sffs_open_name(&fs, &f, name, SFFS_APPEND) == SFFS_OPEN_NAME_OK);
+	CHECK(sffs_write(&f, NAME_DATA(0), NAME_LEN(0)) == (int32_t)NAME_LEN(0));
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	removed[0] = 0;
+	verify_names(&fs, removed);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_names(&fs, removed);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Compressed files are written in spans and read back transparently. */
+static void test_compress(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	struct sffs_span span;
+	uint32_t len = 20000;
+	uint32_t extra = 3000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_log(test_data, len + extra);
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	write_file(&fs, TEST_FILE_ID, SFFS_OVERWRITE | SFFS_COMPRESS, test_data, len);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	CHECK(file_pages(&fs, TEST_FILE_ID) * 3 < len / fs.page_size * 2);
+
+	/* random data take at most one more page per span than uncompressed */
+	fill_random(test_buf, 5000);
+	write_file(&fs, TEST_FILE_ID + 1, SFFS_OVERWRITE | SFFS_COMPRESS, test_buf, 5000);
+	memcpy(&test_data[len + extra], test_buf, 5000);
+	verify_file(&fs, TEST_FILE_ID + 1, &test_data[len + extra], 5000);
+	uint32_t spans = (5000 + fs.page_size * SFFS_COMPRESS_SPAN_PAGES - 1) / (fs.page_size * SFFS_COMPRESS_SPAN_PAGES);
+	CHECK(file_pages(&fs, TEST_FILE_ID + 1) <= (5000 + fs.page_size - 1) / fs.page_size + spans);
+
+	/* uncompressed files cannot be appended compressed, the handle is left
+	 * closed */
+	write_file(&fs, TEST_FILE_ID + 2, SFFS_OVERWRITE, test_data, 100);
+	memset(&f, 0, sizeof(f));
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID + 2, SFFS_APPEND | SFFS_COMPRESS) == SFFS_OPEN_ID_FAILED);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_FAILED);
+	sffs_free(&fs);
+
+	/* compression is recognized when the file is appended */
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	write_file(&fs, TEST_FILE_ID, SFFS_APPEND, &test_data[len], extra);
+	verify_file(&fs, TEST_FILE_ID, test_data, len + extra);
+
+	/* seeks decompress the span at the new position */
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_READ) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_seek(&f, 12345) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[12345], 500);
+	CHECK(sffs_seek_from(&f, -700, SFFS_SEEK_CUR) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[12145], 300);
+	CHECK(sffs_seek_from(&f, -200, SFFS_SEEK_END) == SFFS_SEEK_OK);
+	check_read(&f, &test_data[len + extra - 200], 200);
+	CHECK(sffs_read_span(&f, &span) == SFFS_READ_SPAN_FAILED);
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len + extra);
+	verify_file(&fs, TEST_FILE_ID + 1, &test_data[len + extra], 5000);
+	verify_file(&fs, TEST_FILE_ID + 2, test_data, 100);
+	CHECK(sffs_file_remove(&fs, TEST_FILE_ID) == SFFS_FILE_REMOVE_OK);
+	CHECK(file_pages(&fs, TEST_FILE_ID) == 0);
+	sffs_free(&fs);
+#else
+	/* compression is not available */
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_OVERWRITE | SFFS_COMPRESS) == SFFS_OPEN_ID_FAILED);
+	sffs_free(&fs);
+	(void)span;
+	(void)len;
+#endif
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+/* Run background collection steps until there is nothing to do. Polling
+ * advances the virtual time of the flash, an erase completes after a number
+ * of busy steps. Returns the number of busy steps. */
+static uint32_t gc_until_idle(struct sffs *fs) {
+	int32_t r;
+	uint32_t steps = 0;
+	uint32_t busy = 0;
+	uint32_t waited = 0;
+	while ((r = sffs_gc_step(fs, 4)) != SFFS_GC_STEP_IDLE) {
+		CHECK(r != SFFS_GC_STEP_FAILED);
+		busy = (r == SFFS_GC_STEP_BUSY) ? busy + 1 : 0;
+		waited += (r == SFFS_GC_STEP_BUSY);
+		CHECK(busy < 1000000);
+		CHECK(++steps < 10000000);
+	}
+
+	return waited;
+}
+
+
+/* Find the physical page of a block, the page index counts from the
+ * beginning of the flash. */
+static uint32_t block_position(struct sffs *fs, uint32_t file_id, uint32_t block) {
+	struct sffs_page page;
+	CHECK(sffs_find_page(fs, file_id, block, &page) == SFFS_FIND_PAGE_OK);
+
+	return page.sector * fs->data_pages_per_sector + page.page;
+}
+
+
+/* Pages of a large file are allocated in order in reserved sectors even if
+ * another file is written at the same time. */
+static void test_extent(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	struct sffs_file f;
+	struct sffs_file g;
+	uint32_t len = 60000;
+	uint32_t small = 3000;
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	fill_random(test_data, len + small);
+	write_file(&fs, TEST_FILE_ID + 1, SFFS_OVERWRITE, test_data, 1000);
+
+	/* both files are written in small interleaved chunks */
+	CHECK(sffs_open_id(&fs, &f, TEST_FILE_ID, SFFS_OVERWRITE | SFFS_EXTENT) == SFFS_OPEN_ID_OK);
+	CHECK(sffs_open_id(&fs, &g, TEST_FILE_ID + 2, SFFS_OVERWRITE) == SFFS_OPEN_ID_OK);
+	uint32_t chunk = len / 200;
+	for (uint32_t i = 0; i < 200; i++) {
+		CHECK(sffs_write(&f, &test_data[i * chunk], chunk) == (int32_t)chunk);
+		CHECK(sffs_write(&g, &test_data[len + i * small / 200], small / 200) == (int32_t)(small / 200));
+	}
+	CHECK(sffs_close(&f) == SFFS_CLOSE_OK);
+	CHECK(sffs_close(&g) == SFFS_CLOSE_OK);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	verify_file(&fs, TEST_FILE_ID + 2, &test_data[len], small);
+
+	/* consecutive blocks are in consecutive pages except one jump per
+	 * extent, no sector is shared by the files after the first extent */
+	uint32_t blocks = (len + fs.page_size - 1) / fs.page_size;
+	uint32_t sectors = (blocks + fs.data_pages_per_sector - 1) / fs.data_pages_per_sector;
+	uint32_t jumps = 0;
+	for (uint32_t b = 1; b < blocks; b++) {
+		if (block_position(&fs, TEST_FILE_ID, b) != block_position(&fs, TEST_FILE_ID, b - 1) + 1) {
+			jumps++;
+		}
+	}
+	CHECK(jumps <= sectors + 1);
+	uint32_t last = block_position(&fs, TEST_FILE_ID, blocks - 1) / fs.data_pages_per_sector;
+	for (uint32_t b = 0; b < (small + fs.page_size - 1) / fs.page_size; b++) {
+		CHECK(block_position(&fs, TEST_FILE_ID + 2, b) / fs.data_pages_per_sector != last);
+	}
+	sffs_free(&fs);
+
+	/* whole sectors of the removed file are erased without relocation */
+	mount(&fs, &fl);
+	verify_file(&fs, TEST_FILE_ID, test_data, len);
+	uint32_t moves = fs.stats.gc_moves;
+	uint32_t erases = fs.stats.flash_erases;
+	CHECK(sffs_file_remove(&fs, TEST_FILE_ID) == SFFS_FILE_REMOVE_OK);
+	CHECK(file_pages(&fs, TEST_FILE_ID) == 0);
+	gc_until_idle(&fs);
+	CHECK(fs.stats.flash_erases - erases + 2 >= sectors);
+	CHECK(fs.stats.gc_moves == moves);
+	verify_file(&fs, TEST_FILE_ID + 1, test_data, 1000);
+	verify_file(&fs, TEST_FILE_ID + 2, &test_data[len], small);
+	sffs_free(&fs);
+
+	mount(&fs, &fl);
+	uint32_t size;
+	CHECK(sffs_file_size(&fs, TEST_FILE_ID, &size) != SFFS_FILE_SIZE_OK || size == 0);
+	verify_file(&fs, TEST_FILE_ID + 1, test_data, 1000);
+	verify_file(&fs, TEST_FILE_ID + 2, &test_data[len], small);
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+#define CHURN_FILES 8
+#define CHURN_MAX_LEN 7000
+#define CHURN_OPS 600
+
+/* Files written with different flags are rewritten and appended with the
+ * collector running in the background, the flash is filled many times and
+ * remounted regularly. */
+static void test_churn(void) {
+	struct flash_dev fl;
+	struct sffs fs;
+	uint32_t lens[CHURN_FILES];
+	uint32_t flags[CHURN_FILES];
+
+	CHECK(flash_init(&fl, TEST_FLASH_SIZE) == FLASH_INIT_OK);
+	init(&fs);
+	CHECK(sffs_format(&fs, &fl) == SFFS_FORMAT_OK);
+	mount(&fs, &fl);
+	CHECK(sffs_set_gc_mode(&fs, SFFS_GC_MODE_BACKGROUND) == SFFS_SET_GC_MODE_OK);
+
+	for (uint32_t i = 0; i < CHURN_FILES; i++) {
+		lens[i] = 0;
+		flags[i] = (i % 2) ? SFFS_EXTENT : 0;
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+		if (i % 4 >= 2) {
+			flags[i] |= SFFS_COMPRESS;
+		}
+#endif
+	}
+
+	/* statistics are reset by every mount */
+	uint32_t erases = 0;
+	uint32_t waited = 0;
+	for (uint32_t op = 0; op < CHURN_OPS; op++) {
+		uint32_t i = rand() % CHURN_FILES;
+		uint8_t *data = &test_data[i * CHURN_MAX_LEN];
+
+		if (lens[i] > 0 && lens[i] < CHURN_MAX_LEN - 1000 && rand() % 3 == 0) {
+			/* append to the existing file */
+			uint32_t add = rand() % 1000 + 1;
+			fill_log(&data[lens[i]], add);
+			write_file(&fs, TEST_FILE_ID + i, SFFS_APPEND | flags[i], &data[lens[i]], add);
+			lens[i] += add;
+		} else {
+			lens[i] = rand() % (CHURN_MAX_LEN - 1000) + 1;
+			if (rand() % 2) {
+				fill_log(data, lens[i]);
+			} else {
+				fill_random(data, lens[i]);
+			}
+			write_file(&fs, TEST_FILE_ID + i, SFFS_OVERWRITE | flags[i], data, lens[i]);
+		}
+		verify_file(&fs, TEST_FILE_ID + i, data, lens[i]);
+
+		CHECK(sffs_gc_step(&fs, 2) != SFFS_GC_STEP_FAILED);
+		if (op % 10 == 0) {
+			waited += gc_until_idle(&fs);
+		}
+		if (op % 100 == 99) {
+			erases += fs.stats.flash_erases;
+			sffs_free(&fs);
+			mount(&fs, &fl);
+			CHECK(sffs_set_gc_mode(&fs, SFFS_GC_MODE_BACKGROUND) == SFFS_SET_GC_MODE_OK);
+			for (uint32_t j = 0; j < CHURN_FILES; j++) {
+				if (lens[j] > 0) {
+					verify_file(&fs, TEST_FILE_ID + j, &test_data[j * CHURN_MAX_LEN], lens[j]);
+				}
+			}
+		}
+	}
+	erases += fs.stats.flash_erases;
+
+	/* the flash was reused several times */
+	CHECK(erases > 2 * fs.sector_count);
+	/* steps wait for the flash only if the erase is asynchronous */
+#if SFFS_ASYNC_ERASE
+	CHECK(waited > 0);
+#else
+	CHECK(waited == 0);
+#endif
+	sffs_free(&fs);
+
+	flash_free(&fl);
+	tests_run++;
+}
+
+
+int main(int argc, char *argv[]) {
+	(void)argc;
+	(void)argv;
+
+	srand(1234);
+
+	test_flash_readv();
+	test_cached_write();
+	test_logical_page_cache();
+	test_init_arena();
+	test_label();
+	test_reserved_ids();
+	test_sector_format_failure();
+	test_seek();
+	test_reopen();
+#if SFFS_CACHE_PAGES > 0
+	test_read_span();
+#endif
+	test_directory();
+	test_compress();
+	test_extent();
+	test_churn();
+
+	printf("tests run = %d, all passed\n", tests_run);
+
+	return 0;
+}
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "sffs.h"
 #include "flash_emulator.h"
@@ -34,704 +35,4578 @@
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
+#define SFFS_ARENA_ROUND(x) (((x) + SFFS_ARENA_ALIGN - 1) & ~(uint32_t)(SFFS_ARENA_ALIGN - 1))
+
+/* Geometry of the mounted filesystem, constant if it is fixed at compile time */
+#if SFFS_FIXED_PAGE_SIZE > 0 && SFFS_FIXED_SECTOR_SIZE > 0
+#define SFFS_PAGE_SIZE(fs) ((void)(fs), (uint32_t)SFFS_FIXED_PAGE_SIZE)
+#define SFFS_SECTOR_SIZE(fs) ((void)(fs), (uint32_t)SFFS_FIXED_SECTOR_SIZE)
+#define SFFS_DATA_PAGES_PER_SECTOR(fs) ((void)(fs), (uint32_t)((SFFS_FIXED_SECTOR_SIZE - sizeof(struct sffs_metadata_header)) / \
+	(sizeof(struct sffs_metadata_item) + SFFS_FIXED_PAGE_SIZE)))
+#define SFFS_FIRST_DATA_PAGE(fs) (SFFS_FIXED_SECTOR_SIZE / SFFS_FIXED_PAGE_SIZE - SFFS_DATA_PAGES_PER_SECTOR(fs))
+#else
+#define SFFS_PAGE_SIZE(fs) ((fs)->page_size)
+#define SFFS_SECTOR_SIZE(fs) ((fs)->sector_size)
+#define SFFS_DATA_PAGES_PER_SECTOR(fs) ((fs)->data_pages_per_sector)
+#define SFFS_FIRST_DATA_PAGE(fs) ((fs)->first_data_page)
+#endif
+
+/* Number of bytes of one compressed span. Compressed tokens can expand
+ * incompressible data, one more page than the number of blocks is reserved
+ * for each span. */
+#define SFFS_SPAN_SIZE(fs) (SFFS_COMPRESS_SPAN_PAGES * SFFS_PAGE_SIZE(fs))
+#define SFFS_SPAN_PAGES (SFFS_COMPRESS_SPAN_PAGES + 1)
+
+/* File 0 holds the master page, IDs from SFFS_DIRECTORY_FILE_ID up are used
+ * by the filesystem itself. Neither can be modified through the public API. */
+#define SFFS_FILE_ID_RESERVED(id) ((id) == 0 || (id) >= SFFS_DIRECTORY_FILE_ID)
+
+
+/* State collected while sectors are replayed during mount. */
+struct sffs_mount_state {
+	struct sffs_page master;
+	struct sffs_page moving[SFFS_MOUNT_MOVING_PAGES];
+	uint32_t moving_count;
+};
+
+static int32_t sffs_metadata_load(struct sffs *fs, uint32_t sector, uint32_t count, struct sffs_metadata_header **header, struct sffs_metadata_item **items);
+static void sffs_index_reset(struct sffs *fs);
+static void sffs_sector_count_pages(struct sffs *fs, uint32_t sector, struct sffs_metadata_item *items);
+static int32_t sffs_sector_commit_state(struct sffs *fs, uint32_t sector);
+static int32_t sffs_mount_sector(struct sffs *fs, uint32_t sector, struct sffs_mount_state *ms);
+static int32_t sffs_checkpoint_load(struct sffs *fs, struct sffs_mount_state *ms, uint8_t *replay);
+static void sffs_checkpoint_touch(struct sffs *fs, uint32_t sector);
+static void sffs_checkpoint_drop(struct sffs *fs);
+static int32_t sffs_flash_read(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len);
+static void sffs_sector_set_next_free(struct sffs *fs, struct sffs_sector_info *si, uint32_t next_free);
+static int32_t sffs_write_pages(struct sffs_file *f, uint32_t pos, const uint8_t *buf, uint32_t len);
+static void sffs_dir_load(struct sffs *fs);
+static int32_t sffs_do_collect_garbage(struct sffs *fs);
+static int32_t sffs_do_flush(struct sffs_file *f);
+static int32_t sffs_do_close(struct sffs_file *f);
+static int32_t sffs_do_remove_many(struct sffs *fs, const uint32_t *file_ids, uint32_t count);
+static int32_t sffs_do_file_size(struct sffs *fs, uint32_t file_id, uint32_t *size);
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+static uint32_t sffs_span_last(struct sffs *fs, uint32_t file_id, uint32_t span, struct sffs_page *page, struct sffs_metadata_item *item, uint32_t *start);
+#endif
+
+
+/* State of a public API call in progress. */
+struct sffs_call {
+	uint32_t op;
+	struct sffs_file *file;
+	uint32_t mode;
+	uint32_t user_bytes;
+#if SFFS_OP_STATS
+	struct sffs_stats start;
+	uint32_t start_time;
+#endif
+};
+
+
+#if SFFS_LOCKING
+static void sffs_lock(struct sffs *fs, void *lock, uint32_t mode) {
+	if (fs->lock_ops != NULL && lock != NULL) {
+		fs->lock_ops->lock(lock, mode);
+	}
+}
 
 
-int32_t sffs_init(struct sffs *fs) {
-	assert(fs != NULL);
+static void sffs_unlock(struct sffs *fs, void *lock, uint32_t mode) {
+	if (fs->lock_ops != NULL && lock != NULL) {
+		fs->lock_ops->unlock(lock, mode);
+	}
+}
+#endif
 
-	/* nothing to initialize yet */
-	return SFFS_INIT_OK;
+
+/* Page cache and statistics are accessed by calls holding the filesystem lock
+ * shared, they are protected by the cache lock. */
+static void sffs_cache_lock(struct sffs *fs) {
+#if SFFS_LOCKING
+	sffs_lock(fs, fs->cache_lock, SFFS_LOCK_EXCLUSIVE);
+#else
+	(void)fs;
+#endif
 }
 
 
-int32_t sffs_mount(struct sffs *fs, struct flash_dev *flash) {
-	assert(fs != NULL);
-	assert(flash != NULL);
+static void sffs_cache_unlock(struct sffs *fs) {
+#if SFFS_LOCKING
+	sffs_unlock(fs, fs->cache_lock, SFFS_LOCK_EXCLUSIVE);
+#else
+	(void)fs;
+#endif
+}
 
-	struct flash_info info;
-	if (flash_get_info(flash, &info) != FLASH_GET_INFO_OK) {
-		return SFFS_MOUNT_FAILED;
+
+/* Public API call begins. Locks of the file and the filesystem are taken.
+ * Shared mode is requested by reads, it is used only if pages are found
+ * using the block index (metadata are scanned into a single buffer
+ * otherwise), no buffered data of the file need to be written and the file
+ * is not compressed. Calls
+ * with op set to SFFS_OP_COUNT are not accounted. */
+static void sffs_op_begin(struct sffs *fs, struct sffs_call *call, struct sffs_file *f, uint32_t op, uint32_t mode) {
+	call->op = op;
+	call->file = f;
+	call->mode = SFFS_LOCK_EXCLUSIVE;
+	call->user_bytes = 0;
+
+#if SFFS_LOCKING
+	if (f != NULL) {
+		sffs_lock(fs, f->lock, SFFS_LOCK_EXCLUSIVE);
 	}
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	if (f != NULL && f->wbuf_len > 0) {
+		mode = SFFS_LOCK_EXCLUSIVE;
+	}
+#endif
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	/* spans are decompressed using the scratch page */
+	if (f != NULL && f->compress) {
+		mode = SFFS_LOCK_EXCLUSIVE;
+	}
+#endif
+	if (mode == SFFS_LOCK_SHARED && fs->cache_lock != NULL) {
+		sffs_lock(fs, fs->fs_lock, SFFS_LOCK_SHARED);
+#if SFFS_INDEX_SIZE > 0
+		if (fs->index_valid) {
+			call->mode = SFFS_LOCK_SHARED;
+		}
+#endif
+		if (call->mode != SFFS_LOCK_SHARED) {
+			sffs_unlock(fs, fs->fs_lock, SFFS_LOCK_SHARED);
+		}
+	}
+	if (call->mode == SFFS_LOCK_EXCLUSIVE) {
+		sffs_lock(fs, fs->fs_lock, SFFS_LOCK_EXCLUSIVE);
+	}
+#else
+	(void)fs;
+	(void)mode;
+#endif
+
+#if SFFS_OP_STATS
+	if (op < SFFS_OP_COUNT) {
+		sffs_cache_lock(fs);
+		call->start = fs->stats;
+		sffs_cache_unlock(fs);
+		call->start_time = SFFS_TIME_US();
+		if (fs->hook != NULL) {
+			fs->hook(fs, op, SFFS_HOOK_BEGIN, fs->hook_ctx);
+		}
+	}
+#endif
+}
 
-	fs->flash = flash;
-	fs->page_size = info.page_size;
-	fs->sector_size = info.sector_size;
-	fs->sector_count = info.capacity / info.sector_size;
-	fs->data_pages_per_sector =
-		(info.sector_size - sizeof(struct sffs_metadata_header)) /
-		(sizeof(struct sffs_metadata_item) + info.page_size);
-	fs->first_data_page = info.sector_size / info.page_size - fs->data_pages_per_sector;
 
-	/* TODO: check flash geometry and computed values */
+/* Counters of concurrent shared calls are included in each other's. */
+static void sffs_op_end(struct sffs *fs, struct sffs_call *call) {
+	sffs_cache_lock(fs);
+	if (call->op == SFFS_OP_READ) {
+		fs->stats.user_read_bytes += call->user_bytes;
+	}
+	if (call->op == SFFS_OP_WRITE) {
+		fs->stats.user_write_bytes += call->user_bytes;
+	}
+#if SFFS_OP_STATS
+	if (call->op < SFFS_OP_COUNT) {
+		struct sffs_op_stats *os = &(fs->op_stats[call->op]);
+		struct sffs_stats *start = &(call->start);
+		os->calls++;
+		os->flash_reads += fs->stats.flash_reads - start->flash_reads;
+		os->flash_read_bytes += fs->stats.flash_read_bytes - start->flash_read_bytes;
+		os->flash_programs += fs->stats.flash_programs - start->flash_programs;
+		os->flash_program_bytes += fs->stats.flash_program_bytes - start->flash_program_bytes;
+		os->flash_erases += fs->stats.flash_erases - start->flash_erases;
+		os->user_bytes += call->user_bytes;
+		os->time_us += SFFS_TIME_US() - call->start_time;
+	}
+#endif
+	sffs_cache_unlock(fs);
 
-	if (sffs_cache_clear(fs) != SFFS_CACHE_CLEAR_OK) {
-		return SFFS_MOUNT_FAILED;
+#if SFFS_OP_STATS
+	if (call->op < SFFS_OP_COUNT && fs->hook != NULL) {
+		fs->hook(fs, call->op, SFFS_HOOK_END, fs->hook_ctx);
 	}
+#endif
 
-	/* Find first page of file "0", it should contain filesystem metadata */
-	struct sffs_master_page master;
-	struct sffs_file f;
-	if (sffs_open_id(fs, &f, 0, SFFS_READ) != SFFS_OPEN_ID_OK) {
-		return SFFS_MOUNT_FAILED;
+#if SFFS_LOCKING
+	sffs_unlock(fs, fs->fs_lock, call->mode);
+	if (call->file != NULL) {
+		sffs_unlock(fs, call->file->lock, SFFS_LOCK_EXCLUSIVE);
 	}
-	sffs_read(&f, (unsigned char *)&master, sizeof(master));
-	sffs_close(&f);
+#endif
+}
 
-	/* TODO: check SFFS master page for validity */
-	/* TODO: fetch filesystem label */
 
-	return SFFS_MOUNT_OK;
+/* Reset runtime state, structures must be already allocated. */
+static void sffs_init_state(struct sffs *fs) {
+	sffs_stats_reset(fs);
+#if SFFS_OP_STATS
+	fs->hook = NULL;
+	fs->hook_ctx = NULL;
+#endif
+#if SFFS_LOCKING
+	fs->lock_ops = NULL;
+	fs->fs_lock = NULL;
+	fs->cache_lock = NULL;
+#endif
+	fs->gc_erasing = SFFS_MAX_SECTORS;
+	fs->gc_mode = SFFS_GC_MODE_INLINE;
+	fs->page_gen = 0;
+	fs->files = NULL;
+
+#if SFFS_CACHE_PAGES > 0
+	fs->cache_enabled = 0;
+	sffs_cache_clear(fs);
+#endif
+
+#if SFFS_INDEX_SIZE > 0
+	/* index is not usable until the filesystem is mounted */
+	fs->index_valid = 0;
+	fs->index_used = 0;
+#endif
+
+#if SFFS_FILE_TABLE_SIZE > 0
+	fs->file_table_valid = 0;
+#endif
+
+	fs->dir_slots = 0;
+	fs->dir_free = 0;
+	fs->dir_next_id = SFFS_DIRECTORY_FIRST_ID;
+#if SFFS_DIRECTORY_SIZE > 0
+	fs->names_valid = 0;
+	fs->names_used = 0;
+#endif
 }
 
 
-int32_t sffs_free(struct sffs *fs) {
+int32_t sffs_init(struct sffs *fs) {
 	assert(fs != NULL);
 
-	/* nothing to do yet */
-	return SFFS_FREE_OK;
-}
-
+#if SFFS_STATIC_STORAGE
+#if SFFS_INDEX_SIZE > 0
+	fs->index = fs->storage.index;
+	fs->index_size = SFFS_INDEX_SIZE;
+#endif
+#if SFFS_FILE_TABLE_SIZE > 0
+	fs->file_table = fs->storage.file_table;
+	fs->file_table_size = SFFS_FILE_TABLE_SIZE;
+#endif
+#if SFFS_CACHE_PAGES > 0
+	fs->cache = fs->storage.cache;
+	fs->cache_pages = SFFS_CACHE_PAGES;
+	fs->cache_page_size = SFFS_CACHE_PAGE_SIZE;
+	for (uint32_t i = 0; i < SFFS_CACHE_PAGES; i++) {
+		fs->cache[i].data = fs->storage.cache_data[i];
+	}
+#endif
+	fs->scratch = fs->storage.scratch;
+	fs->scratch_size = SFFS_SCRATCH_PAGE_SIZE;
+#if SFFS_DIRECTORY_SIZE > 0
+	fs->names = fs->storage.names;
+	fs->names_size = SFFS_DIRECTORY_SIZE;
+#endif
 
-int32_t sffs_cache_clear(struct sffs *fs) {
-	assert(fs != NULL);
+	sffs_init_state(fs);
 
-	return SFFS_CACHE_CLEAR_OK;
+	return SFFS_INIT_OK;
+#else
+	/* no static storage, sffs_init_arena must be used */
+	return SFFS_INIT_FAILED;
+#endif
 }
 
 
-int32_t sffs_format(struct flash_dev *flash) {
-	assert(flash != NULL);
+/* Assign arena regions to runtime structures if fs is not NULL. Returns size of
+ * the arena required. */
+static uint32_t sffs_arena_layout(struct sffs *fs, uint8_t *arena, const struct sffs_config *config) {
+	uint32_t pos = 0;
 
-	struct flash_info info;
-	flash_get_info(flash, &info);
+#if SFFS_INDEX_SIZE > 0
+	if (fs != NULL) {
+		fs->index = (struct sffs_index_entry *)&(arena[pos]);
+		fs->index_size = config->index_size;
+	}
+	pos += SFFS_ARENA_ROUND(config->index_size * sizeof(struct sffs_index_entry));
+#endif
 
-	/* we need to simulate filesystem structure somehow (sector format functions
-	 * operate on mounted filesystem). For this purpose we mount the filesystem
-	 * using local sffs structure. Mount fails as no master page can be read,
-	 * we ignore this silently, return code is intentionally unchecked. */
-	struct sffs fs;
-	sffs_mount(&fs, flash);
+#if SFFS_FILE_TABLE_SIZE > 0
+	if (fs != NULL) {
+		fs->file_table = (struct sffs_file_entry *)&(arena[pos]);
+		fs->file_table_size = config->file_table_size;
+	}
+	pos += SFFS_ARENA_ROUND(config->file_table_size * sizeof(struct sffs_file_entry));
+#endif
+
+#if SFFS_CACHE_PAGES > 0
+	if (fs != NULL) {
+		fs->cache = (struct sffs_cache_page *)&(arena[pos]);
+		fs->cache_pages = config->cache_pages;
+		fs->cache_page_size = config->page_size;
+	}
+	pos += SFFS_ARENA_ROUND(config->cache_pages * sizeof(struct sffs_cache_page));
+	for (uint32_t i = 0; i < config->cache_pages; i++) {
+		if (fs != NULL) {
+			fs->cache[i].data = &(arena[pos]);
+		}
+		pos += SFFS_ARENA_ROUND(config->page_size);
+	}
+#endif
 
-	/* now iterate over all sectors and format them */
-	for (uint32_t sector = 0; sector < fs.sector_count; sector++) {
-		sffs_sector_format(&fs, sector);
+	if (fs != NULL) {
+		fs->scratch = &(arena[pos]);
+		fs->scratch_size = config->page_size;
 	}
-	/* TODO: write master page */
+	pos += SFFS_ARENA_ROUND(SFFS_SCRATCH_PAGES * config->page_size);
 
-	return SFFS_FORMAT_OK;
+#if SFFS_DIRECTORY_SIZE > 0
+	if (fs != NULL) {
+		fs->names = (struct sffs_name_entry *)&(arena[pos]);
+		fs->names_size = config->directory_size;
+	}
+	pos += SFFS_ARENA_ROUND(config->directory_size * sizeof(struct sffs_name_entry));
+#endif
+
+	return pos;
 }
 
 
-int32_t sffs_sector_debug_print(struct sffs *fs, uint32_t sector) {
+int32_t sffs_init_arena(struct sffs *fs, void *arena, uint32_t size, const struct sffs_config *config) {
 	assert(fs != NULL);
-	assert(sector < fs->sector_count);
-
-	struct sffs_metadata_header header;
-	/* TODO: check return value */
-	sffs_cached_read(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header));
-
-	char sector_state = '?';
-	if (header.state == SFFS_SECTOR_STATE_ERASED) sector_state = ' ';
-	if (header.state == SFFS_SECTOR_STATE_USED) sector_state = 'U';
-	if (header.state == SFFS_SECTOR_STATE_FULL) sector_state = 'F';
-	if (header.state == SFFS_SECTOR_STATE_DIRTY) sector_state = 'D';
-	if (header.state == SFFS_SECTOR_STATE_OLD) sector_state = 'O';
-	printf("%04d [%c]: ", sector, sector_state);
-
-	for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
-		uint32_t item_pos = sector * fs->sector_size + sizeof(struct sffs_metadata_header) + i * sizeof(struct sffs_metadata_item);
-		struct sffs_metadata_item item;
-		/* TODO: check return value */
-		sffs_cached_read(fs, item_pos, (uint8_t *)&item, sizeof(struct sffs_metadata_item));
-
-		char page_state = '?';
-		if (item.state == SFFS_PAGE_STATE_ERASED) page_state = ' ';
-		if (item.state == SFFS_PAGE_STATE_USED) page_state = 'U';
-		if (item.state == SFFS_PAGE_STATE_MOVING) page_state = 'M';
-		if (item.state == SFFS_PAGE_STATE_RESERVED) page_state = 'R';
-		if (item.state == SFFS_PAGE_STATE_OLD) page_state = 'O';
-		printf("[%c] ", page_state);
+	assert(config != NULL);
+
+	/* hash tables are indexed by masking */
+	if (arena == NULL || ((uintptr_t)arena % SFFS_ARENA_ALIGN) != 0 || size < sffs_ram_size(config) ||
+	    (config->index_size & (config->index_size - 1)) != 0 ||
+	    (config->file_table_size & (config->file_table_size - 1)) != 0 ||
+	    (config->directory_size & (config->directory_size - 1)) != 0) {
+		return SFFS_INIT_ARENA_FAILED;
 	}
-	printf("\n");
 
-	return SFFS_SECTOR_DEBUG_PRINT_OK;
-}
+	sffs_arena_layout(fs, (uint8_t *)arena, config);
+	sffs_init_state(fs);
 
+	return SFFS_INIT_ARENA_OK;
+}
 
-int32_t sffs_debug_print(struct sffs *fs) {
-	assert(fs != NULL);
 
-	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
-		sffs_sector_debug_print(fs, sector);
-	}
-	printf("\n");
+uint32_t sffs_ram_size(const struct sffs_config *config) {
+	assert(config != NULL);
 
-	return SFFS_DEBUG_PRINT_OK;
+	return sffs_arena_layout(NULL, NULL, config);
 }
 
-int32_t sffs_metadata_header_check(struct sffs *fs, struct sffs_metadata_header *header) {
-	assert(header != NULL);
-	assert(fs != NULL);
 
-	/* check magic number */
-	if (header->magic != SFFS_METADATA_MAGIC) {
-		return SFFS_METADATA_HEADER_CHECK_FAILED;
+/* Compute filesystem geometry for logical pages of 2^page_shift flash pages.
+ * Returns 0 on success or -1 if the geometry is not supported. */
+static int32_t sffs_set_geometry(struct sffs *fs, struct flash_info *info, uint32_t page_shift) {
+	if (page_shift > SFFS_PAGE_SHIFT_MAX) {
+		return -1;
 	}
+	fs->page_shift = page_shift;
+	fs->page_size = info->page_size << page_shift;
+	fs->sector_size = info->sector_size;
+	fs->sector_count = info->capacity / info->sector_size;
 
-	return SFFS_METADATA_HEADER_CHECK_OK;
-}
+	/* block size must fit the metadata item */
+	if (fs->sector_count > SFFS_MAX_SECTORS || fs->page_size > 0x8000 || fs->sector_size % fs->page_size != 0) {
+		return -1;
+	}
 
+	fs->data_pages_per_sector =
+		(fs->sector_size - sizeof(struct sffs_metadata_header)) /
+		(sizeof(struct sffs_metadata_item) + fs->page_size);
+	fs->first_data_page = fs->sector_size / fs->page_size - fs->data_pages_per_sector;
 
-int32_t sffs_cached_read(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len) {
-	assert(fs != NULL);
-	assert(data != NULL);
+	if (fs->data_pages_per_sector == 0 ||
+	    sizeof(struct sffs_metadata_header) + fs->data_pages_per_sector * sizeof(struct sffs_metadata_item) > SFFS_METADATA_BUF_SIZE) {
+		return -1;
+	}
 
-	if (flash_page_read(fs->flash, addr, data, len) != FLASH_PAGE_READ_OK) {
-		return SFFS_CACHED_READ_FAILED;
+	/* geometry of the flash must match the one fixed at compile time */
+	if (fs->page_size != SFFS_PAGE_SIZE(fs) || fs->sector_size != SFFS_SECTOR_SIZE(fs)) {
+		return -1;
 	}
 
-	return SFFS_CACHED_READ_OK;
+	return 0;
 }
 
 
-int32_t sffs_cached_write(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len) {
+static int32_t sffs_do_mount(struct sffs *fs, struct flash_dev *flash) {
 	assert(fs != NULL);
-	assert(data != NULL);
+	assert(flash != NULL);
 
-	if (flash_page_write(fs->flash, addr, data, len) != FLASH_PAGE_WRITE_OK) {
-		return SFFS_CACHED_WRITE_FAILED;
+	struct flash_info info;
+	if (flash_get_info(flash, &info) != FLASH_GET_INFO_OK) {
+		return SFFS_MOUNT_FAILED;
 	}
 
-	return SFFS_CACHED_WRITE_OK;
-}
+	uint32_t start_time = SFFS_TIME_US();
+	uint32_t start_reads = fs->stats.flash_reads;
+	uint32_t start_read_bytes = fs->stats.flash_read_bytes;
 
+	/* Logical page size is taken from the first valid sector header. */
+	fs->flash = flash;
+	fs->sector_size = info.sector_size;
+	uint32_t page_shift = 0;
+	for (uint32_t sector = 0; sector < info.capacity / info.sector_size && sector < SFFS_MAX_SECTORS; sector++) {
+		struct sffs_metadata_header header;
+		if (sffs_flash_read(fs, sector * info.sector_size, (uint8_t *)&header, sizeof(header)) == SFFS_CACHED_READ_OK &&
+		    header.magic == SFFS_METADATA_MAGIC) {
+			page_shift = SFFS_SECTOR_PAGE_SHIFT(header.reserved);
+			break;
+		}
+	}
+	if (sffs_set_geometry(fs, &info, page_shift) != 0 || SFFS_PAGE_SIZE(fs) > fs->scratch_size) {
+		return SFFS_MOUNT_FAILED;
+	}
 
-int32_t sffs_find_page(struct sffs *fs, uint32_t file_id, uint32_t block, struct sffs_page *page) {
-	assert(fs != NULL);
-	assert(page != NULL);
+#if SFFS_CACHE_PAGES > 0
+	fs->cache_enabled = (fs->cache_pages > 0 && SFFS_PAGE_SIZE(fs) <= fs->cache_page_size);
+#endif
+	if (sffs_cache_clear(fs) != SFFS_CACHE_CLEAR_OK) {
+		return SFFS_MOUNT_FAILED;
+	}
 
-	/* first we need to iterate over all sectors in the flash */
+	memset(&(fs->mount_info), 0, sizeof(fs->mount_info));
+
+	/* Sectors with invalid header are unusable until they are formatted
+	 * again. Garbage collection is suppressed until all sectors are known. */
+	fs->free_pages = 0;
+	fs->gc_running = 1;
+	fs->gc_victim = fs->sector_count;
+	fs->gc_page = 0;
+	fs->gc_erasing = SFFS_MAX_SECTORS;
+	fs->alloc_sector = fs->sector_count;
+	memset(fs->extent_reserved, 0, sizeof(fs->extent_reserved));
+	sffs_index_reset(fs);
+
+#if SFFS_INDEX_SIZE > 0
+	fs->checkpoint_active = 0;
+	fs->checkpoint_writing = 0;
+	fs->checkpoint_gen = 0;
+#endif
+
+	struct sffs_mount_state ms;
+	ms.master.sector = fs->sector_count;
+	ms.master.page = 0;
+	ms.moving_count = 0;
+
+	/* Sectors restored from the checkpoint (or already replayed while
+	 * looking for it) are not scanned again. */
+	uint8_t replay[(SFFS_MAX_SECTORS + 7) / 8];
+	memset(replay, 0xff, sizeof(replay));
+	sffs_checkpoint_load(fs, &ms, replay);
+
+	/* Single pass over metadata of all remaining sectors */
 	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
-		struct sffs_metadata_header header;
-		/* TODO: check return value */
-		sffs_cached_read(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header));
+		if (replay[sector / 8] & (1 << (sector % 8))) {
+			sffs_mount_sector(fs, sector, &ms);
+		}
+	}
+	fs->gc_running = 0;
 
-		if (header.state == SFFS_SECTOR_STATE_ERASED) {
-			continue;
+	/* Moving page is the old copy of a block being rewritten. If the new
+	 * copy was completed, the moving page is not indexed and it can be
+	 * discarded. Otherwise it remains the valid copy. */
+	for (uint32_t i = 0; i < ms.moving_count; i++) {
+		struct sffs_metadata_item item;
+		struct sffs_page page;
+		sffs_get_page_metadata(fs, &(ms.moving[i]), &item);
+		if (sffs_index_lookup(fs, item.file_id, item.block, &page) == SFFS_INDEX_LOOKUP_OK &&
+		    (page.sector != ms.moving[i].sector || page.page != ms.moving[i].page)) {
+			sffs_set_page_state(fs, &(ms.moving[i]), SFFS_PAGE_STATE_OLD);
+			fs->mount_info.pages_recovered++;
 		}
+	}
 
-		for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
-			struct sffs_metadata_item item;
-			sffs_get_page_metadata(fs, &(struct sffs_page){ .sector = sector, .page = i }, &item);
+	/* Sector header is written last when a sector is formatted, sectors
+	 * with readable but invalid header contain no data. They are formatted
+	 * again if the filesystem was recognized. */
+	for (uint32_t sector = 0; sector < fs->sector_count && fs->mount_info.sectors_valid > 0; sector++) {
+		struct sffs_metadata_header header;
+		if (fs->sectors[sector].state == 0 &&
+		    sffs_flash_read(fs, sector * SFFS_SECTOR_SIZE(fs), (uint8_t *)&header, sizeof(header)) == SFFS_CACHED_READ_OK &&
+		    sffs_metadata_header_check(fs, &header) != SFFS_METADATA_HEADER_CHECK_OK &&
+		    sffs_sector_format(fs, sector) == SFFS_SECTOR_FORMAT_OK) {
+			fs->mount_info.sectors_formatted++;
+		}
+	}
 
-			/* check if page contains valid data for requested file */
-			if (item.file_id == file_id && item.block == block && (item.state == SFFS_PAGE_STATE_USED || item.state == SFFS_PAGE_STATE_MOVING)) {
-				page->sector = sector;
-				page->page = i;
-				return SFFS_FIND_PAGE_OK;
-			}
+	/* First block of file "0" contains filesystem metadata. Filesystems
+	 * formatted without the master page are accepted too. */
+	memset(fs->label, 0, sizeof(fs->label));
+	int32_t ret = (fs->mount_info.sectors_valid > 0) ? SFFS_MOUNT_OK : SFFS_MOUNT_FAILED;
+	if (ms.master.sector < fs->sector_count) {
+		struct sffs_master_page mp;
+		uint32_t addr;
+		sffs_page_addr(fs, &(ms.master), &addr);
+		if (sffs_cached_read(fs, addr, (uint8_t *)&mp, sizeof(mp)) != SFFS_CACHED_READ_OK ||
+		    mp.magic != SFFS_MASTER_MAGIC ||
+		    (1UL << mp.page_size) != SFFS_PAGE_SIZE(fs) ||
+		    (1UL << mp.sector_size) != SFFS_SECTOR_SIZE(fs) ||
+		    mp.sector_count != fs->sector_count) {
+			ret = SFFS_MOUNT_FAILED;
+		} else {
+			memcpy(fs->label, mp.label, MIN(sizeof(fs->label), sizeof(mp.label)));
 		}
 	}
+	if (ret == SFFS_MOUNT_OK) {
+		sffs_dir_load(fs);
+	}
 
-	return SFFS_FIND_PAGE_NOT_FOUND;
+#if SFFS_INDEX_SIZE > 0
+	fs->mount_info.checkpoint_gen = fs->checkpoint_gen;
+#endif
+	fs->mount_info.flash_reads = fs->stats.flash_reads - start_reads;
+	fs->mount_info.flash_read_bytes = fs->stats.flash_read_bytes - start_read_bytes;
+	fs->mount_info.time_us = SFFS_TIME_US() - start_time;
+
+	return ret;
 }
 
 
-int32_t sffs_find_erased_page(struct sffs *fs, struct sffs_page *page) {
+int32_t sffs_mount(struct sffs *fs, struct flash_dev *flash) {
 	assert(fs != NULL);
-	assert(page != NULL);
 
-	/* first we need to iterate over all sectors in the flash */
-	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
-		struct sffs_metadata_header header;
-		/* TODO: check return value */
-		sffs_cached_read(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header));
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_MOUNT, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_mount(fs, flash);
+	sffs_op_end(fs, &call);
 
-		if (header.state == SFFS_SECTOR_STATE_DIRTY || header.state == SFFS_SECTOR_STATE_FULL) {
+	return ret;
+}
+
+
+/* Rebuild summary, block index and file table entries of one sector from its
+ * metadata. Pages left by interrupted writes are recovered. */
+static int32_t sffs_mount_sector(struct sffs *fs, uint32_t sector, struct sffs_mount_state *ms) {
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+	si->state = 0;
+	si->erased = 0;
+	si->used = 0;
+	si->old = 0;
+	si->erase_count = 0;
+	si->next_free = SFFS_DATA_PAGES_PER_SECTOR(fs);
+
+	struct sffs_metadata_header *header;
+	struct sffs_metadata_item *items;
+	if (sffs_metadata_load(fs, sector, SFFS_DATA_PAGES_PER_SECTOR(fs), &header, &items) != SFFS_CACHED_READ_OK ||
+	    sffs_metadata_header_check(fs, header) != SFFS_METADATA_HEADER_CHECK_OK) {
+		fs->mount_info.sectors_invalid++;
+		return SFFS_SECTOR_SCAN_FAILED;
+	}
+	fs->mount_info.sectors_valid++;
+	si->state = header->state;
+	si->erase_count = header->erase_count;
+
+	uint32_t recovered = 0;
+	for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs); i++) {
+		struct sffs_page page = { .sector = sector, .page = i };
+		struct sffs_metadata_item *item = &(items[i]);
+
+		/* Data write to a reserved page was interrupted, contents
+		 * are not complete. */
+		if (item->state == SFFS_PAGE_STATE_RESERVED) {
+			uint8_t page_state = SFFS_PAGE_STATE_OLD;
+			sffs_checkpoint_touch(fs, sector);
+			uint32_t state_pos = sector * SFFS_SECTOR_SIZE(fs) + sizeof(struct sffs_metadata_header) +
+				i * sizeof(struct sffs_metadata_item) + offsetof(struct sffs_metadata_item, state);
+			if (sffs_cached_write(fs, state_pos, &page_state, sizeof(page_state)) == SFFS_CACHED_WRITE_OK) {
+				item->state = page_state;
+				recovered++;
+			}
 			continue;
 		}
 
-		for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
-			uint32_t item_pos = sector * fs->sector_size + sizeof(struct sffs_metadata_header) + i * sizeof(struct sffs_metadata_item);
-			struct sffs_metadata_item item;
-			/* TODO: check return value */
-			sffs_cached_read(fs, item_pos, (uint8_t *)&item, sizeof(struct sffs_metadata_item));
+		if (item->state != SFFS_PAGE_STATE_USED && item->state != SFFS_PAGE_STATE_MOVING) {
+			continue;
+		}
+		/* Failure is not fatal here, filesystem can still be used
+		 * without the index (with degraded performance). */
+		sffs_index_update(fs, &page, item);
 
-			if (item.state == SFFS_PAGE_STATE_ERASED) {
-				page->sector = sector;
-				page->page = i;
-				return SFFS_FIND_ERASED_PAGE_OK;
-			}
+		if (item->file_id == 0 && item->block == 0 && (ms->master.sector == fs->sector_count || item->state == SFFS_PAGE_STATE_USED)) {
+			ms->master = page;
+		}
+		if (item->state == SFFS_PAGE_STATE_MOVING && ms->moving_count < SFFS_MOUNT_MOVING_PAGES) {
+			ms->moving[ms->moving_count++] = page;
 		}
 	}
 
-	return SFFS_FIND_ERASED_PAGE_NOT_FOUND;
-}
+	sffs_sector_count_pages(fs, sector, items);
+	if (recovered > 0) {
+		fs->mount_info.pages_recovered += recovered;
+		sffs_sector_commit_state(fs, sector);
+	}
 
+	return SFFS_SECTOR_SCAN_OK;
+}
 
-int32_t sffs_page_addr(struct sffs *fs, struct sffs_page *page, uint32_t *addr) {
-	assert(page != NULL);
-	assert(addr != NULL);
 
-	*addr = page->sector * fs->sector_size + (fs->first_data_page + page->page) * fs->page_size;
+#if SFFS_INDEX_SIZE > 0
+/* Read data of the checkpoint file. One page is kept in the page_data buffer,
+ * block is the number of the block loaded. Returns 0 on success or -1 if the
+ * block doesn't exist or it cannot be read. */
+static int32_t sffs_checkpoint_read(struct sffs *fs, uint32_t pos, uint8_t *data, uint32_t len, uint8_t *page_data, uint32_t *block) {
+	while (len > 0) {
+		uint32_t offset = pos % SFFS_PAGE_SIZE(fs);
+		uint32_t chunk = MIN(len, SFFS_PAGE_SIZE(fs) - offset);
 
-	return SFFS_PAGE_ADDR_OK;
-}
+		if (*block != pos / SFFS_PAGE_SIZE(fs)) {
+			struct sffs_page page;
+			uint32_t addr;
+			if (sffs_index_lookup(fs, SFFS_CHECKPOINT_FILE_ID, pos / SFFS_PAGE_SIZE(fs), &page) != SFFS_INDEX_LOOKUP_OK) {
+				return -1;
+			}
+			sffs_page_addr(fs, &page, &addr);
+			if (sffs_cached_read(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_READ_OK) {
+				return -1;
+			}
+			*block = pos / SFFS_PAGE_SIZE(fs);
+		}
+		memcpy(data, &(page_data[offset]), chunk);
 
+		pos += chunk;
+		data += chunk;
+		len -= chunk;
+	}
 
-int32_t sffs_sector_format(struct sffs *fs, uint32_t sector) {
-	assert(fs != NULL);
-	assert(sector < fs->sector_count);
+	return 0;
+}
 
-	flash_sector_erase(fs->flash, sector * fs->sector_size);
 
-	/* prepare and write sector header */
-	struct sffs_metadata_header header;
-	header.magic = SFFS_METADATA_MAGIC;
-	header.state = SFFS_SECTOR_STATE_ERASED;
-	/* TODO: fill other fields */
-	flash_page_write(fs->flash, fs->sector_size * sector, (uint8_t *)&header, sizeof(header));
+/* Append data to the checkpoint file being written. Full pages are written at
+ * the file position. Returns 0 on success or -1 if error occured. */
+static int32_t sffs_checkpoint_append(struct sffs_file *f, uint8_t *page_data, uint32_t *fill, const uint8_t *data, uint32_t len) {
+	struct sffs *fs = f->fs;
 
-	/* prepare and write sector metadata items */
-	for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
-		struct sffs_metadata_item item;
-		item.file_id = 0xffff;
-		item.block = 0xffff;
-		item.state = SFFS_PAGE_STATE_ERASED;
-		item.size = 0xffff;
+	while (len > 0) {
+		uint32_t chunk = MIN(len, SFFS_PAGE_SIZE(fs) - *fill);
+		memcpy(&(page_data[*fill]), data, chunk);
+		*fill += chunk;
+		data += chunk;
+		len -= chunk;
 
-		/* sffs_set_page_metadata cannot be used here as the remaining sector
-		 * metadata are not complete yet and function will fail during sector
-		 * metadata update */
-		flash_page_write(fs->flash, fs->sector_size * sector + sizeof(header) + i * sizeof(item), (uint8_t *)&item, sizeof(item));
+		if (*fill == SFFS_PAGE_SIZE(fs)) {
+			if (sffs_write_pages(f, f->pos, page_data, SFFS_PAGE_SIZE(fs)) != 0) {
+				return -1;
+			}
+			f->pos += SFFS_PAGE_SIZE(fs);
+			*fill = 0;
+		}
 	}
 
-	return SFFS_SECTOR_FORMAT_OK;
+	return 0;
 }
+#endif
 
 
-int32_t sffs_sector_collect_garbage(struct sffs *fs, uint32_t sector) {
-	assert(fs != NULL);
-	assert(sector < fs->sector_count);
+/* Restore sector summary and block index entries of sectors not modified since
+ * the checkpoint was written. Sectors holding the checkpoint file are found by
+ * reading their headers only and they are replayed first. Bits of sectors
+ * which don't need to be replayed anymore are cleared in the replay bitmap. */
+static int32_t sffs_checkpoint_load(struct sffs *fs, struct sffs_mount_state *ms, uint8_t *replay) {
+#if SFFS_INDEX_SIZE > 0
+	uint32_t flagged = 0;
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+		si->state = 0;
+		si->erased = 0;
+		si->used = 0;
+		si->old = 0;
+		si->erase_count = 0;
+		si->next_free = SFFS_DATA_PAGES_PER_SECTOR(fs);
 
-	struct sffs_metadata_header header;
-	if (sffs_cached_read(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header)) != SFFS_CACHED_READ_OK) {
-		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
-	}
+		struct sffs_metadata_header header;
+		if (sffs_flash_read(fs, sector * SFFS_SECTOR_SIZE(fs), (uint8_t *)&header, sizeof(header)) != SFFS_CACHED_READ_OK ||
+		    sffs_metadata_header_check(fs, &header) != SFFS_METADATA_HEADER_CHECK_OK) {
+			fs->mount_info.sectors_invalid++;
+			replay[sector / 8] &= ~(1 << (sector % 8));
+			continue;
+		}
+		si->state = header.state;
+		si->erase_count = header.erase_count;
 
-	if (sffs_metadata_header_check(fs, &header) != SFFS_METADATA_HEADER_CHECK_OK) {
-		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+		if ((header.reserved & SFFS_SECTOR_FLAG_CHECKPOINT) == 0) {
+			replay[sector / 8] &= ~(1 << (sector % 8));
+			sffs_mount_sector(fs, sector, ms);
+			flagged++;
+		}
+	}
+	if (flagged == 0) {
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	if (header.state == SFFS_SECTOR_STATE_OLD) {
-		sffs_sector_format(fs, sector);
+	uint8_t *page_data = &(fs->scratch[fs->scratch_size]);
+	uint32_t block = 0xffffffff;
+	uint32_t bitmap_len = (fs->sector_count + 7) / 8;
+	struct sffs_checkpoint_header ch;
+	if (sffs_checkpoint_read(fs, 0, (uint8_t *)&ch, sizeof(ch), page_data, &block) != 0 ||
+	    ch.magic != SFFS_CHECKPOINT_MAGIC ||
+	    ch.sector_count != fs->sector_count ||
+	    ch.data_pages_per_sector != SFFS_DATA_PAGES_PER_SECTOR(fs) ||
+	    ch.record_size != sizeof(struct sffs_sector_info) ||
+	    ch.entry_size != sizeof(struct sffs_index_entry) ||
+	    sizeof(ch) + bitmap_len > SFFS_PAGE_SIZE(fs)) {
+		return SFFS_CHECKPOINT_FAILED;
+	}
+	uint8_t bitmap[(SFFS_MAX_SECTORS + 7) / 8];
+	if (sffs_checkpoint_read(fs, sizeof(ch), bitmap, bitmap_len, page_data, &block) != 0) {
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	return SFFS_SECTOR_COLLECT_GARBAGE_OK;
-}
+	/* Sector is restored only if it was not modified since the checkpoint
+	 * and its header still matches. */
+	uint8_t restored[(SFFS_MAX_SECTORS + 7) / 8];
+	memset(restored, 0, sizeof(restored));
+	uint32_t pos = SFFS_PAGE_SIZE(fs);
+	uint32_t failed = 0;
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		struct sffs_sector_info rec;
+		if (sffs_checkpoint_read(fs, pos, (uint8_t *)&rec, sizeof(rec), page_data, &block) != 0) {
+			failed = 1;
+			break;
+		}
+		pos += sizeof(rec);
+
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+		uint8_t bit = 1 << (sector % 8);
+		if ((replay[sector / 8] & bit) && (bitmap[sector / 8] & bit) &&
+		    si->state != 0 && si->state == rec.state && si->erase_count == rec.erase_count &&
+		    rec.next_free <= SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+			si->erased = rec.erased;
+			si->used = rec.used;
+			si->old = rec.old;
+			sffs_sector_set_next_free(fs, si, rec.next_free);
+			restored[sector / 8] |= bit;
+			replay[sector / 8] &= ~bit;
+			fs->mount_info.sectors_restored++;
+			fs->mount_info.sectors_valid++;
+		}
+	}
 
+	for (uint32_t i = 0; i < ch.entries && !failed; i++) {
+		struct sffs_index_entry entry;
+		if (sffs_checkpoint_read(fs, pos, (uint8_t *)&entry, sizeof(entry), page_data, &block) != 0) {
+			failed = 1;
+			break;
+		}
+		pos += sizeof(entry);
 
-int32_t sffs_update_sector_metadata(struct sffs *fs, uint32_t sector) {
-	assert(fs != NULL);
-	assert(sector < fs->sector_count);
+		if (entry.sector >= fs->sector_count || !(restored[entry.sector / 8] & (1 << (entry.sector % 8)))) {
+			continue;
+		}
+		struct sffs_page page = { .sector = entry.sector, .page = entry.page };
+		struct sffs_metadata_item item = {
+			.file_id = entry.file_id,
+			.block = entry.block,
+			.state = SFFS_PAGE_STATE_USED,
+			.size = entry.size,
+			.reserved = 0xff,
+		};
+		sffs_index_update(fs, &page, &item);
+		if (entry.file_id == 0 && entry.block == 0) {
+			ms->master = page;
+		}
+	}
 
-	struct sffs_metadata_header header;
-	if (sffs_cached_read(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header)) != SFFS_CACHED_READ_OK) {
-		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	/* Restored sectors are replayed again if the checkpoint cannot be read
+	 * completely. Index entries already inserted are the same. */
+	if (failed) {
+		for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+			if (restored[sector / 8] & (1 << (sector % 8))) {
+				sffs_sector_set_next_free(fs, &(fs->sectors[sector]), SFFS_DATA_PAGES_PER_SECTOR(fs));
+				replay[sector / 8] |= 1 << (sector % 8);
+				fs->mount_info.sectors_restored--;
+				fs->mount_info.sectors_valid--;
+			}
+		}
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	if (sffs_metadata_header_check(fs, &header) != SFFS_METADATA_HEADER_CHECK_OK) {
-		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	struct sffs_page page;
+	sffs_index_lookup(fs, SFFS_CHECKPOINT_FILE_ID, 0, &page);
+	sffs_page_addr(fs, &page, &(fs->checkpoint_bitmap_addr));
+	fs->checkpoint_bitmap_addr += sizeof(ch);
+	memcpy(fs->checkpoint_dirty, bitmap, bitmap_len);
+	fs->checkpoint_gen = ch.generation;
+	fs->checkpoint_active = 1;
+
+	/* sectors not matching the checkpoint cannot be restored next time */
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		if (!(restored[sector / 8] & (1 << (sector % 8)))) {
+			sffs_checkpoint_touch(fs, sector);
+		}
 	}
 
-	uint8_t old_state = header.state;
+	return SFFS_CHECKPOINT_OK;
+#else
+	(void)fs;
+	(void)ms;
+	(void)replay;
 
-	uint32_t p_erased = 0;
-	uint32_t p_reserved = 0;
-	uint32_t p_used = 0;
-	uint32_t p_moving = 0;
-	uint32_t p_old = 0;
+	return SFFS_CHECKPOINT_FAILED;
+#endif
+}
 
 
-	for (uint32_t i = 0; i < fs->data_pages_per_sector; i++) {
-		struct sffs_metadata_item item;
-		sffs_get_page_metadata(fs, &(struct sffs_page){ .sector = sector, .page = i }, &item);
+/* Sector is going to be modified, its summary in the checkpoint is not valid
+ * anymore. The bit is cleared in the dirty bitmap before the modification. */
+static void sffs_checkpoint_touch(struct sffs *fs, uint32_t sector) {
+#if SFFS_INDEX_SIZE > 0
+	uint8_t bit = 1 << (sector % 8);
+	if (!(fs->checkpoint_active || fs->checkpoint_writing) || !(fs->checkpoint_dirty[sector / 8] & bit)) {
+		return;
+	}
 
-		if (item.state == SFFS_PAGE_STATE_ERASED) p_erased++;
-		if (item.state == SFFS_PAGE_STATE_RESERVED) p_reserved++;
-		if (item.state == SFFS_PAGE_STATE_USED) p_used++;
-		if (item.state == SFFS_PAGE_STATE_MOVING) p_moving++;
-		if (item.state == SFFS_PAGE_STATE_OLD) p_old++;
+	fs->checkpoint_dirty[sector / 8] &= ~bit;
+	if (fs->checkpoint_active) {
+		sffs_cached_write(fs, fs->checkpoint_bitmap_addr + sector / 8, &(fs->checkpoint_dirty[sector / 8]), 1);
 	}
+#else
+	(void)fs;
+	(void)sector;
+#endif
+}
 
-	int update_ok = 0;
 
-	if (p_erased == fs->data_pages_per_sector && p_reserved == 0 && p_used == 0 && p_moving == 0 && p_old == 0) {
-		header.state = SFFS_SECTOR_STATE_ERASED;
-		update_ok = 1;
+/* Mark all sectors dirty, the checkpoint is not used anymore. */
+static void sffs_checkpoint_drop(struct sffs *fs) {
+#if SFFS_INDEX_SIZE > 0
+	if (!fs->checkpoint_active) {
+		return;
 	}
 
-	if (p_erased > 0 && (p_reserved > 0 || p_used > 0 || p_moving > 0 || p_old > 0)) {
-		header.state = SFFS_SECTOR_STATE_USED;
-		update_ok = 1;
-	}
+	fs->checkpoint_active = 0;
+	memset(fs->checkpoint_dirty, 0, sizeof(fs->checkpoint_dirty));
+	sffs_cached_write(fs, fs->checkpoint_bitmap_addr, fs->checkpoint_dirty, (fs->sector_count + 7) / 8);
+#else
+	(void)fs;
+#endif
+}
 
-	if (p_erased == 0 && p_old == 0) {
-		header.state = SFFS_SECTOR_STATE_FULL;
-		update_ok = 1;
-	}
 
-	if (p_erased == 0 && (p_reserved + p_used + p_moving + p_old) == fs->data_pages_per_sector) {
-		header.state = SFFS_SECTOR_STATE_DIRTY;
-		update_ok = 1;
+static int32_t sffs_do_checkpoint(struct sffs *fs) {
+	assert(fs != NULL);
+
+#if SFFS_INDEX_SIZE > 0
+	uint32_t bitmap_len = (fs->sector_count + 7) / 8;
+	if (!fs->index_valid || sizeof(struct sffs_checkpoint_header) + bitmap_len > SFFS_PAGE_SIZE(fs)) {
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	if (p_old == fs->data_pages_per_sector) {
-		header.state = SFFS_SECTOR_STATE_OLD;
-		update_ok = 1;
+	/* previous checkpoint is removed first */
+	uint32_t file_id = SFFS_CHECKPOINT_FILE_ID;
+	sffs_checkpoint_drop(fs);
+	if (sffs_do_remove_many(fs, &file_id, 1) != SFFS_REMOVE_MANY_OK) {
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	if (update_ok == 1) {
-		/* New sector state cannot be greater than the old one
-		 * (otherwise the sector metadata would need to be erased first).
-		 * This would indicate error in metadata manipulation. */
-		assert(header.state <= old_state);
+	/* garbage collection is suppressed while the checkpoint is being
+	 * written, all pages must be available in advance */
+	uint32_t len = fs->sector_count * sizeof(struct sffs_sector_info) + fs->index_used * sizeof(struct sffs_index_entry);
+	uint32_t pages = 1 + (len + SFFS_PAGE_SIZE(fs) - 1) / SFFS_PAGE_SIZE(fs);
+	if (fs->free_pages < pages + SFFS_GC_RESERVE_SECTORS * SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		return SFFS_CHECKPOINT_FAILED;
+	}
 
-		if (old_state != header.state) {
+	/* Sectors modified while the checkpoint is being written are marked
+	 * dirty in the bitmap written to the first block. */
+	fs->checkpoint_gen++;
+	memset(fs->checkpoint_dirty, 0xff, sizeof(fs->checkpoint_dirty));
+	fs->checkpoint_writing = 1;
+	fs->gc_running = 1;
 
-			if (sffs_cached_write(fs, sector * fs->sector_size, (uint8_t *)&header, sizeof(header)) != SFFS_CACHED_WRITE_OK) {
-				return SFFS_UPDATE_SECTOR_METADATA_FAILED;
-			}
+	struct sffs_file f;
+	f.fs = fs;
+	f.file_id = SFFS_CHECKPOINT_FILE_ID;
+	f.pos = SFFS_PAGE_SIZE(fs);
+	f.blocks = 0;
+	f.tail_gen = fs->page_gen;
+	f.extent = 0;
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	f.wbuf_len = 0;
+#endif
+	f.next = NULL;
+
+	uint8_t *page_data = &(fs->scratch[fs->scratch_size]);
+	uint32_t fill = 0;
+	int32_t ret = 0;
+	for (uint32_t sector = 0; sector < fs->sector_count && ret == 0; sector++) {
+		ret = sffs_checkpoint_append(&f, page_data, &fill, (uint8_t *)&(fs->sectors[sector]), sizeof(struct sffs_sector_info));
+	}
 
-			sffs_sector_collect_garbage(fs, sector);
+	/* No entries are removed while garbage collection is suppressed, new
+	 * entries of the checkpoint file are skipped. */
+	uint32_t entries = 0;
+	for (uint32_t i = 0; i < fs->index_size && ret == 0; i++) {
+		if (fs->index[i].file_id == 0xffff || fs->index[i].file_id == SFFS_CHECKPOINT_FILE_ID) {
+			continue;
 		}
+		ret = sffs_checkpoint_append(&f, page_data, &fill, (uint8_t *)&(fs->index[i]), sizeof(struct sffs_index_entry));
+		entries++;
+	}
+	if (ret == 0 && fill > 0) {
+		ret = sffs_write_pages(&f, f.pos, page_data, fill);
+	}
 
-		return SFFS_UPDATE_SECTOR_METADATA_OK;
+	/* first block is written last, the checkpoint is not valid without it */
+	struct sffs_checkpoint_header ch = {
+		.magic = SFFS_CHECKPOINT_MAGIC,
+		.generation = fs->checkpoint_gen,
+		.sector_count = fs->sector_count,
+		.data_pages_per_sector = SFFS_DATA_PAGES_PER_SECTOR(fs),
+		.record_size = sizeof(struct sffs_sector_info),
+		.entry_size = sizeof(struct sffs_index_entry),
+		.entries = entries,
+	};
+	memcpy(page_data, &ch, sizeof(ch));
+	memcpy(&(page_data[sizeof(ch)]), fs->checkpoint_dirty, bitmap_len);
+	if (ret == 0) {
+		ret = sffs_write_pages(&f, 0, page_data, sizeof(ch) + bitmap_len);
+	}
+
+	struct sffs_page page;
+	if (ret == 0 && fs->index_valid && sffs_index_lookup(fs, SFFS_CHECKPOINT_FILE_ID, 0, &page) == SFFS_INDEX_LOOKUP_OK) {
+		sffs_page_addr(fs, &page, &(fs->checkpoint_bitmap_addr));
+		fs->checkpoint_bitmap_addr += sizeof(ch);
+		fs->checkpoint_active = 1;
+
+		/* sectors modified while the first block was written */
+		sffs_cached_write(fs, fs->checkpoint_bitmap_addr, fs->checkpoint_dirty, bitmap_len);
+	} else {
+		ret = -1;
+	}
+	fs->checkpoint_writing = 0;
+	fs->gc_running = 0;
+
+	if (ret != 0) {
+		/* incomplete checkpoint file is not valid */
+		sffs_do_remove_many(fs, &file_id, 1);
+		return SFFS_CHECKPOINT_FAILED;
 	}
 
-	assert(0);
-	return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	return SFFS_CHECKPOINT_OK;
+#else
+	return SFFS_CHECKPOINT_FAILED;
+#endif
 }
 
 
-int32_t sffs_get_page_metadata(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item) {
+int32_t sffs_checkpoint(struct sffs *fs) {
 	assert(fs != NULL);
-	assert(page != NULL);
-	assert(item != NULL);
 
-	uint32_t item_pos = page->sector * fs->sector_size + sizeof(struct sffs_metadata_header) + page->page * sizeof(struct sffs_metadata_item);
-	sffs_cached_read(fs, item_pos, (uint8_t *)item, sizeof(struct sffs_metadata_item));
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_CHECKPOINT, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_checkpoint(fs);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_free(struct sffs *fs) {
+	assert(fs != NULL);
+
+	/* nothing to do yet */
+	return SFFS_FREE_OK;
+}
+
+
+int32_t sffs_cache_clear(struct sffs *fs) {
+	assert(fs != NULL);
+
+#if SFFS_CACHE_PAGES > 0
+	for (uint32_t i = 0; i < fs->cache_pages; i++) {
+		fs->cache[i].addr = SFFS_CACHE_EMPTY;
+		fs->cache[i].referenced = 0;
+		fs->cache[i].pinned = 0;
+	}
+	fs->cache_hand = 0;
+	fs->cache_last = 0;
+	fs->cache_pinned = 0;
+#endif
+
+	return SFFS_CACHE_CLEAR_OK;
+}
+
+
+int32_t sffs_cache_invalidate(struct sffs *fs, uint32_t addr, uint32_t len) {
+	assert(fs != NULL);
+
+#if SFFS_CACHE_PAGES > 0
+	for (uint32_t i = 0; i < fs->cache_pages; i++) {
+		if (fs->cache[i].addr != SFFS_CACHE_EMPTY && fs->cache[i].addr + SFFS_PAGE_SIZE(fs) > addr && fs->cache[i].addr < addr + len) {
+			fs->cache[i].addr = SFFS_CACHE_EMPTY;
+			fs->cache[i].referenced = 0;
+		}
+	}
+#endif
+
+	return SFFS_CACHE_INVALIDATE_OK;
+}
+
+
+int32_t sffs_format(struct sffs *fs, struct flash_dev *flash) {
+	assert(flash != NULL);
+
+	return sffs_format_label(fs, flash, NULL);
+}
+
+
+int32_t sffs_format_label(struct sffs *fs, struct flash_dev *flash, const char *label) {
+	assert(flash != NULL);
+
+	return sffs_format_geometry(fs, flash, label, 0);
+}
+
+
+int32_t sffs_format_geometry(struct sffs *fs, struct flash_dev *flash, const char *label, uint32_t page_shift) {
+	assert(fs != NULL);
+	assert(flash != NULL);
+
+	/* state of opened files would not be valid anymore */
+	if (fs->files != NULL) {
+		return SFFS_FORMAT_FAILED;
+	}
+
+	struct flash_info info;
+	flash_get_info(flash, &info);
+
+	/* we need to simulate filesystem structure somehow (sector format functions
+	 * operate on mounted filesystem). For this purpose the filesystem provided
+	 * by the caller is mounted. Mount fails if the flash contains no valid
+	 * sectors, we ignore this silently, return code is intentionally
+	 * unchecked. Erase counts are lost if the flash was formatted with
+	 * logical pages larger than the scratch pages. */
+	memset(fs->sectors, 0, sizeof(fs->sectors));
+	sffs_mount(fs, flash);
+
+	/* Erase counts are kept from the mount, the geometry is replaced. The
+	 * mount could have failed before the summary was initialized. */
+	if (sffs_set_geometry(fs, &info, page_shift) != 0 || SFFS_PAGE_SIZE(fs) > fs->scratch_size) {
+		return SFFS_FORMAT_FAILED;
+	}
+#if SFFS_CACHE_PAGES > 0
+	fs->cache_enabled = (fs->cache_pages > 0 && SFFS_PAGE_SIZE(fs) <= fs->cache_page_size);
+#endif
+	sffs_cache_clear(fs);
+	fs->free_pages = 0;
+	fs->alloc_sector = fs->sector_count;
+	memset(fs->extent_reserved, 0, sizeof(fs->extent_reserved));
+	fs->gc_running = 0;
+	fs->gc_victim = fs->sector_count;
+	fs->gc_page = 0;
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		fs->sectors[sector].next_free = SFFS_DATA_PAGES_PER_SECTOR(fs);
+	}
+#if SFFS_INDEX_SIZE > 0
+	fs->checkpoint_active = 0;
+	fs->checkpoint_writing = 0;
+#endif
+
+	/* now iterate over all sectors and format them */
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		if (sffs_sector_format(fs, sector) != SFFS_SECTOR_FORMAT_OK) {
+			return SFFS_FORMAT_FAILED;
+		}
+	}
+	/* blocks found by the mount above are gone */
+	sffs_index_reset(fs);
+	/* Write master page as block 0 of file "0" using the same sequence
+	 * as sffs_write uses for a new block. */
+	struct sffs_master_page mp;
+	memset(&mp, 0, sizeof(mp));
+	mp.magic = SFFS_MASTER_MAGIC;
+	while ((1UL << mp.page_size) < SFFS_PAGE_SIZE(fs)) {
+		mp.page_size++;
+	}
+	while ((1UL << mp.sector_size) < SFFS_SECTOR_SIZE(fs)) {
+		mp.sector_size++;
+	}
+	mp.sector_count = fs->sector_count;
+	if (label != NULL) {
+		/* strnlen is not available in C99 */
+		uint32_t label_len = 0;
+		while (label_len < sizeof(mp.label) && label[label_len] != '\0') {
+			label_len++;
+		}
+		memcpy(mp.label, label, label_len);
+	}
+
+	struct sffs_page page;
+	if (sffs_find_erased_page(fs, &page) != SFFS_FIND_ERASED_PAGE_OK) {
+		return SFFS_FORMAT_FAILED;
+	}
+	sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_RESERVED);
+	uint32_t addr;
+	sffs_page_addr(fs, &page, &addr);
+	if (sffs_cached_write(fs, addr, (uint8_t *)&mp, sizeof(mp)) != SFFS_CACHED_WRITE_OK) {
+		return SFFS_FORMAT_FAILED;
+	}
+	struct sffs_metadata_item item;
+	item.file_id = 0;
+	item.block = 0;
+	item.state = SFFS_PAGE_STATE_USED;
+	item.size = sizeof(mp);
+	item.reserved = 0xff;
+	sffs_set_page_metadata(fs, &page, &item);
+
+	return SFFS_FORMAT_OK;
+}
+
+
+/* Read sector header and first count metadata items to the metadata buffer in
+ * one request. */
+static int32_t sffs_metadata_load(struct sffs *fs, uint32_t sector, uint32_t count, struct sffs_metadata_header **header, struct sffs_metadata_item **items) {
+	uint32_t len = sizeof(struct sffs_metadata_header) + count * sizeof(struct sffs_metadata_item);
+	assert(len <= SFFS_METADATA_BUF_SIZE);
+
+	fs->stats.sector_scans++;
+	if (sffs_cached_read(fs, sector * SFFS_SECTOR_SIZE(fs), fs->metadata_buf, len) != SFFS_CACHED_READ_OK) {
+		return SFFS_CACHED_READ_FAILED;
+	}
+	/* metadata structures are packed, the buffer needs no alignment */
+	*header = (struct sffs_metadata_header *)fs->metadata_buf;
+	*items = (struct sffs_metadata_item *)&(fs->metadata_buf[sizeof(struct sffs_metadata_header)]);
+
+	return SFFS_CACHED_READ_OK;
+}
+
+
+int32_t sffs_sector_debug_print(struct sffs *fs, uint32_t sector) {
+	assert(fs != NULL);
+	assert(sector < fs->sector_count);
+
+	struct sffs_metadata_header *header;
+	struct sffs_metadata_item *items;
+	if (sffs_metadata_load(fs, sector, SFFS_DATA_PAGES_PER_SECTOR(fs), &header, &items) != SFFS_CACHED_READ_OK) {
+		return SFFS_SECTOR_DEBUG_PRINT_FAILED;
+	}
+
+	char sector_state = '?';
+	if (header->state == SFFS_SECTOR_STATE_ERASED) sector_state = ' ';
+	if (header->state == SFFS_SECTOR_STATE_USED) sector_state = 'U';
+	if (header->state == SFFS_SECTOR_STATE_FULL) sector_state = 'F';
+	if (header->state == SFFS_SECTOR_STATE_DIRTY) sector_state = 'D';
+	if (header->state == SFFS_SECTOR_STATE_OLD) sector_state = 'O';
+	printf("%04d [%c]: ", sector, sector_state);
+
+	for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs); i++) {
+		char page_state = '?';
+		if (items[i].state == SFFS_PAGE_STATE_ERASED) page_state = ' ';
+		if (items[i].state == SFFS_PAGE_STATE_USED) page_state = 'U';
+		if (items[i].state == SFFS_PAGE_STATE_MOVING) page_state = 'M';
+		if (items[i].state == SFFS_PAGE_STATE_RESERVED) page_state = 'R';
+		if (items[i].state == SFFS_PAGE_STATE_OLD) page_state = 'O';
+		printf("[%c] ", page_state);
+	}
+	printf("\n");
+
+	return SFFS_SECTOR_DEBUG_PRINT_OK;
+}
+
+
+int32_t sffs_debug_print(struct sffs *fs) {
+	assert(fs != NULL);
+
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		sffs_sector_debug_print(fs, sector);
+	}
+	printf("\n");
+
+	return SFFS_DEBUG_PRINT_OK;
+}
+
+int32_t sffs_stats_print(struct sffs *fs) {
+	assert(fs != NULL);
+
+	struct sffs_stats *st = &(fs->stats);
+	printf("reads %u (%u B), programs %u (%u B), erases %u, cache %u/%u, gc moves %u, scans %u, user %u B read, %u B written\n",
+		st->flash_reads, st->flash_read_bytes, st->flash_programs, st->flash_program_bytes, st->flash_erases,
+		st->cache_hits, st->cache_hits + st->cache_misses, st->gc_moves, st->sector_scans,
+		st->user_read_bytes, st->user_write_bytes);
+
+#if SFFS_OP_STATS
+	static const char *names[SFFS_OP_COUNT] = {
+		"mount", "open", "close", "flush", "write", "read", "remove", "size", "gc", "checkpoint"
+	};
+	for (uint32_t i = 0; i < SFFS_OP_COUNT; i++) {
+		struct sffs_op_stats *os = &(fs->op_stats[i]);
+		if (os->calls == 0) {
+			continue;
+		}
+		printf("%-10s calls %u, reads %u (%u B), programs %u (%u B), erases %u, user %u B, %u us\n",
+			names[i], os->calls, os->flash_reads, os->flash_read_bytes, os->flash_programs,
+			os->flash_program_bytes, os->flash_erases, os->user_bytes, os->time_us);
+	}
+#endif
+
+	return SFFS_STATS_PRINT_OK;
+}
+
+
+int32_t sffs_stats_reset(struct sffs *fs) {
+	assert(fs != NULL);
+
+	memset(&(fs->stats), 0, sizeof(fs->stats));
+#if SFFS_OP_STATS
+	memset(fs->op_stats, 0, sizeof(fs->op_stats));
+#endif
+
+	return SFFS_STATS_RESET_OK;
+}
+
+
+int32_t sffs_set_hook(struct sffs *fs, void (*hook)(struct sffs *fs, uint32_t op, uint32_t phase, void *ctx), void *ctx) {
+	assert(fs != NULL);
+
+#if SFFS_OP_STATS
+	fs->hook = hook;
+	fs->hook_ctx = ctx;
+
+	return SFFS_SET_HOOK_OK;
+#else
+	(void)hook;
+	(void)ctx;
+
+	return SFFS_SET_HOOK_FAILED;
+#endif
+}
+
+
+int32_t sffs_set_lock(struct sffs *fs, const struct sffs_lock_ops *ops, void *fs_lock, void *cache_lock) {
+	assert(fs != NULL);
+	assert(ops == NULL || (ops->lock != NULL && ops->unlock != NULL));
+
+#if SFFS_LOCKING
+	fs->lock_ops = ops;
+	fs->fs_lock = fs_lock;
+	fs->cache_lock = cache_lock;
+
+	return SFFS_SET_LOCK_OK;
+#else
+	(void)ops;
+	(void)fs_lock;
+	(void)cache_lock;
+
+	return SFFS_SET_LOCK_FAILED;
+#endif
+}
+
+
+int32_t sffs_file_set_lock(struct sffs_file *f, void *lock) {
+	assert(f != NULL);
+
+#if SFFS_LOCKING
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_FILE_SET_LOCK_FAILED;
+	}
+	f->lock = lock;
+
+	return SFFS_FILE_SET_LOCK_OK;
+#else
+	(void)lock;
+
+	return SFFS_FILE_SET_LOCK_FAILED;
+#endif
+}
+
+
+int32_t sffs_metadata_header_check(struct sffs *fs, struct sffs_metadata_header *header) {
+	assert(header != NULL);
+	assert(fs != NULL);
+
+	/* check magic number */
+	if (header->magic != SFFS_METADATA_MAGIC) {
+		return SFFS_METADATA_HEADER_CHECK_FAILED;
+	}
+
+	/* sectors formatted with different logical page size cannot be used */
+	if (SFFS_SECTOR_PAGE_SHIFT(header->reserved) != fs->page_shift) {
+		return SFFS_METADATA_HEADER_CHECK_FAILED;
+	}
+
+	return SFFS_METADATA_HEADER_CHECK_OK;
+}
+
+
+#if SFFS_CACHE_PAGES > 0
+static struct sffs_cache_page *sffs_cache_find(struct sffs *fs, uint32_t page_addr) {
+	/* metadata items are usually read in sequence, try the last hit first */
+	if (fs->cache[fs->cache_last].addr == page_addr) {
+		return &(fs->cache[fs->cache_last]);
+	}
+
+	for (uint32_t i = 0; i < fs->cache_pages; i++) {
+		if (fs->cache[i].addr == page_addr) {
+			fs->cache_last = i;
+			return &(fs->cache[i]);
+		}
+	}
+
+	return NULL;
+}
+
+
+static struct sffs_cache_page *sffs_cache_victim(struct sffs *fs) {
+	/* CLOCK replacement, referenced pages get second chance, pinned pages
+	 * are skipped (at least one page is never pinned) */
+	while (fs->cache[fs->cache_hand].pinned || (fs->cache[fs->cache_hand].addr != SFFS_CACHE_EMPTY && fs->cache[fs->cache_hand].referenced)) {
+		fs->cache[fs->cache_hand].referenced = 0;
+		fs->cache_hand = (fs->cache_hand + 1) % fs->cache_pages;
+	}
+	struct sffs_cache_page *cp = &(fs->cache[fs->cache_hand]);
+	fs->cache_hand = (fs->cache_hand + 1) % fs->cache_pages;
+	cp->addr = SFFS_CACHE_EMPTY;
+
+	return cp;
+}
+
+
+static struct sffs_cache_page *sffs_cache_load(struct sffs *fs, uint32_t page_addr) {
+	struct sffs_cache_page *cp = sffs_cache_victim(fs);
+
+	fs->stats.flash_reads++;
+	fs->stats.flash_read_bytes += SFFS_PAGE_SIZE(fs);
+	/* a logical page spans 2^page_shift physical pages, flash_page_read
+	 * cannot cross the physical page boundary */
+	if (flash_read(fs->flash, page_addr, cp->data, SFFS_PAGE_SIZE(fs)) != FLASH_READ_OK) {
+		return NULL;
+	}
+	cp->addr = page_addr;
+	cp->referenced = 1;
+	fs->cache_last = cp - fs->cache;
+
+	return cp;
+}
+#endif
+
+
+int32_t sffs_cache_insert(struct sffs *fs, uint32_t addr, const uint8_t *data) {
+	assert(fs != NULL);
+	assert(data != NULL);
+
+#if SFFS_CACHE_PAGES > 0
+	if (fs->cache_enabled && (addr % SFFS_PAGE_SIZE(fs)) == 0) {
+		struct sffs_cache_page *cp = sffs_cache_find(fs, addr);
+		if (cp == NULL) {
+			cp = sffs_cache_victim(fs);
+		}
+		memcpy(cp->data, data, SFFS_PAGE_SIZE(fs));
+		cp->addr = addr;
+		cp->referenced = 1;
+		fs->cache_last = cp - fs->cache;
+	}
+#endif
+
+	return SFFS_CACHE_INSERT_OK;
+}
+
+
+int32_t sffs_cached_read(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len) {
+	assert(fs != NULL);
+	assert(data != NULL);
+
+	int32_t ret = SFFS_CACHED_READ_OK;
+	sffs_cache_lock(fs);
+#if SFFS_CACHE_PAGES > 0
+	if (fs->cache_enabled) {
+		while (len > 0) {
+			uint32_t page_addr = addr - addr % SFFS_PAGE_SIZE(fs);
+			uint32_t offset = addr - page_addr;
+			uint32_t chunk = MIN(len, SFFS_PAGE_SIZE(fs) - offset);
+
+			struct sffs_cache_page *cp = sffs_cache_find(fs, page_addr);
+			if (cp != NULL) {
+				cp->referenced = 1;
+				fs->stats.cache_hits++;
+			} else {
+				fs->stats.cache_misses++;
+				if ((cp = sffs_cache_load(fs, page_addr)) == NULL) {
+					ret = SFFS_CACHED_READ_FAILED;
+					break;
+				}
+			}
+			memcpy(data, &(cp->data[offset]), chunk);
+
+			addr += chunk;
+			data += chunk;
+			len -= chunk;
+		}
+		sffs_cache_unlock(fs);
+
+		return ret;
+	}
+#endif
+
+	fs->stats.flash_reads++;
+	fs->stats.flash_read_bytes += len;
+	if (flash_read(fs->flash, addr, data, len) != FLASH_READ_OK) {
+		ret = SFFS_CACHED_READ_FAILED;
+	}
+	sffs_cache_unlock(fs);
+
+	return ret;
+}
+
+
+int32_t sffs_cached_write(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len) {
+	assert(fs != NULL);
+	assert(data != NULL);
+
+	fs->stats.flash_programs++;
+	fs->stats.flash_program_bytes += len;
+	if (flash_program(fs->flash, addr, data, len) != FLASH_PROGRAM_OK) {
+		return SFFS_CACHED_WRITE_FAILED;
+	}
+
+#if SFFS_CACHE_PAGES > 0
+	if (fs->cache_enabled) {
+		/* write-through, update cached copies the same way as flash does */
+		while (len > 0) {
+			uint32_t page_addr = addr - addr % SFFS_PAGE_SIZE(fs);
+			uint32_t offset = addr - page_addr;
+			uint32_t chunk = MIN(len, SFFS_PAGE_SIZE(fs) - offset);
+
+			struct sffs_cache_page *cp = sffs_cache_find(fs, page_addr);
+			if (cp != NULL) {
+				for (uint32_t i = 0; i < chunk; i++) {
+					cp->data[offset + i] &= data[i];
+				}
+			}
+
+			addr += chunk;
+			data += chunk;
+			len -= chunk;
+		}
+	}
+#endif
+
+	return SFFS_CACHED_WRITE_OK;
+}
+
+
+#if SFFS_INDEX_SIZE > 0
+static uint32_t sffs_index_hash(struct sffs *fs, uint32_t file_id, uint32_t block) {
+	uint32_t h = (((file_id & 0xffff) << 16) | (block & 0xffff)) * 2654435761u;
+
+	return (h ^ (h >> 15)) & (fs->index_size - 1);
+}
+
+
+static struct sffs_index_entry *sffs_index_find(struct sffs *fs, uint32_t file_id, uint32_t block) {
+	uint32_t i = sffs_index_hash(fs, file_id, block);
+
+	while (fs->index[i].file_id != 0xffff) {
+		if (fs->index[i].file_id == file_id && fs->index[i].block == block) {
+			return &(fs->index[i]);
+		}
+		i = (i + 1) & (fs->index_size - 1);
+	}
+
+	return NULL;
+}
+
+
+#if SFFS_FILE_TABLE_SIZE > 0
+static struct sffs_file_entry *sffs_file_table_find(struct sffs *fs, uint32_t file_id, uint32_t create) {
+	uint32_t i = ((file_id * 2654435761u) >> 16) & (fs->file_table_size - 1);
+
+	while (fs->file_table[i].file_id != 0xffff) {
+		if (fs->file_table[i].file_id == file_id) {
+			return &(fs->file_table[i]);
+		}
+		i = (i + 1) & (fs->file_table_size - 1);
+	}
+
+	if (!create || (fs->file_table_used + 1) >= fs->file_table_size) {
+		return NULL;
+	}
+	fs->file_table_used++;
+	fs->file_table[i].file_id = file_id;
+	fs->file_table[i].blocks = 0;
+	fs->file_table[i].last = 0;
+	fs->file_table[i].size = 0;
+
+	return &(fs->file_table[i]);
+}
+
+
+static void sffs_file_table_remove(struct sffs *fs, struct sffs_file_entry *entry) {
+	uint32_t mask = fs->file_table_size - 1;
+	uint32_t i = entry - fs->file_table;
+	uint32_t j = i;
+
+	/* backward shift deletion, the same as in the block index */
+	while (1) {
+		j = (j + 1) & mask;
+		if (fs->file_table[j].file_id == 0xffff) {
+			break;
+		}
+		uint32_t k = ((fs->file_table[j].file_id * 2654435761u) >> 16) & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			fs->file_table[i] = fs->file_table[j];
+			i = j;
+		}
+	}
+	fs->file_table[i].file_id = 0xffff;
+	fs->file_table_used--;
+}
+
+
+/* Account a block for its file. Size difference is added to the file size. */
+static void sffs_file_table_add(struct sffs *fs, uint32_t file_id, uint32_t block, int32_t size_diff, uint32_t new_block) {
+	if (!fs->file_table_valid) {
+		return;
+	}
+
+	struct sffs_file_entry *entry = sffs_file_table_find(fs, file_id, new_block);
+	if (entry == NULL) {
+		/* file table overflowed, sizes are computed from the index */
+		fs->file_table_valid = 0;
+		return;
+	}
+
+	entry->size += size_diff;
+	if (new_block) {
+		if (entry->blocks == 0 || (entry->last != 0xffff && block > entry->last)) {
+			entry->last = block;
+		}
+		entry->blocks++;
+	}
+}
+
+
+/* Remove a block from its file. Entry of the file is removed together with
+ * the last block. */
+static void sffs_file_table_del(struct sffs *fs, uint32_t file_id, uint32_t block, uint32_t size) {
+	if (!fs->file_table_valid) {
+		return;
+	}
+
+	struct sffs_file_entry *entry = sffs_file_table_find(fs, file_id, 0);
+	assert(entry != NULL);
+
+	entry->size -= size;
+	entry->blocks--;
+	if (entry->blocks == 0) {
+		sffs_file_table_remove(fs, entry);
+	} else if (block == entry->last) {
+		/* files are truncated from the end, the previous block is
+		 * checked only */
+		entry->last = (sffs_index_find(fs, file_id, block - 1) != NULL) ? block - 1 : 0xffff;
+	}
+}
+#endif
+
+
+static int32_t sffs_index_insert(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item, uint32_t replace) {
+	uint32_t i = sffs_index_hash(fs, item->file_id, item->block);
+
+	while (fs->index[i].file_id != 0xffff) {
+		if (fs->index[i].file_id == item->file_id && fs->index[i].block == item->block) {
+			break;
+		}
+		i = (i + 1) & (fs->index_size - 1);
+	}
+
+	if (fs->index[i].file_id == 0xffff) {
+		/* at least one slot must be left empty to terminate searches */
+		if ((fs->index_used + 1) >= fs->index_size) {
+			return SFFS_INDEX_UPDATE_FAILED;
+		}
+		fs->index_used++;
+#if SFFS_FILE_TABLE_SIZE > 0
+		sffs_file_table_add(fs, item->file_id, item->block, item->size, 1);
+#endif
+	} else if (!replace) {
+		return SFFS_INDEX_UPDATE_OK;
+	} else {
+#if SFFS_FILE_TABLE_SIZE > 0
+		sffs_file_table_add(fs, item->file_id, item->block, (int32_t)item->size - fs->index[i].size, 0);
+#endif
+	}
+
+	fs->index[i].file_id = item->file_id;
+	fs->index[i].block = item->block;
+	fs->index[i].sector = page->sector;
+	fs->index[i].page = page->page;
+	fs->index[i].size = item->size;
+
+	return SFFS_INDEX_UPDATE_OK;
+}
+
+
+static void sffs_index_remove(struct sffs *fs, struct sffs_index_entry *entry) {
+	uint32_t mask = fs->index_size - 1;
+	uint32_t i = entry - fs->index;
+	uint32_t j = i;
+
+#if SFFS_FILE_TABLE_SIZE > 0
+	sffs_file_table_del(fs, entry->file_id, entry->block, entry->size);
+#endif
+
+	/* Linear probing needs no tombstones if following entries of the chain
+	 * are shifted back to fill the hole. Entry j can be moved to the hole i
+	 * only if its home slot is not cyclically within (i, j]. */
+	while (1) {
+		j = (j + 1) & mask;
+		if (fs->index[j].file_id == 0xffff) {
+			break;
+		}
+		uint32_t k = sffs_index_hash(fs, fs->index[j].file_id, fs->index[j].block);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			fs->index[i] = fs->index[j];
+			i = j;
+		}
+	}
+	fs->index[i].file_id = 0xffff;
+	fs->index_used--;
+}
+#endif
+
+
+/* Empty the block index and the file table and mark them valid. */
+static void sffs_index_reset(struct sffs *fs) {
+#if SFFS_INDEX_SIZE > 0
+	for (uint32_t i = 0; i < fs->index_size; i++) {
+		fs->index[i].file_id = 0xffff;
+	}
+	fs->index_used = 0;
+	fs->index_valid = (fs->index_size > 0);
+#endif
+
+#if SFFS_FILE_TABLE_SIZE > 0
+	for (uint32_t i = 0; i < fs->file_table_size; i++) {
+		fs->file_table[i].file_id = 0xffff;
+	}
+	fs->file_table_used = 0;
+	fs->file_table_valid = (fs->file_table_size > 0);
+#endif
+	(void)fs;
+}
+
+
+int32_t sffs_index_build(struct sffs *fs) {
+	assert(fs != NULL);
+
+#if SFFS_INDEX_SIZE > 0
+	sffs_index_reset(fs);
+
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		struct sffs_metadata_header *header;
+		struct sffs_metadata_item *items;
+		if (sffs_metadata_load(fs, sector, SFFS_DATA_PAGES_PER_SECTOR(fs), &header, &items) != SFFS_CACHED_READ_OK) {
+			fs->index_valid = 0;
+			return SFFS_INDEX_BUILD_FAILED;
+		}
+
+		if (sffs_metadata_header_check(fs, header) != SFFS_METADATA_HEADER_CHECK_OK || header->state == SFFS_SECTOR_STATE_ERASED) {
+			continue;
+		}
+
+		for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs); i++) {
+			struct sffs_page page = { .sector = sector, .page = i };
+
+			if (items[i].state == SFFS_PAGE_STATE_USED || items[i].state == SFFS_PAGE_STATE_MOVING) {
+				if (sffs_index_update(fs, &page, &(items[i])) != SFFS_INDEX_UPDATE_OK) {
+					return SFFS_INDEX_BUILD_FAILED;
+				}
+			}
+		}
+	}
+
+	return SFFS_INDEX_BUILD_OK;
+#else
+	return SFFS_INDEX_BUILD_FAILED;
+#endif
+}
+
+
+int32_t sffs_index_lookup(struct sffs *fs, uint32_t file_id, uint32_t block, struct sffs_page *page) {
+	assert(fs != NULL);
+	assert(page != NULL);
+
+#if SFFS_INDEX_SIZE > 0
+	if (!fs->index_valid) {
+		return SFFS_INDEX_LOOKUP_FAILED;
+	}
+
+	struct sffs_index_entry *entry = sffs_index_find(fs, file_id, block);
+	if (entry == NULL) {
+		return SFFS_INDEX_LOOKUP_NOT_FOUND;
+	}
+	page->sector = entry->sector;
+	page->page = entry->page;
+
+	return SFFS_INDEX_LOOKUP_OK;
+#else
+	return SFFS_INDEX_LOOKUP_FAILED;
+#endif
+}
+
+
+int32_t sffs_index_update(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item) {
+	assert(fs != NULL);
+	assert(page != NULL);
+	assert(item != NULL);
+
+#if SFFS_INDEX_SIZE > 0
+	if (!fs->index_valid) {
+		return SFFS_INDEX_UPDATE_OK;
+	}
+
+	if (item->state == SFFS_PAGE_STATE_USED || item->state == SFFS_PAGE_STATE_MOVING) {
+		/* moving page is still valid, but it must not replace new used
+		 * copy of the same block */
+		if (sffs_index_insert(fs, page, item, item->state == SFFS_PAGE_STATE_USED) != SFFS_INDEX_UPDATE_OK) {
+			fs->index_valid = 0;
+			return SFFS_INDEX_UPDATE_FAILED;
+		}
+		return SFFS_INDEX_UPDATE_OK;
+	}
+
+	struct sffs_index_entry *entry = sffs_index_find(fs, item->file_id, item->block);
+	if (entry != NULL && entry->sector == page->sector && entry->page == page->page) {
+		sffs_index_remove(fs, entry);
+	}
+#endif
+
+	return SFFS_INDEX_UPDATE_OK;
+}
+
+
+int32_t sffs_find_page(struct sffs *fs, uint32_t file_id, uint32_t block, struct sffs_page *page) {
+	assert(fs != NULL);
+	assert(page != NULL);
+
+	int32_t ret = sffs_index_lookup(fs, file_id, block, page);
+	if (ret == SFFS_INDEX_LOOKUP_OK) {
+		return SFFS_FIND_PAGE_OK;
+	}
+	if (ret == SFFS_INDEX_LOOKUP_NOT_FOUND) {
+		return SFFS_FIND_PAGE_NOT_FOUND;
+	}
+
+	/* Index is not available. First we need to iterate over all sectors in the flash */
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		/* skip sectors without any valid page */
+		if (fs->sectors[sector].used == 0) {
+			continue;
+		}
+
+		/* pages after next_free are erased */
+		struct sffs_metadata_header *header;
+		struct sffs_metadata_item *items;
+		if (sffs_metadata_load(fs, sector, fs->sectors[sector].next_free, &header, &items) != SFFS_CACHED_READ_OK) {
+			return SFFS_FIND_PAGE_NOT_FOUND;
+		}
+
+		for (uint32_t i = 0; i < fs->sectors[sector].next_free; i++) {
+			struct sffs_metadata_item *item = &(items[i]);
+
+			/* check if page contains valid data for requested file */
+			if (item->file_id == file_id && item->block == block && (item->state == SFFS_PAGE_STATE_USED || item->state == SFFS_PAGE_STATE_MOVING)) {
+				page->sector = sector;
+				page->page = i;
+				return SFFS_FIND_PAGE_OK;
+			}
+		}
+	}
+
+	return SFFS_FIND_PAGE_NOT_FOUND;
+}
+
+
+static uint32_t sffs_extent_reserved(struct sffs *fs, uint32_t sector) {
+	return fs->extent_reserved[sector / 8] & (1 << (sector % 8));
+}
+
+
+/* Run the garbage collector if erased pages are running low. Returns 0 if a
+ * page can be allocated or -1 if the rest is left for the collector. */
+static int32_t sffs_alloc_check(struct sffs *fs) {
+	if (!fs->gc_running) {
+		/* Try to reclaim dirty sectors if we are running out of space. If
+		 * inline collection is disabled, it is done only if the write
+		 * would fail otherwise. */
+		uint32_t threshold = SFFS_GC_RESERVE_SECTORS * SFFS_DATA_PAGES_PER_SECTOR(fs);
+		if (fs->gc_mode == SFFS_GC_MODE_INLINE) {
+			threshold += SFFS_DATA_PAGES_PER_SECTOR(fs);
+		}
+		if (fs->free_pages <= threshold) {
+			sffs_do_collect_garbage(fs);
+		}
+
+		/* some pages must be left for the garbage collector to be able
+		 * to relocate used pages from dirty sectors */
+		if (fs->free_pages <= SFFS_GC_RESERVE_SECTORS * SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Allocate an erased page from the shared allocation sector. */
+static int32_t sffs_alloc_shared(struct sffs *fs, struct sffs_page *page) {
+	/* Erased pages are allocated in order, the first page of trailing erased
+	 * run is kept in the sector summary. Pages are taken from the current
+	 * allocation sector until it is full. No flash access is required. */
+	if (fs->alloc_sector < fs->sector_count && fs->sectors[fs->alloc_sector].next_free < SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		page->sector = fs->alloc_sector;
+		page->page = fs->sectors[fs->alloc_sector].next_free;
+		return SFFS_FIND_ERASED_PAGE_OK;
+	}
+
+	/* Select next allocation sector starting after the current one.
+	 * Partially used sectors are filled first, otherwise the least worn
+	 * erased sector is used. Extents are used as the last resort. */
+	uint32_t best = fs->sector_count;
+	uint32_t extent = fs->sector_count;
+	for (uint32_t i = 1; i <= fs->sector_count; i++) {
+		uint32_t sector = (fs->alloc_sector + i) % fs->sector_count;
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+
+		if (si->next_free >= SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+			continue;
+		}
+
+		if (sffs_extent_reserved(fs, sector)) {
+			extent = sector;
+			continue;
+		}
+
+		if (si->state == SFFS_SECTOR_STATE_USED) {
+			best = sector;
+			break;
+		}
+
+		if (si->state == SFFS_SECTOR_STATE_ERASED &&
+		    (best == fs->sector_count || si->erase_count < fs->sectors[best].erase_count)) {
+			best = sector;
+		}
+	}
+	if (best == fs->sector_count) {
+		best = extent;
+	}
+
+	if (best < fs->sector_count) {
+		fs->alloc_sector = best;
+		page->sector = best;
+		page->page = fs->sectors[best].next_free;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int32_t sffs_find_erased_page(struct sffs *fs, struct sffs_page *page) {
+	assert(fs != NULL);
+	assert(page != NULL);
+
+	if (sffs_alloc_check(fs) != 0 || sffs_alloc_shared(fs, page) != 0) {
+		return SFFS_FIND_ERASED_PAGE_NOT_FOUND;
+	}
+
+	return SFFS_FIND_ERASED_PAGE_OK;
+}
+
+
+/* End the extent reservation of a file, the rest of the sector is shared. */
+static void sffs_extent_release(struct sffs_file *f) {
+	struct sffs *fs = f->fs;
+
+	if (f->extent_sector < fs->sector_count) {
+		fs->extent_reserved[f->extent_sector / 8] &= ~(1 << (f->extent_sector % 8));
+	}
+	f->extent_sector = SFFS_FILE_EXTENT_NONE;
+}
+
+
+/* Find an erased page for a block of the file. Pages of files opened with
+ * SFFS_EXTENT are taken in order from the sector reserved for the file. If
+ * it is full, the longest erased run of a partially used sector is reserved
+ * for the first extent and the least worn erased sector for the next ones.
+ * The shared allocation sector is never reserved. */
+static int32_t sffs_file_find_erased_page(struct sffs_file *f, struct sffs_page *page) {
+	struct sffs *fs = f->fs;
+
+	if (!f->extent) {
+		return sffs_find_erased_page(fs, page);
+	}
+	if (sffs_alloc_check(fs) != 0) {
+		return SFFS_FIND_ERASED_PAGE_NOT_FOUND;
+	}
+
+	if (f->extent_sector < fs->sector_count) {
+		if (fs->sectors[f->extent_sector].next_free < SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+			page->sector = f->extent_sector;
+			page->page = fs->sectors[f->extent_sector].next_free;
+			return SFFS_FIND_ERASED_PAGE_OK;
+		}
+		sffs_extent_release(f);
+	}
+
+	uint32_t run = fs->sector_count;
+	uint32_t whole = fs->sector_count;
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+
+		if (sector == fs->alloc_sector || sffs_extent_reserved(fs, sector)) {
+			continue;
+		}
+		if (si->state == SFFS_SECTOR_STATE_USED && si->next_free < SFFS_DATA_PAGES_PER_SECTOR(fs) &&
+		    (run == fs->sector_count || si->next_free < fs->sectors[run].next_free)) {
+			run = sector;
+		}
+		if (si->state == SFFS_SECTOR_STATE_ERASED && si->next_free == 0 &&
+		    (whole == fs->sector_count || si->erase_count < fs->sectors[whole].erase_count)) {
+			whole = sector;
+		}
+	}
+
+	uint32_t best = (f->extents == 0 && run < fs->sector_count) ? run : whole;
+	if (best == fs->sector_count) {
+		best = run;
+	}
+	if (best == fs->sector_count) {
+		/* nothing to reserve, share the allocation sector */
+		return (sffs_alloc_shared(fs, page) == 0) ? SFFS_FIND_ERASED_PAGE_OK : SFFS_FIND_ERASED_PAGE_NOT_FOUND;
+	}
+
+	fs->extent_reserved[best / 8] |= 1 << (best % 8);
+	f->extent_sector = best;
+	f->extents++;
+	page->sector = best;
+	page->page = fs->sectors[best].next_free;
+
+	return SFFS_FIND_ERASED_PAGE_OK;
+}
+
+
+int32_t sffs_page_addr(struct sffs *fs, struct sffs_page *page, uint32_t *addr) {
+	assert(page != NULL);
+	assert(addr != NULL);
+
+	*addr = page->sector * SFFS_SECTOR_SIZE(fs) + (SFFS_FIRST_DATA_PAGE(fs) + page->page) * SFFS_PAGE_SIZE(fs);
+
+	return SFFS_PAGE_ADDR_OK;
+}
+
+
+static void sffs_sector_set_next_free(struct sffs *fs, struct sffs_sector_info *si, uint32_t next_free) {
+	/* every sector contributes with its trailing erased run */
+	fs->free_pages = fs->free_pages + si->next_free - next_free;
+	si->next_free = next_free;
+}
+
+
+/* Count pages of a sector from metadata items already loaded. */
+static void sffs_sector_count_pages(struct sffs *fs, uint32_t sector, struct sffs_metadata_item *items) {
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+	uint32_t next_free = SFFS_DATA_PAGES_PER_SECTOR(fs);
+
+	si->erased = 0;
+	si->used = 0;
+	si->old = 0;
+
+	for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs); i++) {
+		if (items[i].state == SFFS_PAGE_STATE_ERASED) {
+			si->erased++;
+			if (next_free == SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+				next_free = i;
+			}
+		} else {
+			if (items[i].state == SFFS_PAGE_STATE_OLD) {
+				si->old++;
+			} else {
+				si->used++;
+			}
+			next_free = SFFS_DATA_PAGES_PER_SECTOR(fs);
+		}
+	}
+	sffs_sector_set_next_free(fs, si, next_free);
+}
+
+
+int32_t sffs_sector_scan(struct sffs *fs, uint32_t sector) {
+	assert(fs != NULL);
+	assert(sector < fs->sector_count);
+
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+	si->state = 0;
+	si->erased = 0;
+	si->used = 0;
+	si->old = 0;
+	si->erase_count = 0;
+	sffs_sector_set_next_free(fs, si, SFFS_DATA_PAGES_PER_SECTOR(fs));
+
+	/* header and all items are read at once */
+	struct sffs_metadata_header *header;
+	struct sffs_metadata_item *items;
+	if (sffs_metadata_load(fs, sector, SFFS_DATA_PAGES_PER_SECTOR(fs), &header, &items) != SFFS_CACHED_READ_OK) {
+		return SFFS_SECTOR_SCAN_FAILED;
+	}
+
+	if (sffs_metadata_header_check(fs, header) != SFFS_METADATA_HEADER_CHECK_OK) {
+		return SFFS_SECTOR_SCAN_FAILED;
+	}
+	si->state = header->state;
+	si->erase_count = header->erase_count;
+
+	sffs_sector_count_pages(fs, sector, items);
+
+	return SFFS_SECTOR_SCAN_OK;
+}
+
+
+/* Nothing may refer to a sector being erased, its cached pages are dropped. */
+static void sffs_sector_erase_begin(struct sffs *fs, uint32_t sector) {
+	sffs_checkpoint_touch(fs, sector);
+#if SFFS_INDEX_SIZE > 0
+	/* the checkpoint is erased together with its old pages */
+	if (fs->checkpoint_active && fs->checkpoint_bitmap_addr / SFFS_SECTOR_SIZE(fs) == sector) {
+		fs->checkpoint_active = 0;
+	}
+#endif
+	sffs_cache_invalidate(fs, sector * SFFS_SECTOR_SIZE(fs), SFFS_SECTOR_SIZE(fs));
+	fs->stats.flash_erases++;
+}
+
+
+/* Write metadata of an erased sector, the sector is ready for allocation.
+ * If the erase or any metadata program failed, the sector is left without
+ * a valid header and it is not used until it is formatted again during
+ * mount. Returns 0 on success or -1 otherwise. */
+static int32_t sffs_sector_erase_end(struct sffs *fs, uint32_t sector, int32_t erased) {
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+
+	/* Erase count is carried over from the previous header (sectors with
+	 * invalid header start from zero). 0xffff is left for erased header. */
+	if (si->erase_count < 0xfffe) {
+		si->erase_count++;
+	}
+
+	/* Prepare and write all sector metadata items in one multi-page program.
+	 * sffs_set_page_metadata cannot be used here as the remaining sector
+	 * metadata are not complete yet and function will fail during sector
+	 * metadata update */
+	struct sffs_metadata_item *items = (struct sffs_metadata_item *)fs->metadata_buf;
+	for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs); i++) {
+		items[i].file_id = 0xffff;
+		items[i].block = 0xffff;
+		items[i].state = SFFS_PAGE_STATE_ERASED;
+		items[i].size = 0xffff;
+		items[i].reserved = 0xff;
+	}
+	struct sffs_metadata_header header;
+	fs->stats.flash_programs += 2;
+	fs->stats.flash_program_bytes += sizeof(header) + SFFS_DATA_PAGES_PER_SECTOR(fs) * sizeof(struct sffs_metadata_item);
+	if (erased && flash_program(fs->flash, SFFS_SECTOR_SIZE(fs) * sector + sizeof(header), (uint8_t *)items,
+	    SFFS_DATA_PAGES_PER_SECTOR(fs) * sizeof(struct sffs_metadata_item)) != FLASH_PROGRAM_OK) {
+		erased = 0;
+	}
+
+	/* sector header is written last, the sector is valid only if its
+	 * metadata are complete */
+	header.magic = SFFS_METADATA_MAGIC;
+	header.state = SFFS_SECTOR_STATE_ERASED;
+	header.reserved = SFFS_SECTOR_PAGE_SHIFT_BITS(fs->page_shift);
+	header.erase_count = si->erase_count;
+	if (erased && flash_program(fs->flash, SFFS_SECTOR_SIZE(fs) * sector, (uint8_t *)&header, sizeof(header)) != FLASH_PROGRAM_OK) {
+		erased = 0;
+	}
+
+	si->used = 0;
+	si->old = 0;
+	if (!erased) {
+		/* the same as a sector with invalid header found during mount */
+		si->state = 0;
+		si->erased = 0;
+		sffs_sector_set_next_free(fs, si, SFFS_DATA_PAGES_PER_SECTOR(fs));
+		return -1;
+	}
+	si->state = SFFS_SECTOR_STATE_ERASED;
+	si->erased = SFFS_DATA_PAGES_PER_SECTOR(fs);
+	sffs_sector_set_next_free(fs, si, 0);
+
+	return 0;
+}
+
+
+int32_t sffs_sector_format(struct sffs *fs, uint32_t sector) {
+	assert(fs != NULL);
+	assert(sector < fs->sector_count);
+
+	sffs_sector_erase_begin(fs, sector);
+	int32_t erased = (flash_sector_erase(fs->flash, sector * SFFS_SECTOR_SIZE(fs)) == FLASH_SECTOR_ERASE_OK);
+	if (sffs_sector_erase_end(fs, sector, erased) != 0) {
+		return SFFS_SECTOR_FORMAT_FAILED;
+	}
+
+	return SFFS_SECTOR_FORMAT_OK;
+}
+
+
+/* Erase an old sector from sffs_gc_step, the sector cannot be selected for
+ * collection until the erase is completed. An asynchronous erase is only
+ * started. Otherwise, if shared calls are possible, the filesystem lock is
+ * held shared during the erase so that readers of other sectors are not
+ * blocked. Returns 0 on success or -1 if the erase failed. */
+static int32_t sffs_gc_erase(struct sffs *fs, uint32_t sector) {
+#if SFFS_ASYNC_ERASE
+	sffs_sector_erase_begin(fs, sector);
+	if (flash_sector_erase_start(fs->flash, sector * SFFS_SECTOR_SIZE(fs)) != FLASH_SECTOR_ERASE_START_OK) {
+		return sffs_sector_erase_end(fs, sector, 0);
+	}
+	fs->gc_erasing = sector;
+
+	return 0;
+#else
+#if SFFS_LOCKING
+	if (fs->lock_ops != NULL && fs->fs_lock != NULL && fs->cache_lock != NULL) {
+		sffs_sector_erase_begin(fs, sector);
+		fs->gc_erasing = sector;
+		sffs_unlock(fs, fs->fs_lock, SFFS_LOCK_EXCLUSIVE);
+
+		sffs_lock(fs, fs->fs_lock, SFFS_LOCK_SHARED);
+		int32_t erased = (flash_sector_erase(fs->flash, sector * SFFS_SECTOR_SIZE(fs)) == FLASH_SECTOR_ERASE_OK);
+		sffs_unlock(fs, fs->fs_lock, SFFS_LOCK_SHARED);
+
+		sffs_lock(fs, fs->fs_lock, SFFS_LOCK_EXCLUSIVE);
+		fs->gc_erasing = SFFS_MAX_SECTORS;
+		return sffs_sector_erase_end(fs, sector, erased);
+	}
+#endif
+	return (sffs_sector_format(fs, sector) == SFFS_SECTOR_FORMAT_OK) ? 0 : -1;
+#endif
+}
+
+
+/* Complete the erase started by sffs_gc_step. Returns 0 if no erase is in
+ * progress anymore, -1 if the flash is still busy and wait is not set or -2
+ * if the sector metadata could not be written. */
+static int32_t sffs_gc_erase_complete(struct sffs *fs, uint32_t wait) {
+#if SFFS_ASYNC_ERASE
+	if (fs->gc_erasing >= fs->sector_count) {
+		return 0;
+	}
+	uint32_t addr = fs->gc_erasing * SFFS_SECTOR_SIZE(fs);
+	while (flash_poll(fs->flash, addr) == FLASH_POLL_BUSY) {
+		if (!wait) {
+			return -1;
+		}
+	}
+	uint32_t sector = fs->gc_erasing;
+	fs->gc_erasing = SFFS_MAX_SECTORS;
+	if (sffs_sector_erase_end(fs, sector, 1) != 0) {
+		return -2;
+	}
+#else
+	(void)fs;
+	(void)wait;
+#endif
+
+	return 0;
+}
+
+
+int32_t sffs_page_move(struct sffs *fs, struct sffs_page *page) {
+	assert(fs != NULL);
+	assert(page != NULL);
+
+	struct sffs_metadata_item item;
+	sffs_get_page_metadata(fs, page, &item);
+	if (item.state != SFFS_PAGE_STATE_USED && item.state != SFFS_PAGE_STATE_MOVING) {
+		return SFFS_PAGE_MOVE_OK;
+	}
+
+	/* moving page with a newer copy of the block is discarded */
+	struct sffs_page current;
+	if (item.state == SFFS_PAGE_STATE_MOVING &&
+	    sffs_index_lookup(fs, item.file_id, item.block, &current) == SFFS_INDEX_LOOKUP_OK &&
+	    (current.sector != page->sector || current.page != page->page)) {
+		sffs_set_page_state(fs, page, SFFS_PAGE_STATE_OLD);
+		return SFFS_PAGE_MOVE_OK;
+	}
+
+	struct sffs_page new_page;
+	if (sffs_find_erased_page(fs, &new_page) != SFFS_FIND_ERASED_PAGE_OK) {
+		return SFFS_PAGE_MOVE_FAILED;
+	}
+
+	/* moved checkpoint would be restored from its old location */
+	if (item.file_id == SFFS_CHECKPOINT_FILE_ID) {
+		sffs_checkpoint_drop(fs);
+	}
+
+	uint8_t *page_data = fs->scratch;
+	uint32_t addr;
+	sffs_page_addr(fs, page, &addr);
+	if (sffs_cached_read(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_READ_OK) {
+		return SFFS_PAGE_MOVE_FAILED;
+	}
+
+	/* The same sequence as used when a page is rewritten. Moving page left
+	 * after an interrupted write is still valid and it is moved as well. */
+	if (item.state == SFFS_PAGE_STATE_USED) {
+		sffs_set_page_state(fs, page, SFFS_PAGE_STATE_MOVING);
+	}
+	sffs_set_page_state(fs, &new_page, SFFS_PAGE_STATE_RESERVED);
+
+	sffs_page_addr(fs, &new_page, &addr);
+	if (sffs_cached_write(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_WRITE_OK) {
+		return SFFS_PAGE_MOVE_FAILED;
+	}
+
+	item.state = SFFS_PAGE_STATE_USED;
+	sffs_set_page_metadata(fs, &new_page, &item);
+	sffs_set_page_state(fs, page, SFFS_PAGE_STATE_OLD);
+	fs->stats.gc_moves++;
+
+	return SFFS_PAGE_MOVE_OK;
+}
+
+
+int32_t sffs_sector_collect_garbage(struct sffs *fs, uint32_t sector) {
+	assert(fs != NULL);
+	assert(sector < fs->sector_count);
+
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+
+	if (si->state == SFFS_SECTOR_STATE_DIRTY && !fs->gc_running) {
+		/* all used pages must fit into erased pages elsewhere */
+		if (si->used > fs->free_pages) {
+			return SFFS_SECTOR_COLLECT_GARBAGE_FAILED;
+		}
+
+		fs->gc_running = 1;
+		for (uint32_t i = 0; i < SFFS_DATA_PAGES_PER_SECTOR(fs) && si->used > 0; i++) {
+			if (sffs_page_move(fs, &(struct sffs_page){ .sector = sector, .page = i }) != SFFS_PAGE_MOVE_OK) {
+				fs->gc_running = 0;
+				return SFFS_SECTOR_COLLECT_GARBAGE_FAILED;
+			}
+		}
+		fs->gc_running = 0;
+
+		/* sector was erased when its last page has been marked as old */
+		return SFFS_SECTOR_COLLECT_GARBAGE_OK;
+	}
+
+	if (si->state == SFFS_SECTOR_STATE_OLD && sffs_sector_format(fs, sector) != SFFS_SECTOR_FORMAT_OK) {
+		return SFFS_SECTOR_COLLECT_GARBAGE_FAILED;
+	}
+
+	return SFFS_SECTOR_COLLECT_GARBAGE_OK;
+}
+
+
+static uint32_t sffs_gc_select_victim(struct sffs *fs) {
+	uint32_t victim = fs->sector_count;
+
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+
+		if (sector == fs->gc_erasing) {
+			continue;
+		}
+
+		/* old sectors need no relocation at all */
+		if (si->state == SFFS_SECTOR_STATE_OLD) {
+			return sector;
+		}
+
+		/* Greedy victim selection, dirty sector with the most old pages
+		 * gives the most erased pages for the least relocation work. */
+		if (si->state != SFFS_SECTOR_STATE_DIRTY || si->old == 0 || si->used > fs->free_pages) {
+			continue;
+		}
+		if (victim == fs->sector_count || si->old > fs->sectors[victim].old) {
+			victim = sector;
+		}
+	}
+
+	return victim;
+}
+
+
+static int32_t sffs_do_collect_garbage(struct sffs *fs) {
+	assert(fs != NULL);
+
+	/* sector being erased in background is needed now */
+	if (sffs_gc_erase_complete(fs, 1) != 0) {
+		return SFFS_COLLECT_GARBAGE_FAILED;
+	}
+
+	while (fs->free_pages < (SFFS_GC_RESERVE_SECTORS + 1) * SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		uint32_t victim = sffs_gc_select_victim(fs);
+		if (victim == fs->sector_count) {
+			return SFFS_COLLECT_GARBAGE_NOTHING;
+		}
+
+		if (sffs_sector_collect_garbage(fs, victim) != SFFS_SECTOR_COLLECT_GARBAGE_OK) {
+			return SFFS_COLLECT_GARBAGE_FAILED;
+		}
+
+		/* compacted sector is left old if inline collection is disabled */
+		if (fs->sectors[victim].state == SFFS_SECTOR_STATE_OLD && sffs_sector_format(fs, victim) != SFFS_SECTOR_FORMAT_OK) {
+			return SFFS_COLLECT_GARBAGE_FAILED;
+		}
+	}
+
+	return SFFS_COLLECT_GARBAGE_OK;
+}
+
+
+int32_t sffs_collect_garbage(struct sffs *fs) {
+	assert(fs != NULL);
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_GC, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_collect_garbage(fs);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+static int32_t sffs_do_gc_step(struct sffs *fs, uint32_t budget) {
+	assert(fs != NULL);
+
+	if (fs->gc_running) {
+		return SFFS_GC_STEP_IDLE;
+	}
+
+	/* erase started by a previous step */
+	if (fs->gc_erasing < fs->sector_count) {
+		int32_t r = sffs_gc_erase_complete(fs, 0);
+		if (r == -1) {
+			return SFFS_GC_STEP_BUSY;
+		}
+		return (r == 0) ? SFFS_GC_STEP_OK : SFFS_GC_STEP_FAILED;
+	}
+
+	/* continue with the current victim if it is still dirty */
+	if (fs->gc_victim >= fs->sector_count ||
+	    (fs->sectors[fs->gc_victim].state != SFFS_SECTOR_STATE_DIRTY && fs->sectors[fs->gc_victim].state != SFFS_SECTOR_STATE_OLD)) {
+		fs->gc_victim = fs->sector_count;
+		fs->gc_page = 0;
+
+		uint32_t victim = sffs_gc_select_victim(fs);
+		if (victim == fs->sector_count) {
+			return SFFS_GC_STEP_IDLE;
+		}
+
+		/* dirty sectors are compacted only if erased pages are running low */
+		if (fs->sectors[victim].state == SFFS_SECTOR_STATE_DIRTY &&
+		    fs->free_pages >= (SFFS_GC_RESERVE_SECTORS + SFFS_GC_BACKGROUND_SECTORS) * SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+			return SFFS_GC_STEP_IDLE;
+		}
+		fs->gc_victim = victim;
+	}
+
+	struct sffs_sector_info *si = &(fs->sectors[fs->gc_victim]);
+
+	/* erasing is one unit of work */
+	if (si->state == SFFS_SECTOR_STATE_OLD) {
+		uint32_t victim = fs->gc_victim;
+		fs->gc_victim = fs->sector_count;
+		if (sffs_gc_erase(fs, victim) != 0) {
+			return SFFS_GC_STEP_FAILED;
+		}
+		return SFFS_GC_STEP_OK;
+	}
+
+	if (si->used > fs->free_pages) {
+		fs->gc_victim = fs->sector_count;
+		return SFFS_GC_STEP_FAILED;
+	}
+
+	fs->gc_running = 1;
+	while (budget > 0 && si->used > 0 && fs->gc_page < SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		struct sffs_page page = { .sector = fs->gc_victim, .page = fs->gc_page };
+		struct sffs_metadata_item item;
+		sffs_get_page_metadata(fs, &page, &item);
+
+		if (item.state == SFFS_PAGE_STATE_USED || item.state == SFFS_PAGE_STATE_MOVING) {
+			if (sffs_page_move(fs, &page) != SFFS_PAGE_MOVE_OK) {
+				fs->gc_running = 0;
+				return SFFS_GC_STEP_FAILED;
+			}
+			budget--;
+		}
+		fs->gc_page++;
+	}
+	fs->gc_running = 0;
+
+	/* Victim sector is erased during the next step. If inline collection
+	 * is enabled, it was erased already. */
+	return SFFS_GC_STEP_OK;
+}
+
+
+int32_t sffs_gc_step(struct sffs *fs, uint32_t budget) {
+	assert(fs != NULL);
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_GC, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_gc_step(fs, budget);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_set_gc_mode(struct sffs *fs, uint32_t mode) {
+	assert(fs != NULL);
+
+	if (mode != SFFS_GC_MODE_INLINE && mode != SFFS_GC_MODE_BACKGROUND) {
+		return SFFS_SET_GC_MODE_FAILED;
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_COUNT, SFFS_LOCK_EXCLUSIVE);
+	fs->gc_mode = mode;
+	sffs_op_end(fs, &call);
+
+	return SFFS_SET_GC_MODE_OK;
+}
+
+
+static int32_t sffs_sector_commit_state(struct sffs *fs, uint32_t sector) {
+	struct sffs_sector_info *si = &(fs->sectors[sector]);
+	uint8_t state;
+
+	if (si->old == SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		state = SFFS_SECTOR_STATE_OLD;
+	} else if (si->erased == SFFS_DATA_PAGES_PER_SECTOR(fs)) {
+		state = SFFS_SECTOR_STATE_ERASED;
+	} else if (si->erased > 0) {
+		state = SFFS_SECTOR_STATE_USED;
+	} else if (si->old > 0) {
+		state = SFFS_SECTOR_STATE_DIRTY;
+	} else {
+		state = SFFS_SECTOR_STATE_FULL;
+	}
+
+	/* New sector state cannot be greater than the old one (otherwise the
+	 * sector metadata would need to be erased first). Older versions marked
+	 * full sectors as dirty, such sectors are left as they are. */
+	if (state > si->state) {
+		assert(si->state == SFFS_SECTOR_STATE_DIRTY && state == SFFS_SECTOR_STATE_FULL);
+		return SFFS_UPDATE_SECTOR_METADATA_OK;
+	}
+
+	if (state != si->state) {
+		/* only the state byte is rewritten */
+		uint32_t state_pos = sector * SFFS_SECTOR_SIZE(fs) + offsetof(struct sffs_metadata_header, state);
+		sffs_checkpoint_touch(fs, sector);
+		if (sffs_cached_write(fs, state_pos, &state, sizeof(state)) != SFFS_CACHED_WRITE_OK) {
+			return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+		}
+		si->state = state;
+
+		/* old sectors can be erased immediately, dirty sectors are
+		 * reclaimed when erased pages are running low */
+		if (state == SFFS_SECTOR_STATE_OLD && fs->gc_mode == SFFS_GC_MODE_INLINE) {
+			sffs_sector_collect_garbage(fs, sector);
+		}
+	}
+
+	return SFFS_UPDATE_SECTOR_METADATA_OK;
+}
+
+
+int32_t sffs_update_sector_metadata(struct sffs *fs, uint32_t sector) {
+	assert(fs != NULL);
+	assert(sector < fs->sector_count);
+
+	/* sector with invalid header cannot be updated */
+	if (fs->sectors[sector].state == 0) {
+		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	}
+
+	struct sffs_metadata_header *header;
+	struct sffs_metadata_item *items;
+	if (sffs_metadata_load(fs, sector, SFFS_DATA_PAGES_PER_SECTOR(fs), &header, &items) != SFFS_CACHED_READ_OK) {
+		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	}
+	sffs_sector_count_pages(fs, sector, items);
+
+	return sffs_sector_commit_state(fs, sector);
+}
+
+
+int32_t sffs_update_sector_page_state(struct sffs *fs, struct sffs_page *page, uint8_t old_state, uint8_t new_state) {
+	assert(fs != NULL);
+	assert(page != NULL);
+	assert(page->sector < fs->sector_count);
+
+	struct sffs_sector_info *si = &(fs->sectors[page->sector]);
+	if (si->state == 0) {
+		return SFFS_UPDATE_SECTOR_METADATA_FAILED;
+	}
+
+	if (old_state == new_state) {
+		return SFFS_UPDATE_SECTOR_METADATA_OK;
+	}
+
+	if (old_state == SFFS_PAGE_STATE_ERASED) {
+		si->erased--;
+		/* erased pages are allocated in order */
+		sffs_sector_set_next_free(fs, si, MAX(si->next_free, page->page + 1));
+	} else if (old_state == SFFS_PAGE_STATE_OLD) {
+		si->old--;
+	} else {
+		si->used--;
+	}
+
+	if (new_state == SFFS_PAGE_STATE_ERASED) {
+		/* pages cannot be erased one by one, recount the whole sector */
+		return sffs_update_sector_metadata(fs, page->sector);
+	} else if (new_state == SFFS_PAGE_STATE_OLD) {
+		si->old++;
+	} else {
+		si->used++;
+	}
+
+	return sffs_sector_commit_state(fs, page->sector);
+}
+
+
+int32_t sffs_get_page_metadata(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item) {
+	assert(fs != NULL);
+	assert(page != NULL);
+	assert(item != NULL);
+
+	uint32_t item_pos = page->sector * SFFS_SECTOR_SIZE(fs) + sizeof(struct sffs_metadata_header) + page->page * sizeof(struct sffs_metadata_item);
+	sffs_cached_read(fs, item_pos, (uint8_t *)item, sizeof(struct sffs_metadata_item));
 
 	return SFFS_GET_PAGE_METADATA_OK;
 }
 
 
-int32_t sffs_set_page_metadata(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item) {
+int32_t sffs_set_page_metadata(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item) {
+	assert(fs != NULL);
+	assert(page != NULL);
+	assert(item != NULL);
+
+	uint32_t item_pos = page->sector * SFFS_SECTOR_SIZE(fs) + sizeof(struct sffs_metadata_header) + page->page * sizeof(struct sffs_metadata_item);
+
+	/* previous state is required to update sector page counts */
+	uint8_t old_state;
+	if (sffs_cached_read(fs, item_pos + offsetof(struct sffs_metadata_item, state), &old_state, sizeof(old_state)) != SFFS_CACHED_READ_OK) {
+		return SFFS_SET_PAGE_MATEDATA_FAILED;
+	}
+
+	sffs_checkpoint_touch(fs, page->sector);
+	if (item->file_id == SFFS_CHECKPOINT_FILE_ID && item->state == SFFS_PAGE_STATE_USED) {
+		/* sector is flagged before the checkpoint page is used */
+		uint32_t flags_pos = page->sector * SFFS_SECTOR_SIZE(fs) + offsetof(struct sffs_metadata_header, reserved);
+		uint8_t flags;
+		if (sffs_cached_read(fs, flags_pos, &flags, sizeof(flags)) == SFFS_CACHED_READ_OK && (flags & SFFS_SECTOR_FLAG_CHECKPOINT)) {
+			flags &= ~SFFS_SECTOR_FLAG_CHECKPOINT;
+			sffs_cached_write(fs, flags_pos, &flags, sizeof(flags));
+		}
+	}
+
+	if (sffs_cached_write(fs, item_pos, (uint8_t *)item, sizeof(struct sffs_metadata_item)) != SFFS_CACHED_WRITE_OK) {
+		return SFFS_SET_PAGE_MATEDATA_FAILED;
+	}
+
+	/* keep the block index coherent before the sector is possibly erased */
+	sffs_index_update(fs, page, item);
+	if (item->state == SFFS_PAGE_STATE_USED || item->state == SFFS_PAGE_STATE_OLD) {
+		fs->page_gen++;
+	}
+	sffs_update_sector_page_state(fs, page, old_state, item->state);
+
+	return SFFS_SET_PAGE_MATEDATA_OK;
+}
+
+
+int32_t sffs_set_page_state(struct sffs *fs, struct sffs_page *page, uint8_t page_state) {
+	assert(fs != NULL);
+	assert(page != NULL);
+
+	struct sffs_metadata_item item;
+	if (sffs_get_page_metadata(fs, page, &item) != SFFS_GET_PAGE_METADATA_OK) {
+		return SFFS_SET_PAGE_STATE_FAILED;
+	}
+	uint8_t old_state = item.state;
+	item.state = page_state;
+
+	/* only the state byte is rewritten */
+	uint32_t state_pos = page->sector * SFFS_SECTOR_SIZE(fs) + sizeof(struct sffs_metadata_header) +
+		page->page * sizeof(struct sffs_metadata_item) + offsetof(struct sffs_metadata_item, state);
+	sffs_checkpoint_touch(fs, page->sector);
+	if (sffs_cached_write(fs, state_pos, &page_state, sizeof(page_state)) != SFFS_CACHED_WRITE_OK) {
+		return SFFS_SET_PAGE_STATE_FAILED;
+	}
+
+	sffs_index_update(fs, page, &item);
+	if (page_state == SFFS_PAGE_STATE_USED || page_state == SFFS_PAGE_STATE_OLD) {
+		fs->page_gen++;
+	}
+	sffs_update_sector_page_state(fs, page, old_state, page_state);
+
+	return SFFS_SET_PAGE_STATE_OK;
+}
+
+
+int32_t sffs_check_file_opened(struct sffs_file *f) {
+	assert(f != NULL);
+
+	/* file is probably not opened. TODO: better check */
+	if (f->file_id == 0 || f->fs == NULL) {
+		return SFFS_CHECK_FILE_OPENED_FAILED;
+	}
+
+	return SFFS_CHECK_FILE_OPENED_OK;
+}
+
+
+static int32_t sffs_do_open_id(struct sffs *fs, struct sffs_file *f, uint32_t file_id, uint32_t mode) {
+	assert(fs != NULL);
+	assert(f != NULL);
+	assert(file_id != 0xffff);
+
+	/* reserved files cannot be opened */
+	if (file_id >= SFFS_DIRECTORY_FILE_ID) {
+		return SFFS_OPEN_ID_FAILED;
+	}
+
+	/* whole span must fit the write buffer and the size of its page */
+	uint32_t compress = mode & SFFS_COMPRESS;
+	uint32_t extent = mode & SFFS_EXTENT;
+	mode &= ~(SFFS_COMPRESS | SFFS_EXTENT);
+	if (mode != SFFS_READ && SFFS_FILE_ID_RESERVED(file_id)) {
+		return SFFS_OPEN_ID_FAILED;
+	}
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	if (compress && (SFFS_SPAN_SIZE(fs) > SFFS_WRITE_BUFFER_SIZE || SFFS_SPAN_SIZE(fs) > 0xffff)) {
+		return SFFS_OPEN_ID_FAILED;
+	}
+
+	/* compressed files are recognized by their first span */
+	struct sffs_page span_page;
+	struct sffs_metadata_item span_item;
+	uint32_t span_start;
+	uint32_t detected = (mode != SFFS_OVERWRITE && sffs_span_last(fs, file_id, 0, &span_page, &span_item, &span_start) > 0);
+
+	/* uncompressed data cannot be appended compressed */
+	uint32_t size = 0;
+	if (compress && !detected && mode == SFFS_APPEND &&
+	    (sffs_do_file_size(fs, file_id, &size) != SFFS_FILE_SIZE_OK || size > 0)) {
+		return SFFS_OPEN_ID_FAILED;
+	}
+#else
+	if (compress) {
+		return SFFS_OPEN_ID_FAILED;
+	}
+#endif
+
+	/* The handle may still be opened, it is closed first so that it is
+	 * not linked twice. Open fails and the handle is kept if its buffered
+	 * data cannot be written. */
+	for (struct sffs_file *o = fs->files; o != NULL; o = o->next) {
+		if (o == f) {
+			if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+				return SFFS_OPEN_ID_FAILED;
+			}
+			sffs_do_close(f);
+			break;
+		}
+	}
+
+	f->blocks = SFFS_FILE_BLOCKS_UNKNOWN;
+
+	switch (mode) {
+		case SFFS_OVERWRITE:
+			/* remove old file first, new one will be created.
+			 * We are not checking return value intentionally.
+			 * Write pointer is set to the beginning. */
+			sffs_do_remove_many(fs, &file_id, 1);
+			f->pos = 0;
+			f->blocks = 0;
+			break;
+
+		case SFFS_APPEND:
+			/* Determine end of the file and seek to that position.
+			 * Location of the last block is remembered for appending. */
+			sffs_do_file_size(fs, file_id, &(f->pos));
+			f->blocks = (f->pos + SFFS_PAGE_SIZE(fs) - 1) / SFFS_PAGE_SIZE(fs);
+			if (f->blocks > 0) {
+				if (sffs_find_page(fs, file_id, f->blocks - 1, &(f->tail_page)) != SFFS_FIND_PAGE_OK) {
+					f->blocks = SFFS_FILE_BLOCKS_UNKNOWN;
+					break;
+				}
+				f->tail_size = f->pos - (f->blocks - 1) * SFFS_PAGE_SIZE(fs);
+			}
+			break;
+
+		case SFFS_READ:
+			/* Set write pointer to the beginning. */
+			f->pos = 0;
+			break;
+
+		default:
+			return SFFS_OPEN_ID_FAILED;
+	}
+
+	f->fs = fs;
+	f->file_id = file_id;
+	f->tail_gen = fs->page_gen;
+	f->extent = (extent && mode != SFFS_READ);
+	f->extent_sector = SFFS_FILE_EXTENT_NONE;
+	f->extents = 0;
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	f->wbuf_len = 0;
+#endif
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	f->compress = detected || (compress && mode != SFFS_READ);
+	f->span = SFFS_FILE_SPAN_NONE;
+#endif
+
+#if SFFS_LOCKING
+	f->lock = NULL;
+#endif
+
+	f->next = fs->files;
+	fs->files = f;
+
+	return SFFS_OPEN_ID_OK;
+}
+
+
+int32_t sffs_open_id(struct sffs *fs, struct sffs_file *f, uint32_t file_id, uint32_t mode) {
+	assert(fs != NULL);
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_OPEN, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_open_id(fs, f, file_id, mode);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+/* Write data to file pages at the requested position, position of the file is
+ * not changed. Returns 0 on success or -1 if error occured. */
+static int32_t sffs_write_pages(struct sffs_file *f, uint32_t pos, const uint8_t *buf, uint32_t len) {
+	struct sffs *fs = f->fs;
+
+	/* Write buffer can span multiple flash blocks. We need to determine
+	 * where the buffer starts and ends. */
+	uint32_t b_start = pos / SFFS_PAGE_SIZE(fs);
+	uint32_t b_end = (pos + len - 1) / SFFS_PAGE_SIZE(fs);
+
+	/* now we can iterate over all flash pages which need to be modified */
+	for (uint32_t i = b_start; i <= b_end; i++) {
+
+		/* The first scratch page is shared with sffs_page_move. Garbage
+		 * collection can only run before the page is filled. */
+		uint8_t *page_data = fs->scratch;
+		struct sffs_page page;
+		uint32_t loaded_old = 0;
+		uint32_t old_size = 0;
+
+		/* determine where data wants to be written */
+		uint32_t data_start = pos;
+		uint32_t data_end = pos + len - 1;
+
+		/* crop to current page boundaries */
+		data_start = MAX(data_start, i * SFFS_PAGE_SIZE(fs));
+		data_end = MIN(data_end, (i + 1) * SFFS_PAGE_SIZE(fs) - 1);
+
+		/* get offset in the source buffer */
+		uint32_t source_offset = data_start - pos;
+
+		/* get offset in the destination buffer */
+		uint32_t dest_offset = data_start % SFFS_PAGE_SIZE(fs);
+
+		/* length of data to be writte is the difference between cropped data */
+		uint32_t dest_len = data_end - data_start + 1;
+
+		//~ printf("writing buf[%d-%d] to page %d, offset %d, length %d\n", source_offset, source_offset + dest_len, i, dest_offset, dest_len);
+
+		assert(source_offset < len);
+		assert(dest_offset < SFFS_PAGE_SIZE(fs));
+		assert(dest_len <= SFFS_PAGE_SIZE(fs));
+		assert(dest_len <= len);
+
+		/* Find new erased page first. Garbage collection can be started
+		 * when erased pages are running low and it can move the old page
+		 * of this block to another location. */
+		struct sffs_page new_page;
+		if (sffs_file_find_erased_page(f, &new_page) != SFFS_FIND_ERASED_PAGE_OK) {
+			return -1;
+		}
+
+		/* Cached tail of the file is valid only if no page was written or
+		 * expired since it was saved. Blocks past the tail don't exist
+		 * and their lookup can be skipped. */
+		uint32_t tail_ok = (f->tail_gen == fs->page_gen && f->blocks != SFFS_FILE_BLOCKS_UNKNOWN);
+		if (tail_ok && i >= f->blocks) {
+			loaded_old = 0;
+		} else if (tail_ok && i == f->blocks - 1) {
+			page = f->tail_page;
+			old_size = f->tail_size;
+			loaded_old = 1;
+		} else if (sffs_find_page(fs, f->file_id, i, &page) == SFFS_FIND_PAGE_OK) {
+			struct sffs_metadata_item item;
+			sffs_get_page_metadata(fs, &page, &item);
+			old_size = item.size;
+			loaded_old = 1;
+		}
+
+		if (loaded_old && dest_len < SFFS_PAGE_SIZE(fs)) {
+			/* page is valid and it is not going to be overwritten
+			 * completely. Get its address and read from flash */
+			uint32_t addr;
+			sffs_page_addr(fs, &page, &addr);
+			if (sffs_cached_read(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_READ_OK) {
+				return -1;
+			}
+		} else if (!loaded_old) {
+			/* the file doesn't have allocated requested page. Create
+			 * new one filled with zeroes */
+			memset(page_data, 0x00, dest_offset);
+			memset(&(page_data[data_end % SFFS_PAGE_SIZE(fs) + 1]), 0x00, SFFS_PAGE_SIZE(fs) - data_end % SFFS_PAGE_SIZE(fs) - 1);
+		}
+
+		memcpy(&(page_data[dest_offset]), &(buf[source_offset]), dest_len);
+
+		/* mark new page as reserved (prepared for writing) and old page
+		 * as moving */
+		if (loaded_old) {
+			sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_MOVING);
+		}
+		sffs_set_page_state(fs, &new_page, SFFS_PAGE_STATE_RESERVED);
+
+		/* Finally write modified page, set its state to used and set state of
+		 * old page to old- */
+		uint32_t addr;
+		sffs_page_addr(fs, &new_page, &addr);
+		if (sffs_cached_write(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_WRITE_OK) {
+			return -1;
+		}
+		/* keep the new page cached, next append to it doesn't need to
+		 * read it from the flash */
+		sffs_cache_insert(fs, addr, page_data);
+
+		struct sffs_metadata_item item;
+		item.block = i;
+		item.size = MAX(old_size, data_end % SFFS_PAGE_SIZE(fs) + 1);
+		item.state = SFFS_PAGE_STATE_USED;
+		item.file_id = f->file_id;
+		item.reserved = 0xff;
+		sffs_set_page_metadata(fs, &new_page, &item);
+
+		if (loaded_old) {
+			sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_OLD);
+		}
+
+		/* Update the cached tail. If it was not valid, the block index can
+		 * tell cheaply if this is the last block. */
+		struct sffs_page next;
+		if (!tail_ok && sffs_index_lookup(fs, f->file_id, i + 1, &next) == SFFS_INDEX_LOOKUP_NOT_FOUND) {
+			f->blocks = i + 1;
+			tail_ok = 1;
+		}
+		if (tail_ok) {
+			if (i + 1 >= f->blocks) {
+				f->blocks = i + 1;
+				f->tail_page = new_page;
+				f->tail_size = item.size;
+			}
+			f->tail_gen = fs->page_gen;
+		}
+	}
+
+	return 0;
+}
+
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+/* Spans are compressed by a byte oriented LZ77 codec using the LZF format. A
+ * control byte below 32 is followed by control + 1 literals. Otherwise its
+ * upper 3 bits are the match length - 2 (7 means that the next byte is added
+ * to the length) and the lower 5 bits with the following byte are the match
+ * distance - 1. */
+#define SFFS_LZ_MAX_LITERALS 32
+#define SFFS_LZ_MAX_DISTANCE 8192
+#define SFFS_LZ_MAX_MATCH 264
+#define SFFS_LZ_HASH(d) ((((uint32_t)(d)[0] << 16 | (uint32_t)(d)[1] << 8 | (d)[2]) * 2654435761u) >> (32 - SFFS_COMPRESS_HASH_BITS))
+
+
+/* Append literals data[lit..end) while they fit. Returns 0 if all of them were
+ * added or -1 if the output is full. */
+static int32_t sffs_lz_literals(const uint8_t *data, uint32_t *lit, uint32_t end, uint8_t *out, uint32_t *op, uint32_t out_size) {
+	while (*lit < end) {
+		/* at least one literal must follow the control byte */
+		if (*op + 2 > out_size) {
+			return -1;
+		}
+		uint32_t n = MIN(MIN(end - *lit, SFFS_LZ_MAX_LITERALS), out_size - *op - 1);
+		out[(*op)++] = n - 1;
+		memcpy(&(out[*op]), &(data[*lit]), n);
+		*op += n;
+		*lit += n;
+	}
+
+	return 0;
+}
+
+
+/* Compress data[start..end) following data[0..start) already compressed
+ * before. Tokens are added to the output at op while they fit out_size bytes.
+ * Returns the number of bytes compressed, op is updated. */
+static uint32_t sffs_lz_compress(struct sffs *fs, const uint8_t *data, uint32_t start, uint32_t end, uint8_t *out, uint32_t *op, uint32_t out_size) {
+	uint16_t *hash = fs->compress_hash;
+	memset(hash, 0xff, sizeof(fs->compress_hash));
+
+	/* matches can refer to the preceding data */
+	uint32_t ip = (start > SFFS_LZ_MAX_DISTANCE) ? start - SFFS_LZ_MAX_DISTANCE : 0;
+	for (; ip < start && ip + 2 < end; ip++) {
+		hash[SFFS_LZ_HASH(&(data[ip]))] = ip;
+	}
+
+	ip = start;
+	uint32_t lit = start;
+	while (ip + 2 < end) {
+		uint32_t h = SFFS_LZ_HASH(&(data[ip]));
+		uint32_t ref = hash[h];
+		hash[h] = ip;
+
+		if (ref == 0xffff || ip - ref > SFFS_LZ_MAX_DISTANCE || memcmp(&(data[ref]), &(data[ip]), 3) != 0) {
+			ip++;
+			continue;
+		}
+
+		uint32_t max = MIN(end - ip, SFFS_LZ_MAX_MATCH);
+		uint32_t n = 3;
+		while (n < max && data[ref + n] == data[ip + n]) {
+			n++;
+		}
+
+		/* literals before the match are added first */
+		uint32_t len = (n - 2 < 7) ? 2 : 3;
+		if (sffs_lz_literals(data, &lit, ip, out, op, out_size) != 0 || *op + len > out_size) {
+			return lit - start;
+		}
+		uint32_t dist = ip - ref - 1;
+		if (len == 2) {
+			out[(*op)++] = ((n - 2) << 5) | (dist >> 8);
+		} else {
+			out[(*op)++] = (7 << 5) | (dist >> 8);
+			out[(*op)++] = n - 2 - 7;
+		}
+		out[(*op)++] = dist & 0xff;
+
+		ip += n;
+		lit = ip;
+	}
+	sffs_lz_literals(data, &lit, end, out, op, out_size);
+
+	return lit - start;
+}
+
+
+/* Decompress out[start..end) following out[0..start). Returns the number of
+ * compressed bytes used or -1 if the data are not valid. */
+static int32_t sffs_lz_decompress(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t start, uint32_t end) {
+	uint32_t ip = 0;
+	uint32_t op = start;
+	while (op < end) {
+		if (ip >= size) {
+			return -1;
+		}
+		uint32_t ctrl = data[ip++];
+
+		if (ctrl < SFFS_LZ_MAX_LITERALS) {
+			uint32_t n = ctrl + 1;
+			if (ip + n > size || op + n > end) {
+				return -1;
+			}
+			memcpy(&(out[op]), &(data[ip]), n);
+			ip += n;
+			op += n;
+			continue;
+		}
+
+		uint32_t n = ctrl >> 5;
+		if (n == 7) {
+			if (ip >= size) {
+				return -1;
+			}
+			n += data[ip++];
+		}
+		n += 2;
+		if (ip >= size) {
+			return -1;
+		}
+		uint32_t dist = ((ctrl & 0x1f) << 8) + data[ip++] + 1;
+		if (dist > op || op + n > end) {
+			return -1;
+		}
+
+		/* the match can overlap the bytes being copied */
+		for (uint32_t i = 0; i < n; i++) {
+			out[op] = out[op - dist];
+			op++;
+		}
+	}
+
+	return ip;
+}
+
+
+/* Find the last page of a compressed span. Returns the number of pages of the
+ * span, the last one is returned with its item and start is set to the length
+ * of the span stored in the previous pages. */
+static uint32_t sffs_span_last(struct sffs *fs, uint32_t file_id, uint32_t span, struct sffs_page *page, struct sffs_metadata_item *item, uint32_t *start) {
+	uint32_t first = span * SFFS_SPAN_PAGES;
+	uint32_t count = 0;
+
+	*start = 0;
+	while (count < SFFS_SPAN_PAGES && first + count < SFFS_SPAN_BLOCK) {
+		struct sffs_page p;
+		struct sffs_metadata_item it;
+		if (sffs_find_page(fs, file_id, SFFS_SPAN_BLOCK | (first + count), &p) != SFFS_FIND_PAGE_OK) {
+			break;
+		}
+		sffs_get_page_metadata(fs, &p, &it);
+		if (it.reserved & SFFS_ITEM_FLAG_SPAN) {
+			break;
+		}
+		if (count > 0) {
+			*start = item->size;
+		}
+		*page = p;
+		*item = it;
+		count++;
+	}
+
+	return count;
+}
+
+
+/* Decompress a span into the write buffer of the file. Returns 1 if the span
+ * exists, 0 if it doesn't or -1 on error. */
+static int32_t sffs_span_load(struct sffs_file *f, uint32_t span) {
+	struct sffs *fs = f->fs;
+
+	if (f->wbuf_len == 0 && f->span == span && f->span_gen == fs->page_gen) {
+		return 1;
+	}
+	f->span = SFFS_FILE_SPAN_NONE;
+
+	uint32_t first = span * SFFS_SPAN_PAGES;
+	uint32_t len = 0;
+	for (uint32_t i = 0; i < SFFS_SPAN_PAGES && first + i < SFFS_SPAN_BLOCK; i++) {
+		struct sffs_page page;
+		if (sffs_find_page(fs, f->file_id, SFFS_SPAN_BLOCK | (first + i), &page) != SFFS_FIND_PAGE_OK) {
+			break;
+		}
+		struct sffs_metadata_item item;
+		sffs_get_page_metadata(fs, &page, &item);
+		if (item.reserved & SFFS_ITEM_FLAG_SPAN) {
+			break;
+		}
+		if (item.size <= len || item.size > SFFS_SPAN_SIZE(fs)) {
+			return -1;
+		}
+
+		uint32_t addr;
+		sffs_page_addr(fs, &page, &addr);
+		if ((item.reserved & SFFS_ITEM_FLAG_LITERAL) == 0) {
+			if (item.size - len > SFFS_PAGE_SIZE(fs) ||
+			    sffs_cached_read(fs, addr, &(f->wbuf[len]), item.size - len) != SFFS_CACHED_READ_OK) {
+				return -1;
+			}
+		} else {
+			/* The first scratch page is used, the filesystem lock is
+			 * held exclusively by calls on compressed files. */
+			uint8_t *page_data = fs->scratch;
+			if (sffs_cached_read(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_READ_OK ||
+			    sffs_lz_decompress(page_data, SFFS_PAGE_SIZE(fs), f->wbuf, len, item.size) < 0) {
+				return -1;
+			}
+		}
+		len = item.size;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	f->span = span;
+	f->span_len = len;
+	f->span_gen = fs->page_gen;
+
+	return 1;
+}
+
+
+/* Get a block of a compressed file. Returns 1 with data and size of the block
+ * if its span exists, 0 if it doesn't or -1 on error. */
+static int32_t sffs_span_block(struct sffs_file *f, uint32_t block, const uint8_t **data, uint32_t *size) {
+	struct sffs *fs = f->fs;
+
+	int32_t ret = sffs_span_load(f, block / SFFS_COMPRESS_SPAN_PAGES);
+	if (ret != 1) {
+		return ret;
+	}
+
+	uint32_t offset = (block % SFFS_COMPRESS_SPAN_PAGES) * SFFS_PAGE_SIZE(fs);
+	*data = &(f->wbuf[offset]);
+	*size = (f->span_len > offset) ? MIN(f->span_len - offset, SFFS_PAGE_SIZE(fs)) : 0;
+
+	return 1;
+}
+
+
+/* Write the span held in the write buffer. The last page of the span is
+ * rewritten with new data added, following pages are created. Every page ends
+ * with a complete token and its size is the length of the span decompressed
+ * up to its end, the span is valid after each page write. Returns 0 on success
+ * or -1 if error occured. */
+static int32_t sffs_write_span(struct sffs_file *f) {
+	struct sffs *fs = f->fs;
+	uint32_t span = f->wbuf_block;
+
+	while (f->wbuf_start < f->wbuf_len) {
+		/* Garbage collection can move the last page, it is looked up
+		 * after the new page is found. */
+		struct sffs_page new_page;
+		if (sffs_file_find_erased_page(f, &new_page) != SFFS_FIND_ERASED_PAGE_OK) {
+			return -1;
+		}
+
+		struct sffs_page page;
+		struct sffs_metadata_item item;
+		uint32_t start;
+		uint32_t count = sffs_span_last(fs, f->file_id, span, &page, &item, &start);
+		if (count > 0 && item.size != f->wbuf_start) {
+			return -1;
+		}
+
+		uint8_t *page_data = fs->scratch;
+		uint32_t remaining = f->wbuf_len - f->wbuf_start;
+		uint32_t used = 0;
+		uint32_t done = 0;
+		uint32_t literal = 0;
+		if (count > 0) {
+			/* the last page is filled up first */
+			uint32_t addr;
+			sffs_page_addr(fs, &page, &addr);
+			if (sffs_cached_read(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_READ_OK) {
+				return -1;
+			}
+			literal = (item.reserved & SFFS_ITEM_FLAG_LITERAL) == 0;
+			if (literal) {
+				used = item.size - start;
+				done = MIN(SFFS_PAGE_SIZE(fs) - used, remaining);
+				memcpy(&(page_data[used]), &(f->wbuf[f->wbuf_start]), done);
+				used += done;
+			} else {
+				int32_t ret = sffs_lz_decompress(page_data, SFFS_PAGE_SIZE(fs), f->wbuf, start, item.size);
+				if (ret < 0) {
+					return -1;
+				}
+				used = ret;
+				done = sffs_lz_compress(fs, f->wbuf, f->wbuf_start, f->wbuf_len, page_data, &used, SFFS_PAGE_SIZE(fs));
+			}
+		}
+
+		uint32_t loaded_old = (done > 0);
+		if (!loaded_old) {
+			/* new page, data are stored uncompressed if more of them
+			 * fit the page that way */
+			if ((count + 1) > SFFS_SPAN_PAGES || span * SFFS_SPAN_PAGES + count >= SFFS_SPAN_BLOCK) {
+				return -1;
+			}
+			used = 0;
+			done = sffs_lz_compress(fs, f->wbuf, f->wbuf_start, f->wbuf_len, page_data, &used, SFFS_PAGE_SIZE(fs));
+			literal = 0;
+			uint32_t n = MIN(SFFS_PAGE_SIZE(fs), remaining);
+			if (done < n) {
+				memcpy(page_data, &(f->wbuf[f->wbuf_start]), n);
+				used = n;
+				done = n;
+				literal = 1;
+			}
+			item.block = SFFS_SPAN_BLOCK | (span * SFFS_SPAN_PAGES + count);
+			item.file_id = f->file_id;
+		}
+		memset(&(page_data[used]), 0xff, SFFS_PAGE_SIZE(fs) - used);
+
+		/* the same sequence as used by sffs_write_pages */
+		if (loaded_old) {
+			sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_MOVING);
+		}
+		sffs_set_page_state(fs, &new_page, SFFS_PAGE_STATE_RESERVED);
+
+		uint32_t addr;
+		sffs_page_addr(fs, &new_page, &addr);
+		if (sffs_cached_write(fs, addr, page_data, SFFS_PAGE_SIZE(fs)) != SFFS_CACHED_WRITE_OK) {
+			return -1;
+		}
+		sffs_cache_insert(fs, addr, page_data);
+
+		item.size = f->wbuf_start + done;
+		item.state = SFFS_PAGE_STATE_USED;
+		item.reserved = 0xff & ~SFFS_ITEM_FLAG_SPAN;
+		if (literal) {
+			item.reserved &= ~SFFS_ITEM_FLAG_LITERAL;
+		}
+		sffs_set_page_metadata(fs, &new_page, &item);
+
+		if (loaded_old) {
+			sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_OLD);
+		}
+		f->wbuf_start += done;
+	}
+
+	/* the buffer holds the decompressed span now */
+	f->span = span;
+	f->span_len = f->wbuf_len;
+	f->span_gen = fs->page_gen;
+
+	return 0;
+}
+
+
+/* Append data to a compressed file. The span at the end of the file is
+ * decompressed into the write buffer first, it is written when it is full or
+ * when the file is flushed. */
+static int32_t sffs_write_compressed(struct sffs_file *f, const uint8_t *buf, uint32_t len) {
+	struct sffs *fs = f->fs;
+
+	uint32_t done = 0;
+	while (done < len) {
+		uint32_t pos = f->pos + done;
+		uint32_t span = pos / SFFS_SPAN_SIZE(fs);
+		uint32_t offset = pos % SFFS_SPAN_SIZE(fs);
+
+		if (f->wbuf_len > 0 && f->wbuf_block != span && sffs_do_flush(f) != SFFS_FLUSH_OK) {
+			break;
+		}
+		if (f->wbuf_len == 0) {
+			if ((span + 1) * SFFS_SPAN_PAGES > SFFS_SPAN_BLOCK) {
+				break;
+			}
+			int32_t ret = sffs_span_load(f, span);
+			if (ret < 0) {
+				break;
+			}
+			f->wbuf_block = span;
+			f->wbuf_start = (ret == 1) ? f->span_len : 0;
+		}
+
+		/* data can be added only at the end of the file */
+		uint32_t end = (f->wbuf_len > 0) ? f->wbuf_len : f->wbuf_start;
+		if (offset != end) {
+			break;
+		}
+
+		uint32_t chunk = MIN(len - done, SFFS_SPAN_SIZE(fs) - offset);
+		memcpy(&(f->wbuf[offset]), &(buf[done]), chunk);
+		f->wbuf_len = offset + chunk;
+		done += chunk;
+
+		if (f->wbuf_len == SFFS_SPAN_SIZE(fs) && sffs_do_flush(f) != SFFS_FLUSH_OK) {
+			/* data stays in the buffer and can be flushed later */
+			break;
+		}
+	}
+	f->pos += done;
+
+	return (done > 0) ? (int32_t)done : -1;
+}
+#endif
+
+
+static int32_t sffs_do_close(struct sffs_file *f) {
+	assert(f != NULL);
+
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_CLOSE_FAILED;
+	}
+
+	int32_t ret = SFFS_CLOSE_OK;
+	if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+		ret = SFFS_CLOSE_FAILED;
+	}
+	sffs_extent_release(f);
+
+	/* unlink from the list of opened files */
+	struct sffs_file **p = &(f->fs->files);
+	while (*p != NULL && *p != f) {
+		p = &((*p)->next);
+	}
+	if (*p == f) {
+		*p = f->next;
+	}
+
+	f->file_id = 0;
+	f->fs = NULL;
+
+	return ret;
+}
+
+
+int32_t sffs_close(struct sffs_file *f) {
+	assert(f != NULL);
+
+	/* file is not opened, it is refused by the call */
+	struct sffs *fs = f->fs;
+	if (fs == NULL) {
+		return sffs_do_close(f);
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_CLOSE, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_close(f);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+static int32_t sffs_do_flush(struct sffs_file *f) {
+	assert(f != NULL);
+
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_FLUSH_FAILED;
+	}
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	if (f->compress) {
+		if (f->wbuf_len > 0) {
+			if (sffs_write_span(f) != 0) {
+				return SFFS_FLUSH_FAILED;
+			}
+			f->wbuf_len = 0;
+		}
+		return SFFS_FLUSH_OK;
+	}
+#endif
+
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	if (f->wbuf_len > 0) {
+		uint32_t pos = f->wbuf_block * SFFS_PAGE_SIZE(f->fs) + f->wbuf_start;
+		if (sffs_write_pages(f, pos, &(f->wbuf[f->wbuf_start]), f->wbuf_len) != 0) {
+			return SFFS_FLUSH_FAILED;
+		}
+		f->wbuf_len = 0;
+	}
+#endif
+
+	return SFFS_FLUSH_OK;
+}
+
+
+int32_t sffs_flush(struct sffs_file *f) {
+	assert(f != NULL);
+
+	/* file is not opened, it is refused by the call */
+	struct sffs *fs = f->fs;
+	if (fs == NULL) {
+		return sffs_do_flush(f);
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_FLUSH, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_flush(f);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_sync(struct sffs *fs) {
+	assert(fs != NULL);
+
+	/* Buffers are changed only with the filesystem lock held exclusively,
+	 * locks of the files are not needed. */
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_FLUSH, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = SFFS_SYNC_OK;
+	for (struct sffs_file *f = fs->files; f != NULL; f = f->next) {
+		if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+			ret = SFFS_SYNC_FAILED;
+		}
+	}
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+static int32_t sffs_do_write(struct sffs_file *f, unsigned char *buf, uint32_t len) {
+	assert(f != NULL);
+	assert(buf != NULL);
+
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return -1;
+	}
+
+	struct sffs *fs = f->fs;
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	if (f->compress) {
+		return sffs_write_compressed(f, buf, len);
+	}
+#endif
+
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	if (SFFS_PAGE_SIZE(fs) <= SFFS_WRITE_BUFFER_SIZE) {
+		uint32_t done = 0;
+		while (done < len) {
+			uint32_t pos = f->pos + done;
+			uint32_t block = pos / SFFS_PAGE_SIZE(fs);
+			uint32_t offset = pos % SFFS_PAGE_SIZE(fs);
+			uint32_t chunk = MIN(len - done, SFFS_PAGE_SIZE(fs) - offset);
+
+			/* only a contiguous range of a single block can be buffered,
+			 * flush the buffer if the new data cannot be merged */
+			if (f->wbuf_len > 0 && (f->wbuf_block != block ||
+			    offset > (uint32_t)f->wbuf_start + f->wbuf_len ||
+			    offset + chunk < f->wbuf_start)) {
+				if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+					break;
+				}
+			}
+
+			memcpy(&(f->wbuf[offset]), &(buf[done]), chunk);
+			if (f->wbuf_len == 0) {
+				f->wbuf_block = block;
+				f->wbuf_start = offset;
+				f->wbuf_len = chunk;
+			} else {
+				uint32_t end = MAX((uint32_t)f->wbuf_start + f->wbuf_len, offset + chunk);
+				f->wbuf_start = MIN(f->wbuf_start, offset);
+				f->wbuf_len = end - f->wbuf_start;
+			}
+			done += chunk;
+
+			/* whole block is buffered, write it */
+			if (f->wbuf_len == SFFS_PAGE_SIZE(fs) && sffs_do_flush(f) != SFFS_FLUSH_OK) {
+				/* data stays in the buffer and can be flushed later */
+				break;
+			}
+		}
+		f->pos += done;
+
+		return (done > 0) ? (int32_t)done : -1;
+	}
+#endif
+
+	if (sffs_write_pages(f, f->pos, buf, len) != 0) {
+		return -1;
+	}
+	f->pos += len;
+
+	return len;
+}
+
+
+int32_t sffs_write(struct sffs_file *f, unsigned char *buf, uint32_t len) {
+	assert(f != NULL);
+
+	/* file is not opened, it is refused by the call */
+	struct sffs *fs = f->fs;
+	if (fs == NULL) {
+		return sffs_do_write(f, buf, len);
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_WRITE, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_write(f, buf, len);
+	if (ret > 0) {
+		call.user_bytes = ret;
+	}
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+/* uncached read, used for small reads which would pollute the cache */
+static int32_t sffs_flash_read(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len) {
+	int32_t ret = SFFS_CACHED_READ_OK;
+
+	sffs_cache_lock(fs);
+	fs->stats.flash_reads++;
+	fs->stats.flash_read_bytes += len;
+	if (flash_read(fs->flash, addr, data, len) != FLASH_READ_OK) {
+		ret = SFFS_CACHED_READ_FAILED;
+	}
+	sffs_cache_unlock(fs);
+
+	return ret;
+}
+
+
+static int32_t sffs_flash_readv(struct sffs *fs, const struct flash_iovec *iov, uint32_t count) {
+	sffs_cache_lock(fs);
+	fs->stats.flash_reads++;
+	for (uint32_t i = 0; i < count; i++) {
+		fs->stats.flash_read_bytes += iov[i].len;
+	}
+	int32_t ret = flash_readv(fs->flash, iov, count);
+	sffs_cache_unlock(fs);
+
+	return ret;
+}
+
+
+static int32_t sffs_do_read(struct sffs_file *f, unsigned char *buf, uint32_t len) {
+	assert(f != NULL);
+	assert(buf != NULL);
+	assert(len > 0);
+
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return -1;
+	}
+
+	/* buffered data of this file must be visible */
+	if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+		return -1;
+	}
+
+	struct sffs *fs = f->fs;
+	uint32_t b_start = f->pos / SFFS_PAGE_SIZE(fs);
+	uint32_t b_end = (f->pos + len - 1) / SFFS_PAGE_SIZE(fs);
+
+	uint32_t bytes_read = 0;
+
+	/* Reads spanning multiple pages are done directly to the destination
+	 * buffer as a single scatter/gather request. Ranges of physically
+	 * contiguous pages are merged. */
+	struct flash_iovec iov[SFFS_READ_IOV];
+	uint32_t iov_count = 0;
+
+	/* iterate over all flash pages which need to be read */
+	for (uint32_t i = b_start; i <= b_end; i++) {
+		struct sffs_page page;
+		const uint8_t *span_data = NULL;
+		uint32_t block_size = 0;
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+		/* blocks of compressed spans are decompressed in memory */
+		if (f->compress && sffs_span_block(f, i, &span_data, &block_size) < 0) {
+			return -1;
+		}
+#endif
+		if (span_data == NULL) {
+			if (sffs_find_page(fs, f->file_id, i, &page) != SFFS_FIND_PAGE_OK) {
+				/* no more bytes to read */
+				break;
+			}
+
+			struct sffs_metadata_item item;
+			sffs_get_page_metadata(fs, &page, &item);
+			block_size = item.size;
+		}
+
+		uint32_t file_crop = i * SFFS_PAGE_SIZE(fs) + block_size - 1;
+		uint32_t data_start = f->pos;
+		uint32_t data_end = f->pos + len - 1;
+
+		/* crop to current page boundaries */
+		data_start = MAX(data_start, i * SFFS_PAGE_SIZE(fs));
+		data_end = MIN(data_end, (i + 1) * SFFS_PAGE_SIZE(fs) - 1);
+		data_end = MIN(data_end, file_crop);
+
+		/* block ends before the requested position */
+		if (block_size == 0 || data_end < data_start) {
+			break;
+		}
+
+		/* get offset in the source buffer */
+		uint32_t source_offset = data_start - f->pos;
+
+		/* get offset in the destination buffer */
+		uint32_t dest_offset = data_start % SFFS_PAGE_SIZE(fs);
+
+		/* length of data to be writte is the difference between cropped data */
+		uint32_t dest_len = data_end - data_start + 1;
+
+		assert(source_offset < len);
+		assert(dest_offset < SFFS_PAGE_SIZE(fs));
+		assert(dest_len <= SFFS_PAGE_SIZE(fs));
+		assert(dest_len <= len);
+
+		if (span_data != NULL) {
+			memcpy(&(buf[source_offset]), &(span_data[dest_offset]), dest_len);
+			bytes_read += dest_len;
+			continue;
+		}
+
+		uint32_t addr;
+		sffs_page_addr(fs, &page, &addr);
+		addr += dest_offset;
+
+		//~ printf("reading from page %d, offset %d, length %d to  to buf[%d-%d]\n", i, dest_offset, dest_len, source_offset, source_offset + dest_len);
+		if (b_start == b_end) {
+			/* single page reads are served by the page cache */
+			if (sffs_cached_read(fs, addr, &(buf[source_offset]), dest_len) != SFFS_CACHED_READ_OK) {
+				return -1;
+			}
+		} else if (iov_count > 0 &&
+		           iov[iov_count - 1].addr + iov[iov_count - 1].len == addr &&
+		           iov[iov_count - 1].data + iov[iov_count - 1].len == &(buf[source_offset]))  {
+			iov[iov_count - 1].len += dest_len;
+		} else {
+			if (iov_count == SFFS_READ_IOV) {
+				if (sffs_flash_readv(fs, iov, iov_count) != FLASH_READV_OK) {
+					return -1;
+				}
+				iov_count = 0;
+			}
+			iov[iov_count].addr = addr;
+			iov[iov_count].data = &(buf[source_offset]);
+			iov[iov_count].len = dest_len;
+			iov_count++;
+		}
+
+		bytes_read += dest_len;
+	}
+
+	/* the page cache is write-through, flash contents are always current */
+	if (iov_count > 0 && sffs_flash_readv(fs, iov, iov_count) != FLASH_READV_OK) {
+		return -1;
+	}
+
+	f->pos += bytes_read;
+
+	return bytes_read;
+}
+
+
+int32_t sffs_read(struct sffs_file *f, unsigned char *buf, uint32_t len) {
+	assert(f != NULL);
+
+	/* file is not opened, it is refused by the call */
+	struct sffs *fs = f->fs;
+	if (fs == NULL) {
+		return sffs_do_read(f, buf, len);
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_READ, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_read(f, buf, len);
+	if (ret > 0) {
+		call.user_bytes = ret;
+	}
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+static int32_t sffs_do_read_span(struct sffs_file *f, struct sffs_span *span) {
+	assert(f != NULL);
+	assert(span != NULL);
+
+	span->data = NULL;
+	span->len = 0;
+	span->cp = NULL;
+
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_READ_SPAN_FAILED;
+	}
+
+	if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+		return SFFS_READ_SPAN_FAILED;
+	}
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	/* decompressed data are not in the page cache */
+	if (f->compress) {
+		return SFFS_READ_SPAN_FAILED;
+	}
+#endif
+
+#if SFFS_CACHE_PAGES > 0
+	struct sffs *fs = f->fs;
+	if (!fs->cache_enabled) {
+		return SFFS_READ_SPAN_FAILED;
+	}
+
+	uint32_t block = f->pos / SFFS_PAGE_SIZE(fs);
+	uint32_t offset = f->pos % SFFS_PAGE_SIZE(fs);
+
+	struct sffs_page page;
+	if (sffs_find_page(fs, f->file_id, block, &page) != SFFS_FIND_PAGE_OK) {
+		return SFFS_READ_SPAN_EOF;
+	}
+
+	struct sffs_metadata_item item;
+	sffs_get_page_metadata(fs, &page, &item);
+	if (item.size <= offset) {
+		return SFFS_READ_SPAN_EOF;
+	}
+
+	/* at least one page of the cache is never pinned */
+	uint32_t addr;
+	sffs_page_addr(fs, &page, &addr);
+	sffs_cache_lock(fs);
+	if (fs->cache_pinned >= (fs->cache_pages - 1)) {
+		sffs_cache_unlock(fs);
+		return SFFS_READ_SPAN_FAILED;
+	}
+	struct sffs_cache_page *cp = sffs_cache_find(fs, addr);
+	if (cp != NULL) {
+		cp->referenced = 1;
+		fs->stats.cache_hits++;
+	} else {
+		fs->stats.cache_misses++;
+		if ((cp = sffs_cache_load(fs, addr)) == NULL) {
+			sffs_cache_unlock(fs);
+			return SFFS_READ_SPAN_FAILED;
+		}
+	}
+
+	cp->pinned++;
+	fs->cache_pinned++;
+	sffs_cache_unlock(fs);
+
+	span->data = &(cp->data[offset]);
+	span->len = item.size - offset;
+	span->cp = cp;
+	f->pos += span->len;
+
+	return SFFS_READ_SPAN_OK;
+#else
+	return SFFS_READ_SPAN_FAILED;
+#endif
+}
+
+
+int32_t sffs_read_span(struct sffs_file *f, struct sffs_span *span) {
+	assert(f != NULL);
+
+	/* file is not opened, it is refused by the call */
+	struct sffs *fs = f->fs;
+	if (fs == NULL) {
+		return sffs_do_read_span(f, span);
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_READ, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_read_span(f, span);
+	if (ret == SFFS_READ_SPAN_OK) {
+		call.user_bytes = span->len;
+	}
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_release_span(struct sffs_file *f, struct sffs_span *span) {
+	assert(f != NULL);
+	assert(span != NULL);
+
+#if SFFS_CACHE_PAGES > 0
+	struct sffs *fs = f->fs;
+	if (fs == NULL || span->cp == NULL) {
+		return SFFS_RELEASE_SPAN_FAILED;
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_COUNT, SFFS_LOCK_SHARED);
+	sffs_cache_lock(fs);
+	int32_t ret = SFFS_RELEASE_SPAN_FAILED;
+	if (span->cp->pinned > 0) {
+		span->cp->pinned--;
+		fs->cache_pinned--;
+		span->data = NULL;
+		span->len = 0;
+		span->cp = NULL;
+		ret = SFFS_RELEASE_SPAN_OK;
+	}
+	sffs_cache_unlock(fs);
+	sffs_op_end(fs, &call);
+
+	return ret;
+#else
+	return SFFS_RELEASE_SPAN_FAILED;
+#endif
+}
+
+
+static int32_t sffs_do_seek(struct sffs_file *f, uint32_t pos) {
+	if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+		return SFFS_SEEK_FAILED;
+	}
+
+	/* file size is known from the file table, blocks at the new position
+	 * are resolved by the block index afterwards */
+	uint32_t size;
+	if (sffs_do_file_size(f->fs, f->file_id, &size) != SFFS_FILE_SIZE_OK) {
+		return SFFS_SEEK_FAILED;
+	}
+	if (pos > size) {
+		return SFFS_SEEK_FAILED;
+	}
+	f->pos = pos;
+
+	return SFFS_SEEK_OK;
+}
+
+
+static int32_t sffs_do_seek_from(struct sffs_file *f, int32_t offset, uint32_t whence) {
+	if (sffs_do_flush(f) != SFFS_FLUSH_OK) {
+		return SFFS_SEEK_FAILED;
+	}
+
+	int64_t base;
+	switch (whence) {
+		case SFFS_SEEK_SET:
+			base = 0;
+			break;
+
+		case SFFS_SEEK_CUR:
+			base = f->pos;
+			break;
+
+		case SFFS_SEEK_END: {
+			uint32_t size;
+			if (sffs_do_file_size(f->fs, f->file_id, &size) != SFFS_FILE_SIZE_OK) {
+				return SFFS_SEEK_FAILED;
+			}
+			base = size;
+			break;
+		}
+
+		default:
+			return SFFS_SEEK_FAILED;
+	}
+
+	int64_t pos = base + offset;
+	if (pos < 0 || pos > 0xffffffff) {
+		return SFFS_SEEK_FAILED;
+	}
+
+	return sffs_do_seek(f, (uint32_t)pos);
+}
+
+
+int32_t sffs_seek(struct sffs_file *f, uint32_t pos) {
+	assert(f != NULL);
+
+	struct sffs *fs = f->fs;
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_SEEK_FAILED;
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_COUNT, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_seek(f, pos);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_seek_from(struct sffs_file *f, int32_t offset, uint32_t whence) {
+	assert(f != NULL);
+
+	struct sffs *fs = f->fs;
+	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+		return SFFS_SEEK_FAILED;
+	}
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, f, SFFS_OP_COUNT, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_seek_from(f, offset, whence);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
+
+
+int32_t sffs_file_remove(struct sffs *fs, uint32_t file_id) {
+	assert(fs != NULL);
+
+	if (SFFS_FILE_ID_RESERVED(file_id)) {
+		return SFFS_FILE_REMOVE_FAILED;
+	}
+
+	if (sffs_remove_many(fs, &file_id, 1) != SFFS_REMOVE_MANY_OK) {
+		return SFFS_FILE_REMOVE_FAILED;
+	}
+
+	return SFFS_FILE_REMOVE_OK;
+}
+
+
+/* Check if any of the files has blocks. Can be answered only if the file table
+ * is available, files are assumed to exist otherwise. */
+static uint32_t sffs_files_exist(struct sffs *fs, const uint32_t *file_ids, uint32_t count) {
+#if SFFS_FILE_TABLE_SIZE > 0
+	if (fs->index_valid && fs->file_table_valid) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (sffs_file_table_find(fs, file_ids[i], 0) != NULL) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+#endif
+	(void)file_ids;
+	(void)count;
+
+	return 1;
+}
+
+
+static int32_t sffs_do_remove_many(struct sffs *fs, const uint32_t *file_ids, uint32_t count) {
+	assert(fs != NULL);
+	assert(file_ids != NULL || count == 0);
+
+	/* cannot remove filesystem metadata file */
+	for (uint32_t i = 0; i < count; i++) {
+		if (file_ids[i] == 0) {
+			return SFFS_REMOVE_MANY_FAILED;
+		}
+	}
+
+	/* TODO: interrupting the sweep leaves some blocks of the files in the
+	 * filesystem. */
+	for (uint32_t sector = 0; sector < fs->sector_count; sector++) {
+		/* all blocks already removed */
+		if (!sffs_files_exist(fs, file_ids, count)) {
+			break;
+		}
+
+		struct sffs_sector_info *si = &(fs->sectors[sector]);
+		if (si->state == 0 || si->used == 0) {
+			continue;
+		}
+
+		/* all items of the sector are read at once */
+		struct sffs_metadata_header *header;
+		struct sffs_metadata_item *items;
+		if (sffs_metadata_load(fs, sector, si->next_free, &header, &items) != SFFS_CACHED_READ_OK) {
+			return SFFS_REMOVE_MANY_FAILED;
+		}
+		uint32_t items_pos = sector * SFFS_SECTOR_SIZE(fs) + sizeof(struct sffs_metadata_header);
+
+		uint32_t removed = 0;
+		for (uint32_t p = 0; p < si->next_free; p++) {
+			if (items[p].state != SFFS_PAGE_STATE_USED && items[p].state != SFFS_PAGE_STATE_MOVING) {
+				continue;
+			}
+			uint32_t match = 0;
+			for (uint32_t i = 0; i < count; i++) {
+				if (items[p].file_id == file_ids[i]) {
+					match = 1;
+					break;
+				}
+			}
+			if (!match) {
+				continue;
+			}
+
+			uint8_t page_state = SFFS_PAGE_STATE_OLD;
+			uint32_t state_pos = items_pos + p * sizeof(struct sffs_metadata_item) + offsetof(struct sffs_metadata_item, state);
+			sffs_checkpoint_touch(fs, sector);
+			if (sffs_cached_write(fs, state_pos, &page_state, sizeof(page_state)) != SFFS_CACHED_WRITE_OK) {
+				return SFFS_REMOVE_MANY_FAILED;
+			}
+
+			struct sffs_page page = { .sector = sector, .page = p };
+			items[p].state = page_state;
+			sffs_index_update(fs, &page, &(items[p]));
+			si->used--;
+			si->old++;
+			removed++;
+		}
+
+		/* sector state is updated once for all removed pages */
+		if (removed > 0) {
+			fs->page_gen++;
+			sffs_sector_commit_state(fs, sector);
+		}
+	}
+
+	return SFFS_REMOVE_MANY_OK;
+}
+
+
+int32_t sffs_remove_many(struct sffs *fs, const uint32_t *file_ids, uint32_t count) {
 	assert(fs != NULL);
-	assert(page != NULL);
-	assert(item != NULL);
+	assert(file_ids != NULL || count == 0);
 
-	uint32_t item_pos = page->sector * fs->sector_size + sizeof(struct sffs_metadata_header) + page->page * sizeof(struct sffs_metadata_item);
-	sffs_cached_write(fs, item_pos, (uint8_t *)item, sizeof(struct sffs_metadata_item));
+	/* checkpoint and directory files are removed only internally */
+	for (uint32_t i = 0; i < count; i++) {
+		if (SFFS_FILE_ID_RESERVED(file_ids[i])) {
+			return SFFS_REMOVE_MANY_FAILED;
+		}
+	}
 
-	sffs_update_sector_metadata(fs, page->sector);
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_REMOVE, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_remove_many(fs, file_ids, count);
+	sffs_op_end(fs, &call);
 
-	return SFFS_SET_PAGE_MATEDATA_OK;
+	return ret;
 }
 
 
-int32_t sffs_set_page_state(struct sffs *fs, struct sffs_page *page, uint8_t page_state) {
+static int32_t sffs_do_file_size(struct sffs *fs, uint32_t file_id, uint32_t *size) {
 	assert(fs != NULL);
-	assert(page != NULL);
+	assert(size != NULL);
+
+#if SFFS_FILE_TABLE_SIZE > 0
+	if (fs->index_valid && fs->file_table_valid) {
+		struct sffs_file_entry *entry = sffs_file_table_find(fs, file_id, 0);
+		if (entry == NULL) {
+			*size = 0;
+			return SFFS_FILE_SIZE_OK;
+		}
+		/* files with holes are walked until the first missing block */
+		if (entry->last != 0xffff && entry->last + 1 == entry->blocks) {
+			*size = entry->size;
+			return SFFS_FILE_SIZE_OK;
+		}
+	}
+#endif
 
+	uint32_t block = 0;
+	uint32_t total_size = 0;
+	struct sffs_page page;
 	struct sffs_metadata_item item;
-	sffs_get_page_metadata(fs, page, &item);
-	item.state = page_state;
-	sffs_set_page_metadata(fs, page, &item);
-
-	return SFFS_SET_PAGE_STATE_OK;
-}
 
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	/* spans of a compressed file are walked until the first partial one */
+	uint32_t start;
+	while (sffs_span_last(fs, file_id, block, &page, &item, &start) > 0) {
+		total_size += item.size;
+		block++;
+		if (item.size < SFFS_SPAN_SIZE(fs)) {
+			break;
+		}
+	}
+	if (block > 0) {
+		*size = total_size;
+		return SFFS_FILE_SIZE_OK;
+	}
+#endif
 
-int32_t sffs_check_file_opened(struct sffs_file *f) {
-	assert(f != NULL);
+	while (sffs_find_page(fs, file_id, block, &page) == SFFS_FIND_PAGE_OK) {
+		sffs_get_page_metadata(fs, &page, &item);
+		total_size += item.size;
 
-	/* file is probably not opened. TODO: better check */
-	if (f->file_id == 0 || f->fs == NULL) {
-		return SFFS_CHECK_FILE_OPENED_FAILED;
+		block++;
 	}
+	*size = total_size;
 
-	return SFFS_CHECK_FILE_OPENED_OK;
+	return SFFS_FILE_SIZE_OK;
 }
 
 
-int32_t sffs_open_id(struct sffs *fs, struct sffs_file *f, uint32_t file_id, uint32_t mode) {
+int32_t sffs_file_size(struct sffs *fs, uint32_t file_id, uint32_t *size) {
 	assert(fs != NULL);
-	assert(f != NULL);
-	assert(file_id != 0xffff);
 
-	switch (mode) {
-		case SFFS_OVERWRITE:
-			/* remove old file first, new one will be created.
-			 * We are not checking return value intentionally.
-			 * Write pointer is set to the beginning. */
-			sffs_file_remove(fs, file_id);
-			f->pos = 0;
-			break;
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_FILE_SIZE, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_file_size(fs, file_id, size);
+	sffs_op_end(fs, &call);
 
-		case SFFS_APPEND:
-			/* Determine end of the file and seek to that position. */
-			sffs_file_size(fs, file_id, &(f->pos));
-			break;
+	return ret;
+}
 
-		case SFFS_READ:
-			/* Set write pointer to the beginning. */
-			f->pos = 0;
-			break;
 
-		default:
-			return SFFS_OPEN_ID_FAILED;
+#if SFFS_DIRECTORY_SIZE > 0
+/* FNV-1a hash of a file name */
+static uint32_t sffs_name_hash(const uint8_t *name, uint32_t len) {
+	uint32_t h = 2166136261u;
+
+	for (uint32_t i = 0; i < len; i++) {
+		h = (h ^ name[i]) * 16777619u;
 	}
 
-	f->fs = fs;
-	f->file_id = file_id;
+	return h;
+}
+#endif
 
-	return SFFS_OPEN_ID_OK;
+
+/* Internal file used to write directory records. */
+static void sffs_dir_file(struct sffs *fs, struct sffs_file *f) {
+	f->fs = fs;
+	f->file_id = SFFS_DIRECTORY_FILE_ID;
+	f->pos = 0;
+	f->blocks = SFFS_FILE_BLOCKS_UNKNOWN;
+	f->tail_gen = fs->page_gen;
+	f->extent = 0;
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	f->wbuf_len = 0;
+#endif
+#if SFFS_LOCKING
+	f->lock = NULL;
+#endif
+	f->next = NULL;
 }
 
 
-int32_t sffs_close(struct sffs_file *f) {
-	assert(f != NULL);
+/* Read one directory record. Returns 0 on success or -1 if the record doesn't
+ * exist or it cannot be read. */
+static int32_t sffs_dir_read(struct sffs *fs, uint32_t slot, struct sffs_dir_entry *entry) {
+	uint32_t pos = slot * sizeof(struct sffs_dir_entry);
+	struct sffs_page page;
+	struct sffs_metadata_item item;
+	uint32_t addr;
 
-	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
-		return SFFS_CLOSE_FAILED;
+	if (slot >= fs->dir_slots ||
+	    sffs_find_page(fs, SFFS_DIRECTORY_FILE_ID, pos / SFFS_PAGE_SIZE(fs), &page) != SFFS_FIND_PAGE_OK) {
+		return -1;
+	}
+	sffs_get_page_metadata(fs, &page, &item);
+	if (item.size < pos % SFFS_PAGE_SIZE(fs) + sizeof(struct sffs_dir_entry)) {
+		return -1;
+	}
+	sffs_page_addr(fs, &page, &addr);
+	if (sffs_cached_read(fs, addr + pos % SFFS_PAGE_SIZE(fs), (uint8_t *)entry, sizeof(struct sffs_dir_entry)) != SFFS_CACHED_READ_OK) {
+		return -1;
 	}
 
-	f->file_id = 0;
-	f->fs = NULL;
-
-	return SFFS_CLOSE_OK;
+	return 0;
 }
 
 
-int32_t sffs_write(struct sffs_file *f, unsigned char *buf, uint32_t len) {
-	assert(f != NULL);
-	assert(buf != NULL);
+/* Write one directory record. The block with the record is rewritten as any
+ * other file block. Returns 0 on success or -1 if error occured. */
+static int32_t sffs_dir_write(struct sffs *fs, uint32_t slot, const struct sffs_dir_entry *entry) {
+	struct sffs_file f;
 
-	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+	sffs_dir_file(fs, &f);
+	if (sffs_write_pages(&f, slot * sizeof(struct sffs_dir_entry), (const uint8_t *)entry, sizeof(struct sffs_dir_entry)) != 0) {
 		return -1;
 	}
 
-	/* Write buffer can span multiple flash blocks. We need to determine
-	 * where the buffer starts and ends. */
-	uint32_t b_start = f->pos / f->fs->page_size;
-	uint32_t b_end = (f->pos + len - 1) / f->fs->page_size;
-
-	/* now we can iterate over all flash pages which need to be modified */
-	for (uint32_t i = b_start; i <= b_end; i++) {
+	return 0;
+}
 
-		uint8_t page_data[f->fs->page_size];
-		struct sffs_page page;
-		uint32_t loaded_old = 0;
 
-		if (sffs_find_page(f->fs, f->file_id, i, &page) == SFFS_FIND_PAGE_OK) {
-			/* page is valid. Get its address and read from flash */
-			uint32_t addr;
-			sffs_page_addr(f->fs, &page, &addr);
-			if (sffs_cached_read(f->fs, addr, page_data, sizeof(page_data)) != SFFS_CACHED_READ_OK) {
-				return -1;
-			}
+#if SFFS_DIRECTORY_SIZE > 0
+static void sffs_names_remove(struct sffs *fs, struct sffs_name_entry *entry) {
+	uint32_t mask = fs->names_size - 1;
+	uint32_t i = entry - fs->names;
+	uint32_t j = i;
 
-			loaded_old = 1;
-		} else {
-			/* the file doesn't have allocated requested page. Create
-			 * new one filled with zeroes */
-			memset(page_data, 0x00, sizeof(page_data));
+	/* backward shift deletion, the same as in the block index */
+	while (1) {
+		j = (j + 1) & mask;
+		if (fs->names[j].file_id == 0xffff) {
+			break;
 		}
+		uint32_t k = fs->names[j].hash & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			fs->names[i] = fs->names[j];
+			i = j;
+		}
+	}
+	fs->names[i].file_id = 0xffff;
+	fs->names_used--;
+}
 
-		/* determine where data wants to be written */
-		uint32_t data_start = f->pos;
-		uint32_t data_end = f->pos + len - 1;
-
-		/* crop to current page boundaries */
-		data_start = MAX(data_start, i * f->fs->page_size);
-		data_end = MIN(data_end, (i + 1) * f->fs->page_size - 1);
 
-		/* get offset in the source buffer */
-		uint32_t source_offset = data_start - f->pos;
+/* Add a record to the name index. The index is invalidated if it is full. */
+static void sffs_names_add(struct sffs *fs, uint32_t hash, uint32_t file_id, uint32_t slot) {
+	if (!fs->names_valid) {
+		return;
+	}
+	if ((fs->names_used + 1) >= fs->names_size) {
+		fs->names_valid = 0;
+		return;
+	}
 
-		/* get offset in the destination buffer */
-		uint32_t dest_offset = data_start % f->fs->page_size;
+	uint32_t i = hash & (fs->names_size - 1);
+	while (fs->names[i].file_id != 0xffff) {
+		i = (i + 1) & (fs->names_size - 1);
+	}
+	fs->names[i].file_id = file_id;
+	fs->names[i].slot = slot;
+	fs->names[i].hash = hash;
+	fs->names_used++;
+}
+#endif
+
+
+/* Rebuild the name index from the directory file. */
+static void sffs_dir_load(struct sffs *fs) {
+	fs->dir_slots = 0;
+	fs->dir_free = 0;
+	fs->dir_next_id = SFFS_DIRECTORY_FIRST_ID;
+#if SFFS_DIRECTORY_SIZE > 0
+	fs->names_used = 0;
+	fs->names_valid = (fs->names_size > 0);
+	for (uint32_t i = 0; i < fs->names_size; i++) {
+		fs->names[i].file_id = 0xffff;
+	}
+#endif
 
-		/* length of data to be writte is the difference between cropped data */
-		uint32_t dest_len = data_end - data_start + 1;
+	/* the second scratch page is not used during mount anymore */
+	uint8_t *page_data = &(fs->scratch[fs->scratch_size]);
+	uint32_t per_page = SFFS_PAGE_SIZE(fs) / sizeof(struct sffs_dir_entry);
+	struct sffs_page page;
+	for (uint32_t block = 0; sffs_find_page(fs, SFFS_DIRECTORY_FILE_ID, block, &page) == SFFS_FIND_PAGE_OK; block++) {
+		struct sffs_metadata_item item;
+		uint32_t addr;
+		sffs_get_page_metadata(fs, &page, &item);
+		sffs_page_addr(fs, &page, &addr);
+		if (item.size > SFFS_PAGE_SIZE(fs) || sffs_cached_read(fs, addr, page_data, item.size) != SFFS_CACHED_READ_OK) {
+			break;
+		}
 
-		//~ printf("writing buf[%d-%d] to page %d, offset %d, length %d\n", source_offset, source_offset + dest_len, i, dest_offset, dest_len);
+		struct sffs_dir_entry *entries = (struct sffs_dir_entry *)page_data;
+		uint32_t count = item.size / sizeof(struct sffs_dir_entry);
+		for (uint32_t i = 0; i < count; i++) {
+			if (entries[i].file_id == 0) {
+				fs->dir_free++;
+				continue;
+			}
+			if (entries[i].file_id >= fs->dir_next_id && entries[i].file_id < SFFS_DIRECTORY_FILE_ID) {
+				fs->dir_next_id = entries[i].file_id + 1;
+			}
+#if SFFS_DIRECTORY_SIZE > 0
+			sffs_names_add(fs, sffs_name_hash(entries[i].name, MIN(entries[i].name_len, SFFS_NAME_SIZE)),
+				entries[i].file_id, block * per_page + i);
+#endif
+		}
+		fs->dir_slots = block * per_page + count;
 
-		assert(source_offset < len);
-		assert(dest_offset < f->fs->page_size);
-		assert(dest_len <= f->fs->page_size);
-		assert(dest_len <= len);
+		/* records are appended, only the last block can be partial */
+		if (count < per_page) {
+			break;
+		}
+	}
+}
 
-		/* TODO: write actual data */
-		memcpy(&(page_data[dest_offset]), &(buf[source_offset]), dest_len);
 
-		/* find new erased page and mark is as reserved (prepared for writing).
-		 * Mark old page as moving. */
-		struct sffs_page new_page;
-		if (sffs_find_erased_page(f->fs, &new_page) != SFFS_FIND_ERASED_PAGE_OK) {
-			return -1;
+/* Find the directory record of a name. Returns 0 if it was found or -1
+ * otherwise. */
+static int32_t sffs_dir_find(struct sffs *fs, const uint8_t *name, uint32_t len, uint32_t *slot, uint32_t *file_id) {
+	struct sffs_dir_entry entry;
+
+#if SFFS_DIRECTORY_SIZE > 0
+	if (fs->names_valid) {
+		uint32_t hash = sffs_name_hash(name, len);
+		uint32_t i = hash & (fs->names_size - 1);
+		while (fs->names[i].file_id != 0xffff) {
+			if (fs->names[i].hash == hash &&
+			    sffs_dir_read(fs, fs->names[i].slot, &entry) == 0 &&
+			    entry.name_len == len && memcmp(entry.name, name, len) == 0) {
+				*slot = fs->names[i].slot;
+				*file_id = fs->names[i].file_id;
+				return 0;
+			}
+			i = (i + 1) & (fs->names_size - 1);
 		}
-
-		if (loaded_old) {
-			sffs_set_page_state(f->fs, &page, SFFS_PAGE_STATE_MOVING);
+		return -1;
+	}
+#endif
+
+	for (uint32_t i = 0; i < fs->dir_slots; i++) {
+		if (sffs_dir_read(fs, i, &entry) == 0 && entry.file_id != 0 &&
+		    entry.name_len == len && memcmp(entry.name, name, len) == 0) {
+			*slot = i;
+			*file_id = entry.file_id;
+			return 0;
 		}
-		sffs_set_page_state(f->fs, &new_page, SFFS_PAGE_STATE_RESERVED);
+	}
 
-		/* Finally write modified page, set its state to used and set state of
-		 * old page to old- */
-		uint32_t addr;
-		sffs_page_addr(f->fs, &new_page, &addr);
-		if (sffs_cached_write(f->fs, addr, page_data, sizeof(page_data)) != SFFS_CACHED_WRITE_OK) {
-			return -1;
-		}
+	return -1;
+}
 
-		struct sffs_metadata_item item;
-		item.block = i;
-		item.size = data_end % f->fs->page_size + 1;
-		item.state = SFFS_PAGE_STATE_USED;
-		item.file_id = f->file_id;
-		sffs_set_page_metadata(f->fs, &new_page, &item);
 
-		if (loaded_old) {
-			sffs_set_page_state(f->fs, &page, SFFS_PAGE_STATE_OLD);
+/* Check if a file ID is assigned to a name or if the file has any data. */
+static uint32_t sffs_dir_id_used(struct sffs *fs, uint32_t file_id) {
+	uint32_t size;
+	if (sffs_do_file_size(fs, file_id, &size) != SFFS_FILE_SIZE_OK || size > 0) {
+		return 1;
+	}
+
+#if SFFS_DIRECTORY_SIZE > 0
+	if (fs->names_valid) {
+		for (uint32_t i = 0; i < fs->names_size; i++) {
+			if (fs->names[i].file_id == file_id) {
+				return 1;
+			}
 		}
+		return 0;
 	}
+#endif
 
-	f->pos += len;
+	struct sffs_dir_entry entry;
+	for (uint32_t i = 0; i < fs->dir_slots; i++) {
+		if (sffs_dir_read(fs, i, &entry) == 0 && entry.file_id == file_id) {
+			return 1;
+		}
+	}
 
-	return len;
+	return 0;
 }
 
 
-int32_t sffs_read(struct sffs_file *f, unsigned char *buf, uint32_t len) {
-	assert(f != NULL);
-	assert(buf != NULL);
-	assert(len > 0);
+/* Add a new name to the directory and assign a free file ID to it. Returns 0
+ * on success or -1 if error occured. */
+static int32_t sffs_dir_create(struct sffs *fs, const uint8_t *name, uint32_t len, uint32_t *file_id) {
+	/* IDs are assigned in sequence, they are searched from the beginning
+	 * when they are depleted */
+	uint32_t id = fs->dir_next_id;
+	uint32_t tries = SFFS_DIRECTORY_FILE_ID - SFFS_DIRECTORY_FIRST_ID;
+	while (tries > 0) {
+		if (id >= SFFS_DIRECTORY_FILE_ID) {
+			id = SFFS_DIRECTORY_FIRST_ID;
+		}
+		if (!sffs_dir_id_used(fs, id)) {
+			break;
+		}
+		id++;
+		tries--;
+	}
+	if (tries == 0) {
+		return -1;
+	}
 
-	if (sffs_check_file_opened(f) != SFFS_CHECK_FILE_OPENED_OK) {
+	/* free records are reused first */
+	uint32_t slot = fs->dir_slots;
+	struct sffs_dir_entry entry;
+	for (uint32_t i = 0; i < fs->dir_slots && fs->dir_free > 0; i++) {
+		if (sffs_dir_read(fs, i, &entry) == 0 && entry.file_id == 0) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot > 0xffff) {
 		return -1;
 	}
 
-	uint32_t b_start = f->pos / f->fs->page_size;
-	uint32_t b_end = (f->pos + len - 1) / f->fs->page_size;
+	memset(&entry, 0, sizeof(entry));
+	entry.file_id = id;
+	entry.name_len = len;
+	entry.reserved = 0xff;
+	memcpy(entry.name, name, len);
+	if (sffs_dir_write(fs, slot, &entry) != 0) {
+		return -1;
+	}
 
-	uint32_t bytes_read = 0;
+	if (slot == fs->dir_slots) {
+		fs->dir_slots++;
+	} else {
+		fs->dir_free--;
+	}
+	fs->dir_next_id = id + 1;
+#if SFFS_DIRECTORY_SIZE > 0
+	sffs_names_add(fs, sffs_name_hash(name, len), id, slot);
+#endif
+	*file_id = id;
 
-	/* iterate over all flash pages which need to be read */
-	for (uint32_t i = b_start; i <= b_end; i++) {
+	return 0;
+}
 
 
-		uint8_t page_data[f->fs->page_size];
-		struct sffs_page page;
-		uint32_t dest_len;
+/* Name must not be empty and it must fit the directory record. */
+static uint32_t sffs_name_len(const char *name) {
+	size_t len = strlen(name);
 
-		if (sffs_find_page(f->fs, f->file_id, i, &page) == SFFS_FIND_PAGE_OK) {
-			uint32_t addr;
-			sffs_page_addr(f->fs, &page, &addr);
-			if (sffs_cached_read(f->fs, addr, page_data, sizeof(page_data)) != SFFS_CACHED_READ_OK) {
-				return -1;
-			}
+	return (len > SFFS_NAME_SIZE) ? 0 : len;
+}
 
-			struct sffs_metadata_item item;
-			sffs_get_page_metadata(f->fs, &page, &item);
 
-			uint32_t file_crop = i * f->fs->page_size + item.size - 1;
-			uint32_t data_start = f->pos;
-			uint32_t data_end = f->pos + len - 1;
+static int32_t sffs_do_name_lookup(struct sffs *fs, const char *name, uint32_t *file_id) {
+	uint32_t len = sffs_name_len(name);
+	if (len == 0) {
+		return SFFS_NAME_LOOKUP_FAILED;
+	}
 
-			/* crop to current page boundaries */
-			data_start = MAX(data_start, i * f->fs->page_size);
-			data_end = MIN(data_end, (i + 1) * f->fs->page_size - 1);
-			data_end = MIN(data_end, file_crop);
+	uint32_t slot;
+	if (sffs_dir_find(fs, (const uint8_t *)name, len, &slot, file_id) != 0) {
+		return SFFS_NAME_LOOKUP_NOT_FOUND;
+	}
 
-			/* get offset in the source buffer */
-			uint32_t source_offset = data_start - f->pos;
+	return SFFS_NAME_LOOKUP_OK;
+}
 
-			/* get offset in the destination buffer */
-			uint32_t dest_offset = data_start % f->fs->page_size;
 
-			/* length of data to be writte is the difference between cropped data */
-			dest_len = data_end - data_start + 1;
+int32_t sffs_name_lookup(struct sffs *fs, const char *name, uint32_t *file_id) {
+	assert(fs != NULL);
+	assert(name != NULL);
+	assert(file_id != NULL);
 
-			assert(source_offset < len);
-			assert(dest_offset < f->fs->page_size);
-			assert(dest_len <= f->fs->page_size);
-			assert(dest_len <= len);
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_COUNT, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_name_lookup(fs, name, file_id);
+	sffs_op_end(fs, &call);
 
-			//~ printf("reading from page %d, offset %d, length %d to  to buf[%d-%d]\n", i, dest_offset, dest_len, source_offset, source_offset + dest_len);
-			memcpy(&(buf[source_offset]), &(page_data[dest_offset]), dest_len);
-		} else {
-			/* no more bytes to read */
-			break;
-		}
+	return ret;
+}
 
-		bytes_read += dest_len;
+
+static int32_t sffs_do_open_name(struct sffs *fs, struct sffs_file *f, const char *name, uint32_t mode) {
+	uint32_t len = sffs_name_len(name);
+	if (len == 0) {
+		return SFFS_OPEN_NAME_FAILED;
 	}
 
-	f->pos += bytes_read;
+	uint32_t slot;
+	uint32_t file_id;
+	if (sffs_dir_find(fs, (const uint8_t *)name, len, &slot, &file_id) != 0) {
+		/* only files opened for writing are created */
+		uint32_t write = mode & ~(SFFS_COMPRESS | SFFS_EXTENT);
+		if ((write != SFFS_OVERWRITE && write != SFFS_APPEND) ||
+		    sffs_dir_create(fs, (const uint8_t *)name, len, &file_id) != 0) {
+			return SFFS_OPEN_NAME_FAILED;
+		}
+	}
 
-	return bytes_read;
+	if (sffs_do_open_id(fs, f, file_id, mode) != SFFS_OPEN_ID_OK) {
+		return SFFS_OPEN_NAME_FAILED;
+	}
+
+	return SFFS_OPEN_NAME_OK;
 }
 
 
-int32_t sffs_seek(struct sffs_file *f, uint32_t pos) {
+int32_t sffs_open_name(struct sffs *fs, struct sffs_file *f, const char *name, uint32_t mode) {
+	assert(fs != NULL);
 	assert(f != NULL);
+	assert(name != NULL);
 
-	return SFFS_SEEK_OK;
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_OPEN, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_open_name(fs, f, name, mode);
+	sffs_op_end(fs, &call);
+
+	return ret;
 }
 
 
-int32_t sffs_file_remove(struct sffs *fs, uint32_t file_id) {
-	assert(fs != NULL);
+static int32_t sffs_do_remove_name(struct sffs *fs, const char *name) {
+	uint32_t len = sffs_name_len(name);
+	uint32_t slot;
+	uint32_t file_id;
+	if (len == 0 || sffs_dir_find(fs, (const uint8_t *)name, len, &slot, &file_id) != 0) {
+		return SFFS_REMOVE_NAME_FAILED;
+	}
 
-	/* cannot remove filesystem metadata file */
-	if (file_id == 0) {
-		return SFFS_FILE_REMOVE_FAILED;
+	/* Data are removed first, interrupted removal leaves an empty file
+	 * with the name. */
+	if (sffs_do_remove_many(fs, &file_id, 1) != SFFS_REMOVE_MANY_OK) {
+		return SFFS_REMOVE_NAME_FAILED;
+	}
+	struct sffs_dir_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	if (sffs_dir_write(fs, slot, &entry) != 0) {
+		return SFFS_REMOVE_NAME_FAILED;
 	}
+	fs->dir_free++;
 
-	/* iterate over file blocks until first find fails, mark all found blocks
-	 * as old (remove from file).
-	 * TODO: this action should probably be done in a safer way, interrupting
-	 * deletion sequence will cause garbage to be left in the filesystem
-	 * (file tail) */
-	uint32_t block = 0;
-	struct sffs_page page;
-	while (sffs_find_page(fs, file_id, block, &page) == SFFS_FIND_PAGE_OK) {
-		sffs_set_page_state(fs, &page, SFFS_PAGE_STATE_OLD);
-		block++;
+#if SFFS_DIRECTORY_SIZE > 0
+	if (fs->names_valid) {
+		uint32_t i = sffs_name_hash((const uint8_t *)name, len) & (fs->names_size - 1);
+		while (fs->names[i].file_id != 0xffff && fs->names[i].slot != slot) {
+			i = (i + 1) & (fs->names_size - 1);
+		}
+		if (fs->names[i].file_id != 0xffff) {
+			sffs_names_remove(fs, &(fs->names[i]));
+		}
 	}
+#endif
 
-	return SFFS_FILE_REMOVE_OK;
+	return SFFS_REMOVE_NAME_OK;
 }
 
 
-int32_t sffs_file_size(struct sffs *fs, uint32_t file_id, uint32_t *size) {
+int32_t sffs_remove_name(struct sffs *fs, const char *name) {
 	assert(fs != NULL);
+	assert(name != NULL);
 
-	uint32_t block = 0;
-	uint32_t total_size = 0;
-	struct sffs_page page;
-	while (sffs_find_page(fs, file_id, block, &page) == SFFS_FIND_PAGE_OK) {
-		struct sffs_metadata_item item;
-		sffs_get_page_metadata(fs, &page, &item);
-		total_size += item.size;
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_REMOVE, SFFS_LOCK_EXCLUSIVE);
+	int32_t ret = sffs_do_remove_name(fs, name);
+	sffs_op_end(fs, &call);
 
-		block++;
+	return ret;
+}
+
+
+static int32_t sffs_do_dir_next(struct sffs *fs, uint32_t *pos, uint32_t *file_id, char *name, uint32_t name_size) {
+	uint32_t slot = 0;
+	uint32_t found = 0;
+	struct sffs_dir_entry entry;
+
+#if SFFS_DIRECTORY_SIZE > 0
+	if (fs->names_valid) {
+		while (*pos < fs->names_size && !found) {
+			struct sffs_name_entry *n = &(fs->names[(*pos)++]);
+			if (n->file_id != 0xffff) {
+				*file_id = n->file_id;
+				slot = n->slot;
+				found = 1;
+			}
+		}
+		if (!found) {
+			return SFFS_DIR_NEXT_END;
+		}
+		if (name == NULL) {
+			return SFFS_DIR_NEXT_OK;
+		}
+		if (sffs_dir_read(fs, slot, &entry) != 0) {
+			return SFFS_DIR_NEXT_FAILED;
+		}
 	}
-	*size = total_size;
+#endif
 
-	return SFFS_FILE_SIZE_OK;
+	while (!found && *pos < fs->dir_slots) {
+		slot = (*pos)++;
+		if (sffs_dir_read(fs, slot, &entry) != 0) {
+			return SFFS_DIR_NEXT_FAILED;
+		}
+		if (entry.file_id != 0) {
+			*file_id = entry.file_id;
+			found = 1;
+		}
+	}
+	if (!found) {
+		return SFFS_DIR_NEXT_END;
+	}
+
+	if (name != NULL) {
+		uint32_t len = MIN(MIN(entry.name_len, SFFS_NAME_SIZE), name_size - 1);
+		memcpy(name, entry.name, len);
+		name[len] = '\0';
+	}
+
+	return SFFS_DIR_NEXT_OK;
 }
 
 
+int32_t sffs_dir_next(struct sffs *fs, uint32_t *pos, uint32_t *file_id, char *name, uint32_t name_size) {
+	assert(fs != NULL);
+	assert(pos != NULL);
+	assert(file_id != NULL);
+	assert(name == NULL || name_size > 0);
+
+	struct sffs_call call;
+	sffs_op_begin(fs, &call, NULL, SFFS_OP_COUNT, SFFS_LOCK_SHARED);
+	int32_t ret = sffs_do_dir_next(fs, pos, file_id, name, name_size);
+	sffs_op_end(fs, &call);
+
+	return ret;
+}
@@ -33,9 +33,384 @@
 #define SFFS_MASTER_MAGIC 0x93827485
 #define SFFS_METADATA_MAGIC 0x87985214
 #define SFFS_LABEL_SIZE 8
+#define SFFS_CHECKPOINT_MAGIC 0x43504b54
+
+/* Checkpoint of the block index and sector summary is stored in a file with
+ * reserved ID. Reserved files cannot be opened. */
+#define SFFS_CHECKPOINT_FILE_ID 0xfffe
+
+/* Directory mapping file names to IDs is stored in a reserved file too. IDs
+ * starting from SFFS_DIRECTORY_FIRST_ID are assigned to new named files, they
+ * should not be used by files opened by sffs_open_id. */
+#define SFFS_DIRECTORY_FILE_ID 0xfffd
+#define SFFS_DIRECTORY_FIRST_ID 0x8000
+
+/* Maximum length of a file name */
+#define SFFS_NAME_SIZE 28
+
+/* Number of entries of the RAM block index. It must be a power of two and it
+ * should be somewhat larger than the total number of data pages on the flash
+ * to keep hash chains short. Define as 0 to disable the index completely (data
+ * pages are searched by scanning sector metadata then). Sizes of the index,
+ * file table and cache are used by sffs_init, other sizes can be requested
+ * with sffs_init_arena if the support is enabled. Every entry takes 10 bytes
+ * of RAM, the default index (10 KiB) is sized for about 256 KiB of flash with
+ * 256 byte pages. If more blocks are used than fit the index, it is dropped
+ * and pages are searched in sector metadata again. */
+#ifndef SFFS_INDEX_SIZE
+#define SFFS_INDEX_SIZE 1024
+#endif
+
+/* Number of entries of the RAM file table holding size and block count of
+ * every file. It must be a power of two larger than the number of files and
+ * it is maintained together with the block index (it is not available if the
+ * index is disabled). If it overflows, file sizes are computed from the index. */
+#ifndef SFFS_FILE_TABLE_SIZE
+#define SFFS_FILE_TABLE_SIZE 256
+#endif
+#if SFFS_INDEX_SIZE == 0
+#undef SFFS_FILE_TABLE_SIZE
+#define SFFS_FILE_TABLE_SIZE 0
+#endif
+
+/* Number of entries of the RAM name index built from the directory during
+ * mount. It must be a power of two larger than the number of named files.
+ * If it is 0 or it overflows, the directory file is searched instead. */
+#ifndef SFFS_DIRECTORY_SIZE
+#define SFFS_DIRECTORY_SIZE 64
+#endif
+
+/* Number of flash pages held in the page cache. Define as 0 to disable the
+ * cache, all reads go directly to the flash then. */
+#ifndef SFFS_CACHE_PAGES
+#define SFFS_CACHE_PAGES 16
+#endif
+
+/* Size of one cache buffer. It must be at least as large as the flash page,
+ * the cache is disabled during mount otherwise. */
+#ifndef SFFS_CACHE_PAGE_SIZE
+#define SFFS_CACHE_PAGE_SIZE 256
+#endif
+
+/* Size of scratch page buffers used when pages are written or moved. It must
+ * be at least as large as the logical page, mount fails otherwise. */
+#ifndef SFFS_SCRATCH_PAGE_SIZE
+#define SFFS_SCRATCH_PAGE_SIZE 4096
+#endif
+
+/* One scratch page is used for page writes and moves, the other one when the
+ * checkpoint is written or loaded. */
+#define SFFS_SCRATCH_PAGES 2
+
+/* Index, file table, cache and scratch pages are embedded in struct sffs and
+ * sffs_init can be used. Define as 0 to keep struct sffs small if all runtime
+ * structures are allocated from a caller-provided arena by sffs_init_arena. */
+#ifndef SFFS_STATIC_STORAGE
+#define SFFS_STATIC_STORAGE 1
+#endif
+
+/* Required alignment of the arena passed to sffs_init_arena */
+#define SFFS_ARENA_ALIGN 8
+
+/* Flash geometry can be fixed at compile time. Page and sector sizes are
+ * constants then and address computations are reduced to shifts and masks.
+ * Page size is the size of the logical page, both sizes must be powers of two.
+ * Only flash memories with the same geometry can be mounted. Geometry is read
+ * from the flash if they are zero. */
+#ifndef SFFS_FIXED_PAGE_SIZE
+#define SFFS_FIXED_PAGE_SIZE 0
+#endif
+#ifndef SFFS_FIXED_SECTOR_SIZE
+#define SFFS_FIXED_SECTOR_SIZE 0
+#endif
+
+/* Maximum number of sectors which can be managed. Sector summary table is
+ * allocated for this number of sectors, mount fails on larger flash devices. */
+#ifndef SFFS_MAX_SECTORS
+#define SFFS_MAX_SECTORS 256
+#endif
+
+/* Maximum number of moving pages left by interrupted writes which are resolved
+ * during mount. Remaining ones are resolved when they are garbage collected. */
+#ifndef SFFS_MOUNT_MOVING_PAGES
+#define SFFS_MOUNT_MOVING_PAGES 8
+#endif
+
+/* Monotonic time source in microseconds used to measure mount time. It can be
+ * defined to a platform timer, time is not measured by default. */
+#ifndef SFFS_TIME_US
+#define SFFS_TIME_US() 0
+#endif
+
+/* Collect flash operation counters per public API call and call the timing
+ * hook. Work done on behalf of the call (eg. garbage collection started by
+ * a write) is accounted to the call. */
+#ifndef SFFS_OP_STATS
+#define SFFS_OP_STATS 1
+#endif
+
+/* Support for locking hooks set by sffs_set_lock. Without them the filesystem
+ * must not be used by multiple tasks at once. */
+#ifndef SFFS_LOCKING
+#define SFFS_LOCKING 1
+#endif
+
+/* Size of the buffer metadata of one sector are loaded to when sectors are
+ * scanned. It must hold the sector header and all metadata items, flash
+ * geometry requiring more cannot be mounted. */
+#ifndef SFFS_METADATA_BUF_SIZE
+#define SFFS_METADATA_BUF_SIZE 512
+#endif
+
+/* Number of sectors worth of erased pages kept for the garbage collector.
+ * Writes fail if the only erased pages left are the reserved ones, garbage
+ * collection starts when less than one more sector of erased pages is left. */
+#ifndef SFFS_GC_RESERVE_SECTORS
+#define SFFS_GC_RESERVE_SECTORS 1
+#endif
+
+/* Background garbage collection (sffs_gc_step) starts compacting dirty sectors
+ * when less than this number of sectors worth of erased pages is left above
+ * the reserve. */
+#ifndef SFFS_GC_BACKGROUND_SECTORS
+#define SFFS_GC_BACKGROUND_SECTORS 3
+#endif
+
+/* Sectors erased by sffs_gc_step are erased asynchronously if it is defined
+ * as 1. The erase is started by flash_sector_erase_start and completed by
+ * later steps after flash_poll reports the flash is not busy, the flash driver
+ * must provide both. By default sffs_gc_step uses the blocking erase, erases
+ * done inline by writes are always blocking. */
+#ifndef SFFS_ASYNC_ERASE
+#define SFFS_ASYNC_ERASE 0
+#endif
+
+/* Maximum number of ranges of one scatter/gather flash read issued by
+ * sffs_read. Physically contiguous pages are merged into one range. */
+#ifndef SFFS_READ_IOV
+#define SFFS_READ_IOV 8
+#endif
+
+/* Size of the per-file write buffer. Small writes are accumulated in the
+ * buffer and one page is programmed only when the buffer fills or the file is
+ * flushed. It is used when the flash page fits in it, 0 disables buffering. */
+#ifndef SFFS_WRITE_BUFFER_SIZE
+#define SFFS_WRITE_BUFFER_SIZE 256
+#endif
+
+/* Number of blocks in one compressed span. Data of compressed files are
+ * split to spans, each span is compressed separately into as many pages as
+ * needed. A whole span is decompressed when any of its bytes is read, it must
+ * fit the write buffer. 0 disables compression. */
+#ifndef SFFS_COMPRESS_SPAN_PAGES
+#define SFFS_COMPRESS_SPAN_PAGES 0
+#endif
+
+/* Size of the match finder hash table used by the compressor as a power of
+ * two, two bytes per entry. */
+#ifndef SFFS_COMPRESS_HASH_BITS
+#define SFFS_COMPRESS_HASH_BITS 8
+#endif
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0 && SFFS_WRITE_BUFFER_SIZE == 0
+#error "compressed spans require the write buffer"
+#endif
+
+/* One entry of the block index maps file_id/block pair to the data page where
+ * the block is stored. Unused entries have file_id set to 0xffff. */
+struct sffs_index_entry {
+	uint16_t file_id;
+	uint16_t block;
+	uint16_t sector;
+	uint16_t page;
+	uint16_t size;
+};
+
+/* File table entry. Blocks is the number of indexed blocks of the file, last is
+ * the highest block number or 0xffff if it is not known. The file has no holes
+ * if last + 1 equals blocks, size in bytes is the sum of all block sizes then.
+ * Unused entries have file_id set to 0xffff. */
+struct sffs_file_entry {
+	uint16_t file_id;
+	uint16_t blocks;
+	uint16_t last;
+	uint32_t size;
+};
+
+/* Directory record, the name is not terminated. Free records have file_id
+ * set to 0 (file 0 is the master file and it is never named). */
+struct __attribute__((__packed__)) sffs_dir_entry {
+	uint16_t file_id;
+	uint8_t name_len;
+	uint8_t reserved;
+	uint8_t name[SFFS_NAME_SIZE];
+};
+
+/* Name index entry points to the directory record of a file with the name
+ * hash. Unused entries have file_id set to 0xffff. */
+struct sffs_name_entry {
+	uint16_t file_id;
+	uint16_t slot;
+	uint32_t hash;
+};
+
+/* Summary of one sector kept in RAM. Page counts are determined during mount
+ * and they are updated with every page state change. Used count includes
+ * reserved and moving pages. Erased pages are always allocated in order,
+ * next_free is the first page of the trailing run of erased pages. */
+struct sffs_sector_info {
+	uint8_t state;
+	uint16_t erased;
+	uint16_t used;
+	uint16_t old;
+	uint16_t next_free;
+	uint16_t erase_count;
+};
+
+/* One flash page held in the page cache. Unused entries have addr set to
+ * SFFS_CACHE_EMPTY. Pinned pages are referenced by read spans, they are never
+ * replaced and their data are kept even if they are invalidated. */
+struct sffs_cache_page {
+	uint32_t addr;
+	uint8_t referenced;
+	uint8_t pinned;
+	uint8_t *data;
+};
+#define SFFS_CACHE_EMPTY 0xffffffff
+
+/* Part of a file returned by sffs_read_span. Data point directly to the page
+ * cache and they are valid until the span is released. */
+struct sffs_span {
+	const uint8_t *data;
+	uint32_t len;
+
+	struct sffs_cache_page *cp;
+};
+
+/* Write amplification is the ratio of flash_program_bytes and
+ * user_write_bytes. */
+struct sffs_stats {
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+
+	/* flash read requests and bytes read */
+	uint32_t flash_reads;
+	uint32_t flash_read_bytes;
+
+	/* flash program requests, bytes programmed and sectors erased */
+	uint32_t flash_programs;
+	uint32_t flash_program_bytes;
+	uint32_t flash_erases;
+
+	/* pages relocated by the garbage collector and sector metadata loads */
+	uint32_t gc_moves;
+	uint32_t sector_scans;
+
+	/* bytes requested by the user */
+	uint32_t user_read_bytes;
+	uint32_t user_write_bytes;
+};
+
+/* Public API calls with separate statistics */
+#define SFFS_OP_MOUNT 0
+#define SFFS_OP_OPEN 1
+#define SFFS_OP_CLOSE 2
+#define SFFS_OP_FLUSH 3
+#define SFFS_OP_WRITE 4
+#define SFFS_OP_READ 5
+#define SFFS_OP_REMOVE 6
+#define SFFS_OP_FILE_SIZE 7
+#define SFFS_OP_GC 8
+#define SFFS_OP_CHECKPOINT 9
+#define SFFS_OP_COUNT 10
+
+/* Phase of the call passed to the timing hook */
+#define SFFS_HOOK_BEGIN 0
+#define SFFS_HOOK_END 1
+
+/* Flash operations caused by one kind of API calls including all nested
+ * calls. Time is measured using SFFS_TIME_US. */
+struct sffs_op_stats {
+	uint32_t calls;
+	uint32_t flash_reads;
+	uint32_t flash_read_bytes;
+	uint32_t flash_programs;
+	uint32_t flash_program_bytes;
+	uint32_t flash_erases;
+	uint32_t user_bytes;
+	uint32_t time_us;
+};
+
+/* Mode in which a lock is taken. File and cache locks are always taken in
+ * the exclusive mode. */
+#define SFFS_LOCK_SHARED 0
+#define SFFS_LOCK_EXCLUSIVE 1
+
+/* Locking primitives of the platform (eg. RTOS mutexes). Lock objects are
+ * passed to sffs_set_lock and sffs_file_set_lock, they are never created or
+ * destroyed by sffs. A lock used only in the exclusive mode can be a plain
+ * mutex ignoring the mode. */
+struct sffs_lock_ops {
+	void (*lock)(void *lock, uint32_t mode);
+	void (*unlock)(void *lock, uint32_t mode);
+};
+
+/* Results of the last mount. Recovered pages were left reserved or moving
+ * after an interrupted write and they have been marked as old. */
+struct sffs_mount_info {
+	uint32_t sectors_valid;
+	uint32_t sectors_invalid;
+	uint32_t pages_recovered;
+	uint32_t flash_reads;
+	uint32_t flash_read_bytes;
+	uint32_t time_us;
+
+	/* sectors restored from the checkpoint without reading their metadata */
+	uint32_t sectors_restored;
+	uint32_t checkpoint_gen;
+
+	/* sectors with invalid header formatted again, their erase or format
+	 * was interrupted */
+	uint32_t sectors_formatted;
+};
+
+/* Sizes of runtime structures allocated by sffs_init_arena. Index, file
+ * table and name index sizes must be powers of two or 0 to disable them. Page
+ * size is the size of the largest logical page to be mounted, it is used for
+ * the cache and scratch pages. */
+struct sffs_config {
+	uint32_t index_size;
+	uint32_t file_table_size;
+	uint32_t cache_pages;
+	uint32_t page_size;
+	uint32_t directory_size;
+};
+
+#if SFFS_STATIC_STORAGE
+/* Runtime structures used by sffs_init */
+struct sffs_storage {
+#if SFFS_INDEX_SIZE > 0
+	struct sffs_index_entry index[SFFS_INDEX_SIZE];
+#endif
+#if SFFS_FILE_TABLE_SIZE > 0
+	struct sffs_file_entry file_table[SFFS_FILE_TABLE_SIZE];
+#endif
+#if SFFS_CACHE_PAGES > 0
+	struct sffs_cache_page cache[SFFS_CACHE_PAGES];
+	uint8_t cache_data[SFFS_CACHE_PAGES][SFFS_CACHE_PAGE_SIZE];
+#endif
+	uint8_t scratch[SFFS_SCRATCH_PAGES * SFFS_SCRATCH_PAGE_SIZE];
+#if SFFS_DIRECTORY_SIZE > 0
+	struct sffs_name_entry names[SFFS_DIRECTORY_SIZE];
+#endif
+};
+#endif
 
 struct sffs {
+	/* Page size is the size of a logical page, it can consist of multiple
+	 * physical flash pages (2^page_shift pages). */
 	uint32_t page_size;
+	uint32_t page_shift;
 	uint32_t sector_size;
 	uint32_t sector_count;
 	uint32_t data_pages_per_sector;
@@ -43,7 +418,131 @@ struct sffs {
 
 	struct flash_dev *flash;
 
+	/* label of the mounted filesystem, not terminated if it is full */
 	char label[SFFS_LABEL_SIZE];
+
+	struct sffs_stats stats;
+	struct sffs_mount_info mount_info;
+
+#if SFFS_OP_STATS
+	struct sffs_op_stats op_stats[SFFS_OP_COUNT];
+
+	/* called when a public API call begins and ends */
+	void (*hook)(struct sffs *fs, uint32_t op, uint32_t phase, void *ctx);
+	void *hook_ctx;
+#endif
+
+#if SFFS_LOCKING
+	/* Filesystem lock is held by every public API call, reads hold it in
+	 * the shared mode. Cache lock protects the page cache and statistics
+	 * updated by shared calls. */
+	const struct sffs_lock_ops *lock_ops;
+	void *fs_lock;
+	void *cache_lock;
+#endif
+
+	struct sffs_sector_info sectors[SFFS_MAX_SECTORS];
+
+	/* Header and items of one sector read at once. Contents are not
+	 * preserved across calls. */
+	uint8_t metadata_buf[SFFS_METADATA_BUF_SIZE];
+	/* total number of allocatable erased pages */
+	uint32_t free_pages;
+	/* sector from which erased pages are currently allocated */
+	uint32_t alloc_sector;
+	/* sectors reserved as extents of files opened with SFFS_EXTENT, other
+	 * pages are allocated from them only if no other sector is left */
+	uint8_t extent_reserved[(SFFS_MAX_SECTORS + 7) / 8];
+	uint8_t gc_running;
+	uint8_t gc_mode;
+
+	/* incremented every time a page is marked as used or old, it is used
+	 * to validate locations cached in open files */
+	uint32_t page_gen;
+
+	/* opened files, they are flushed by sffs_sync */
+	struct sffs_file *files;
+
+	/* sector being compacted by sffs_gc_step and the next page to check */
+	uint32_t gc_victim;
+	uint32_t gc_page;
+	/* sector erased by sffs_gc_step, SFFS_MAX_SECTORS if none */
+	uint32_t gc_erasing;
+
+	/* SFFS_SCRATCH_PAGES buffers of scratch_size bytes */
+	uint8_t *scratch;
+	uint32_t scratch_size;
+
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	/* last position of every hashed three byte sequence of the span being
+	 * compressed */
+	uint16_t compress_hash[1 << SFFS_COMPRESS_HASH_BITS];
+#endif
+
+#if SFFS_CACHE_PAGES > 0
+	/* Write-through page cache with CLOCK replacement. Pages are cached on
+	 * read misses, writes update cached copies only. */
+	struct sffs_cache_page *cache;
+	uint32_t cache_pages;
+	uint32_t cache_page_size;
+	uint32_t cache_hand;
+	uint32_t cache_last;
+	uint32_t cache_pinned;
+	uint8_t cache_enabled;
+#endif
+
+#if SFFS_INDEX_SIZE > 0
+	/* Block index is built during mount and kept coherent on every metadata
+	 * item write. If it overflows, it is marked as invalid and sffs falls
+	 * back to metadata scanning until the filesystem is mounted again. */
+	struct sffs_index_entry *index;
+	uint32_t index_size;
+	uint32_t index_used;
+	uint8_t index_valid;
+#endif
+
+#if SFFS_INDEX_SIZE > 0
+	/* Active checkpoint. A sector bit in the dirty bitmap is cleared (in RAM
+	 * and in the checkpoint on the flash) when the sector is modified for
+	 * the first time after the checkpoint has been written. */
+	uint32_t checkpoint_bitmap_addr;
+	uint32_t checkpoint_gen;
+	uint8_t checkpoint_dirty[(SFFS_MAX_SECTORS + 7) / 8];
+	uint8_t checkpoint_active;
+	uint8_t checkpoint_writing;
+#endif
+
+#if SFFS_FILE_TABLE_SIZE > 0
+	/* valid only if the block index is valid too */
+	struct sffs_file_entry *file_table;
+	uint32_t file_table_size;
+	uint32_t file_table_used;
+	uint8_t file_table_valid;
+#endif
+
+	/* Directory file has dir_slots records, dir_free of them are free.
+	 * dir_next_id is the next file ID to be assigned. */
+	uint32_t dir_slots;
+	uint32_t dir_free;
+	uint32_t dir_next_id;
+
+#if SFFS_DIRECTORY_SIZE > 0
+	/* valid only if all directory records fit */
+	struct sffs_name_entry *names;
+	uint32_t names_size;
+	uint32_t names_used;
+	uint8_t names_valid;
+#endif
+
+#if SFFS_STATIC_STORAGE
+	struct sffs_storage storage;
+#endif
+};
+
+struct sffs_page {
+	uint32_t sector;
+	uint32_t page;
+
 };
 
 struct sffs_file {
@@ -51,13 +550,53 @@ struct sffs_file {
 	uint16_t file_id;
 
 	struct sffs *fs;
-};
 
-struct sffs_page {
-	uint32_t sector;
-	uint32_t page;
+	/* Number of blocks of the file and location of the last one. They are
+	 * valid only if no page was written or expired since tail_gen was
+	 * saved from the filesystem page generation counter. */
+	uint32_t blocks;
+	struct sffs_page tail_page;
+	uint16_t tail_size;
+	uint32_t tail_gen;
+
+#if SFFS_WRITE_BUFFER_SIZE > 0
+	/* Dirty range of one block not written to the flash yet. The buffer
+	 * is empty if wbuf_len is 0. */
+	uint8_t wbuf[SFFS_WRITE_BUFFER_SIZE];
+	uint32_t wbuf_block;
+	uint16_t wbuf_start;
+	uint16_t wbuf_len;
+#endif
 
+#if SFFS_COMPRESS_SPAN_PAGES > 0
+	/* The write buffer of a compressed file holds the whole span being
+	 * appended, wbuf_block is the span number and wbuf_start is the
+	 * length already written. If the buffer is empty, it holds decompressed
+	 * span valid while span_gen matches the page generation counter. */
+	uint8_t compress;
+	uint32_t span;
+	uint32_t span_len;
+	uint32_t span_gen;
+#endif
+
+	/* Pages of a file opened with SFFS_EXTENT are allocated from sector
+	 * extent_sector reserved for the file, extents is the number of
+	 * sectors reserved so far. */
+	uint8_t extent;
+	uint32_t extent_sector;
+	uint32_t extents;
+
+#if SFFS_LOCKING
+	/* taken before the filesystem lock if the file is used by multiple tasks */
+	void *lock;
+#endif
+
+	/* list of files opened on the filesystem */
+	struct sffs_file *next;
 };
+#define SFFS_FILE_BLOCKS_UNKNOWN 0xffffffff
+#define SFFS_FILE_SPAN_NONE 0xffffffff
+#define SFFS_FILE_EXTENT_NONE 0xffffffff
 
 
 struct __attribute__((__packed__)) sffs_master_page {
@@ -67,7 +606,8 @@ struct __attribute__((__packed__)) sffs_master_page {
 	uint8_t sector_size;
 	uint16_t sector_count;
 
-	uint8_t label[8];
+	/* padded with zeroes, not terminated if it is SFFS_LABEL_SIZE long */
+	uint8_t label[SFFS_LABEL_SIZE];
 };
 
 /* Erase state is set right after sector has been erased. Note that 0xFF is not
@@ -95,12 +635,30 @@ struct __attribute__((__packed__)) sffs_master_page {
 #define SFFS_SECTOR_STATE_OLD 0x42
 
 
+/* Flags in the reserved byte of the sector header. Flags are set by clearing
+ * their bits, they are reset when the sector is erased. */
+#define SFFS_SECTOR_FLAG_CHECKPOINT 0x01
+
+/* Upper three bits of the reserved byte contain inverted log2 of the number of
+ * physical pages in one logical page. Headers written by older versions have
+ * all bits set (one physical page). */
+#define SFFS_PAGE_SHIFT_MAX 7
+#define SFFS_SECTOR_PAGE_SHIFT(r) ((uint8_t)~(r) >> 5)
+#define SFFS_SECTOR_PAGE_SHIFT_BITS(s) ((uint8_t)~((s) << 5))
+
 struct __attribute__((__packed__)) sffs_metadata_header {
 	uint32_t magic;
 
 	uint8_t state;
+
+	/* Sector flags and page shift. SFFS_SECTOR_FLAG_CHECKPOINT marks
+	 * sectors containing pages of the checkpoint file, they are always
+	 * scanned during mount. All sectors must have the same page shift. */
 	uint8_t reserved;
-	uint16_t reserved2;
+
+	/* Number of times the sector has been erased. It is incremented
+	 * every time the sector is formatted. */
+	uint16_t erase_count;
 };
 
 
@@ -130,8 +688,8 @@ struct __attribute__((__packed__)) sffs_metadata_header {
  * Metadata items can be spread along multiple metadata pages.
  */
 struct __attribute__((__packed__)) sffs_metadata_item {
-	/* Unique file identifier. It can be assigned using
-	 * some sort of directory structure. This also means
+	/* Unique file identifier. It can be assigned by
+	 * the directory to a named file. This also means
 	 * that maximum number of files on single filesystem
 	 * can be 65536 */
 	uint16_t file_id;
@@ -150,9 +708,32 @@ struct __attribute__((__packed__)) sffs_metadata_item {
 	/* How much block space is used */
 	uint16_t size;
 
+	/* Page flags, all bits are set in pages of uncompressed files. */
 	uint8_t reserved;
 };
 
+/* Flags in the reserved byte of the metadata item. Flags are set by clearing
+ * their bits. Pages of compressed spans are flagged with SFFS_ITEM_FLAG_SPAN
+ * and SFFS_SPAN_BLOCK is set in their block numbers. Size of such page is the
+ * number of bytes of the span decompressed up to the end of the page. Pages
+ * flagged with SFFS_ITEM_FLAG_LITERAL contain the bytes uncompressed. */
+#define SFFS_ITEM_FLAG_SPAN 0x01
+#define SFFS_ITEM_FLAG_LITERAL 0x02
+#define SFFS_SPAN_BLOCK 0x8000
+
+/* First block of the checkpoint file. The header is followed by the dirty
+ * bitmap with one bit per sector. Following blocks contain sector summary
+ * records of all sectors and block index entries. */
+struct __attribute__((__packed__)) sffs_checkpoint_header {
+	uint32_t magic;
+	uint32_t generation;
+	uint16_t sector_count;
+	uint16_t data_pages_per_sector;
+	uint16_t record_size;
+	uint16_t entry_size;
+	uint32_t entries;
+};
+
 
 /**
  * File open mode constants
@@ -161,6 +742,23 @@ struct __attribute__((__packed__)) sffs_metadata_item {
 #define SFFS_APPEND 2
 #define SFFS_READ 3
 
+/**
+ * Flag combined with SFFS_OVERWRITE or SFFS_APPEND to create a compressed
+ * file. Compressed files can be only appended, they are recognized when they
+ * are opened and the flag is not required then.
+ */
+#define SFFS_COMPRESS 0x10
+
+/**
+ * Flag combined with SFFS_OVERWRITE or SFFS_APPEND to allocate pages of a
+ * large sequentially written file in extents. Pages are taken in order from
+ * the longest erased run of a partially used sector first and from whole
+ * erased sectors reserved for the file later, sequential reads are merged to
+ * continuous flash transfers and a removed file leaves sectors which can be
+ * erased without relocation. The reservation ends when the file is closed.
+ */
+#define SFFS_EXTENT 0x20
+
 
 /**
  * Initialize SFFS filesystem structure and allocate all required resources.
@@ -175,10 +773,41 @@ int32_t sffs_init(struct sffs *fs);
 #define SFFS_INIT_OK 0
 #define SFFS_INIT_FAILED -1
 
+/**
+ * Initialize SFFS filesystem structure with all runtime structures allocated
+ * from a caller-provided arena. No other memory is used. The arena must stay
+ * valid until the filesystem is freed.
+ *
+ * @param fs A filesystem structure to initialize.
+ * @param arena Memory aligned to SFFS_ARENA_ALIGN bytes.
+ * @param size Size of the arena, at least sffs_ram_size(config) bytes.
+ * @param config Sizes of runtime structures. Index, file table and cache
+ *               are not used if their support is disabled at compile time.
+ *
+ * @return SFFS_INIT_ARENA_OK on success or
+ *         SFFS_INIT_ARENA_FAILED if the arena is too small or the
+ *         configuration is not valid.
+ */
+int32_t sffs_init_arena(struct sffs *fs, void *arena, uint32_t size, const struct sffs_config *config);
+#define SFFS_INIT_ARENA_OK 0
+#define SFFS_INIT_ARENA_FAILED -1
+
+/**
+ * Get size of the arena required by sffs_init_arena.
+ *
+ * @param config Sizes of runtime structures.
+ *
+ * @return Number of bytes required.
+ */
+uint32_t sffs_ram_size(const struct sffs_config *config);
+
 /**
  * Mounts SFFS filesystem from a flash device. Mount operation fetches required
  * information from the flash, initializes page cache (if enabled), checks master
- * block if it is valid and marks the filesystem as mounted.
+ * block if it is valid and marks the filesystem as mounted. Metadata of all
+ * sectors are read in one pass, sector summary, block index and file table are
+ * built and pages and sectors left by interrupted writes and erases are
+ * recovered. Statistics of the pass are saved to fs->mount_info.
  *
  * @param fs A SFFS filesystem structure where the flash will be mounted to.
  * @param flash A flash device to be mounted.
@@ -214,22 +843,88 @@ int32_t sffs_cache_clear(struct sffs *fs);
 #define SFFS_CACHE_CLEAR_OK 0
 #define SFFS_CACHE_CLEAR_FAILED -1
 
+/**
+ * Drop all cached pages overlapping specified flash address range. It must
+ * be called before the range is erased.
+ *
+ * @param fs A filesystem with cache.
+ * @param addr Start of the range.
+ * @param len Length of the range.
+ *
+ * @return SFFS_CACHE_INVALIDATE_OK.
+ */
+int32_t sffs_cache_invalidate(struct sffs *fs, uint32_t addr, uint32_t len);
+#define SFFS_CACHE_INVALIDATE_OK 0
+
+/**
+ * Put a whole page to the cache without reading it from the flash. It is used
+ * after a data page has been programmed, data must be equal to the flash
+ * contents.
+ *
+ * @param fs A filesystem with cache.
+ * @param addr Page aligned flash address.
+ * @param data Page contents.
+ *
+ * @return SFFS_CACHE_INSERT_OK.
+ */
+int32_t sffs_cache_insert(struct sffs *fs, uint32_t addr, const uint8_t *data);
+#define SFFS_CACHE_INSERT_OK 0
+
 /**
  * Create new SFFS filesystem on flash memory. Flash memory cannot be mounted
  * during this operation. Information about memory geometry is fetched directly
  * from the flash.
  *
+ * @param fs A filesystem initialized by sffs_init or sffs_init_arena with no
+ *           files opened. It is used as a working area to keep erase counts
+ *           of the sectors, it must be mounted by sffs_mount afterwards.
  * @param flash A flash device to create SFFS filesystem on.
  *
  * @return SFFS_FORMAT_OK on success or
  *         SFFS_FORMAT_FAILED otherwise.
  */
-int32_t sffs_format(struct flash_dev *flash);
+int32_t sffs_format(struct sffs *fs, struct flash_dev *flash);
 #define SFFS_FORMAT_OK 0
 #define SFFS_FORMAT_FAILED -1
 
+/**
+ * Create new SFFS filesystem with a label. Master page containing flash
+ * geometry and the label is written as the first block of file 0.
+ *
+ * @param fs A filesystem initialized by sffs_init or sffs_init_arena.
+ * @param flash A flash device to create SFFS filesystem on.
+ * @param label Filesystem label, up to SFFS_LABEL_SIZE characters. It can be
+ *              NULL. Longer labels are truncated, the stored label is not
+ *              NUL-terminated if it is SFFS_LABEL_SIZE characters long.
+ *
+ * @return SFFS_FORMAT_OK on success or
+ *         SFFS_FORMAT_FAILED otherwise.
+ */
+int32_t sffs_format_label(struct sffs *fs, struct flash_dev *flash, const char *label);
+
+/**
+ * Create new SFFS filesystem with logical pages consisting of multiple physical
+ * flash pages. Larger logical pages reduce number of metadata items per sector
+ * (and the time required to scan them) and increase maximum file size. They
+ * are required for flash memories with large sectors and small pages. The
+ * geometry is detected during mount.
+ *
+ * @param fs A filesystem initialized by sffs_init or sffs_init_arena, its
+ *           scratch pages must hold the logical page.
+ * @param flash A flash device to create SFFS filesystem on.
+ * @param label Filesystem label, up to SFFS_LABEL_SIZE characters. It can be
+ *              NULL.
+ * @param page_shift Logical page consists of 2^page_shift physical pages,
+ *                   up to SFFS_PAGE_SHIFT_MAX.
+ *
+ * @return SFFS_FORMAT_OK on success or
+ *         SFFS_FORMAT_FAILED if the geometry is not supported.
+ */
+int32_t sffs_format_geometry(struct sffs *fs, struct flash_dev *flash, const char *label, uint32_t page_shift);
+
 int32_t sffs_sector_debug_print(struct sffs *fs, uint32_t sector);
 #define SFFS_SECTOR_DEBUG_PRINT_OK 0
+#define SFFS_SECTOR_DEBUG_PRINT_FAILED -1
 
 /**
  * Print filesystem structure to stdout. It can help to visualize  how pages and
@@ -242,6 +937,84 @@ int32_t sffs_sector_debug_print(struct sffs *fs, uint32_t sector);
 int32_t sffs_debug_print(struct sffs *fs);
 #define SFFS_DEBUG_PRINT_OK 0
 
+/**
+ * Print flash operation counters and their breakdown per API call to stdout.
+ *
+ * @param fs A filesystem to print statistics of.
+ *
+ * @return SFFS_STATS_PRINT_OK.
+ */
+int32_t sffs_stats_print(struct sffs *fs);
+#define SFFS_STATS_PRINT_OK 0
+
+/**
+ * Clear all statistics counters.
+ *
+ * @param fs A filesystem to clear statistics of.
+ *
+ * @return SFFS_STATS_RESET_OK.
+ */
+int32_t sffs_stats_reset(struct sffs *fs);
+#define SFFS_STATS_RESET_OK 0
+
+/**
+ * Set a hook called when a public API call begins and ends. It can be used to
+ * measure time of calls with a platform timer. If locking is used, the hook
+ * of calls holding the filesystem lock shared can run concurrently.
+ *
+ * @param fs A filesystem to set the hook for.
+ * @param hook Function called with SFFS_OP_* call type and SFFS_HOOK_BEGIN
+ *             or SFFS_HOOK_END phase. NULL disables the hook.
+ * @param ctx User context passed to the hook.
+ *
+ * @return SFFS_SET_HOOK_OK on success or
+ *         SFFS_SET_HOOK_FAILED if the support is disabled (SFFS_OP_STATS).
+ */
+int32_t sffs_set_hook(struct sffs *fs, void (*hook)(struct sffs *fs, uint32_t op, uint32_t phase, void *ctx), void *ctx);
+#define SFFS_SET_HOOK_OK 0
+#define SFFS_SET_HOOK_FAILED -1
+
+/**
+ * Set locks used to share the filesystem between multiple tasks. The
+ * filesystem lock is taken by every public API call. Reads of files without
+ * buffered data, file size and directory lookups take it shared if the block
+ * index is valid, all other calls exclusively. The cache lock serializes
+ * access to the page cache and statistics during shared calls, if it is NULL,
+ * all calls take the filesystem lock exclusively. Flash erase of a sector
+ * compacted by sffs_gc_step runs with the filesystem lock shared, the flash
+ * driver must allow reads during an erase then. Locks are taken in the order
+ * file, filesystem, cache. Locks must be set before the filesystem is mounted
+ * and no call may be in progress.
+ *
+ * @param fs A filesystem to set locks for.
+ * @param ops Locking primitives, NULL disables locking.
+ * @param fs_lock Reader-writer lock of the filesystem.
+ * @param cache_lock Mutex of the page cache or NULL.
+ *
+ * @return SFFS_SET_LOCK_OK on success or
+ *         SFFS_SET_LOCK_FAILED if the support is disabled (SFFS_LOCKING).
+ */
+int32_t sffs_set_lock(struct sffs *fs, const struct sffs_lock_ops *ops, void *fs_lock, void *cache_lock);
+#define SFFS_SET_LOCK_OK 0
+#define SFFS_SET_LOCK_FAILED -1
+
+/**
+ * Set a lock of an opened file shared between multiple tasks. It is taken
+ * by all calls using the file and it is forgotten when the file is closed.
+ * Calls using different files run in parallel as far as the filesystem lock
+ * allows.
+ *
+ * @param f An opened file.
+ * @param lock Mutex of the file or NULL.
+ *
+ * @return SFFS_FILE_SET_LOCK_OK on success or
+ *         SFFS_FILE_SET_LOCK_FAILED if the file is not opened or the support
+ *         is disabled (SFFS_LOCKING).
+ */
+int32_t sffs_file_set_lock(struct sffs_file *f, void *lock);
+#define SFFS_FILE_SET_LOCK_OK 0
+#define SFFS_FILE_SET_LOCK_FAILED -1
+
 /**
  * Perform various checks on metadata page header to find any inconsistencies.
  *
@@ -257,21 +1030,25 @@ int32_t sffs_metadata_header_check(struct sffs *fs, struct sffs_metadata_header
 
 /**
  * Try to fetch requested block of data from read cache. If requested data is not
- * found in the cache, read whole page from the flash.
+ * found in the cache, read whole page from the flash. Requested range can span
+ * multiple pages if the cache is enabled.
  *
- * @param fs TODO
- * @param addr TODO
- * @param data TODO
- * @param len TODO
+ * @param fs A SFFS filesystem with cache.
+ * @param addr Flash address to read from.
+ * @param data Buffer for read data.
+ * @param len Length of data to be read.
  *
- * @return TODO
+ * @return SFFS_CACHED_READ_OK on success or
+ *         SFFS_CACHED_READ_FAILED otherwise.
  */
 int32_t sffs_cached_read(struct sffs *fs, uint32_t addr, uint8_t *data, uint32_t len);
 #define SFFS_CACHED_READ_OK 0
 #define SFFS_CACHED_READ_FAILED -1
 
 /**
- * Write one page to cache.
+ * Write data to the flash. The cache is write-through, cached copy of the page
+ * is updated the same way as the flash (bits can be cleared only), pages not
+ * present in the cache are not loaded.
  *
  * @param fs A SFFS filesystem with cache.
  * @param addr Starting address of page to be written.
@@ -303,7 +1080,58 @@ int32_t sffs_find_page(struct sffs *fs, uint32_t file_id, uint32_t block, struct
 #define SFFS_FIND_PAGE_FAILED -2
 
 /**
- * Try to find erased page suitable to be written with file contents.
+ * Build RAM block index from scratch. All sectors are scanned and every used
+ * or moving page is inserted. If both moving and used page exist for the same
+ * block (interrupted write), the used one wins.
+ *
+ * @param fs A SFFS filesystem.
+ *
+ * @return SFFS_INDEX_BUILD_OK on success or
+ *         SFFS_INDEX_BUILD_FAILED if the index cannot hold all blocks.
+ */
+int32_t sffs_index_build(struct sffs *fs);
+#define SFFS_INDEX_BUILD_OK 0
+#define SFFS_INDEX_BUILD_FAILED -1
+
+/**
+ * Lookup file_id/block pair in the RAM block index.
+ *
+ * @param fs A SFFS filesystem.
+ * @param file_id File to search for.
+ * @param block Block index within the file.
+ * @param page Pointer to page structure which will be filled if found.
+ *
+ * @return SFFS_INDEX_LOOKUP_OK if the block was found,
+ *         SFFS_INDEX_LOOKUP_NOT_FOUND if the block doesn't exist or
+ *         SFFS_INDEX_LOOKUP_FAILED if the index is not available.
+ */
+int32_t sffs_index_lookup(struct sffs *fs, uint32_t file_id, uint32_t block, struct sffs_page *page);
+#define SFFS_INDEX_LOOKUP_OK 0
+#define SFFS_INDEX_LOOKUP_NOT_FOUND -1
+#define SFFS_INDEX_LOOKUP_FAILED -2
+
+/**
+ * Update the RAM block index after metadata item of a page has been written.
+ * Used pages are inserted (replacing previous location of the block), moving
+ * pages are inserted only if the block is not indexed yet and all other states
+ * remove the block if it points to this page.
+ *
+ * @param fs A SFFS filesystem.
+ * @param page A page which metadata was written.
+ * @param item New metadata item of the page.
+ *
+ * @return SFFS_INDEX_UPDATE_OK on success or
+ *         SFFS_INDEX_UPDATE_FAILED if the index overflowed (it is invalidated).
+ */
+int32_t sffs_index_update(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item);
+#define SFFS_INDEX_UPDATE_OK 0
+#define SFFS_INDEX_UPDATE_FAILED -1
+
+/**
+ * Try to find erased page suitable to be written with file contents. Pages
+ * are allocated from one sector until it is full, the next sector is selected
+ * round robin preferring partially used sectors and then erased sectors with
+ * the lowest erase count.
  *
  * @param fs A SFFS filesystem.
  * @param page Pointer to page structure which will be filled if page is found.
@@ -331,15 +1159,44 @@ int32_t sffs_page_addr(struct sffs *fs, struct sffs_page *page, uint32_t *addr);
 #define SFFS_PAGE_ADDR_OK 0
 #define SFFS_PAGE_ADDR_FAILED -1
 
+/**
+ * Read sector header and metadata items and fill sector summary table entry.
+ * Sectors with invalid header are marked with zero state and no pages.
+ *
+ * @param fs A SFFS filesystem.
+ * @param sector Sector to scan.
+ *
+ * @return SFFS_SECTOR_SCAN_OK on success or
+ *         SFFS_SECTOR_SCAN_FAILED if the sector header is not valid.
+ */
+int32_t sffs_sector_scan(struct sffs *fs, uint32_t sector);
+#define SFFS_SECTOR_SCAN_OK 0
+#define SFFS_SECTOR_SCAN_FAILED -1
+
 int32_t sffs_sector_format(struct sffs *fs, uint32_t sector);
 #define SFFS_SECTOR_FORMAT_OK 0
 #define SFFS_SECTOR_FORMAT_FAILED -1
 
+/**
+ * Move one used (or moving) data page to a newly allocated erased page. The
+ * same reserved/moving sequence is used as when a page is rewritten, the
+ * source page is marked as old afterwards.
+ *
+ * @param fs A SFFS filesystem.
+ * @param page A page to move.
+ *
+ * @return SFFS_PAGE_MOVE_OK on success (or if there is nothing to move) or
+ *         SFFS_PAGE_MOVE_FAILED otherwise.
+ */
+int32_t sffs_page_move(struct sffs *fs, struct sffs_page *page);
+#define SFFS_PAGE_MOVE_OK 0
+#define SFFS_PAGE_MOVE_FAILED -1
+
 /**
  * Initiate garbage collection for a given sector. If the sector is marked as old,
- * it is being erased automatically. If the sector is dirty, garbage collector
- * finds out if it is worth it to move used page to other locations and erase
- * current dirty sector.
+ * it is being erased. If the sector is dirty, all used pages are moved to other
+ * locations and the sector is erased after the last one is marked as old.
+ * Deciding if it is worth it is left to sffs_collect_garbage.
  *
  * @param A SFFS filesystem.
  * @param sector A sector to perform garbage collection on.
@@ -352,9 +1209,71 @@ int32_t sffs_sector_collect_garbage(struct sffs *fs, uint32_t sector);
 #define SFFS_SECTOR_COLLECT_GARBAGE_FAILED -1
 
 /**
- * Function called after every page metadata write to update sector metadata.
- * It iterates over all pages contained in specified sector and determines sector
- * state. State is written to sector header afterwards.
+ * Reclaim dirty sectors until enough erased pages are available. Victims are
+ * selected greedily, dirty sector with the highest number of old pages is
+ * compacted first. Called automatically when erased pages are running low.
+ *
+ * @param fs A SFFS filesystem.
+ *
+ * @return SFFS_COLLECT_GARBAGE_OK if enough erased pages are available,
+ *         SFFS_COLLECT_GARBAGE_NOTHING if no sector can be reclaimed or
+ *         SFFS_COLLECT_GARBAGE_FAILED otherwise.
+ */
+int32_t sffs_collect_garbage(struct sffs *fs);
+#define SFFS_COLLECT_GARBAGE_OK 0
+#define SFFS_COLLECT_GARBAGE_NOTHING -1
+#define SFFS_COLLECT_GARBAGE_FAILED -2
+
+/**
+ * Perform bounded amount of garbage collection work. It can be called from an
+ * idle task to keep enough erased pages available, so that writes don't need
+ * to collect garbage themselves. One call either erases one old sector or
+ * moves up to @a budget used pages from the current victim sector. Dirty
+ * sectors are compacted only if erased pages are running low. With
+ * SFFS_ASYNC_ERASE the erase is only started and the call returns, the
+ * following calls return SFFS_GC_STEP_BUSY until it completes. Other calls
+ * can be made meanwhile, they wait for the flash only if they need to access
+ * the bank being erased. Completion callback of the flash driver can be used
+ * to schedule the next step.
+ *
+ * @param fs A SFFS filesystem.
+ * @param budget Maximum number of pages to move.
+ *
+ * @return SFFS_GC_STEP_OK if some work was done,
+ *         SFFS_GC_STEP_IDLE if there is nothing to do,
+ *         SFFS_GC_STEP_BUSY if a sector erase is in progress or
+ *         SFFS_GC_STEP_FAILED otherwise.
+ */
+int32_t sffs_gc_step(struct sffs *fs, uint32_t budget);
+#define SFFS_GC_STEP_OK 0
+#define SFFS_GC_STEP_IDLE 1
+#define SFFS_GC_STEP_BUSY 2
+#define SFFS_GC_STEP_FAILED -1
+
+/**
+ * Set garbage collection mode. In the inline mode (default) old sectors are
+ * erased as soon as they become old and dirty sectors are compacted during
+ * writes when erased pages are running low. In the background mode all work is
+ * left to sffs_gc_step, writes collect garbage only if they would fail
+ * otherwise.
+ *
+ * @param fs A SFFS filesystem.
+ * @param mode SFFS_GC_MODE_INLINE or SFFS_GC_MODE_BACKGROUND.
+ *
+ * @return SFFS_SET_GC_MODE_OK on success or
+ *         SFFS_SET_GC_MODE_FAILED if the mode is invalid.
+ */
+int32_t sffs_set_gc_mode(struct sffs *fs, uint32_t mode);
+#define SFFS_SET_GC_MODE_OK 0
+#define SFFS_SET_GC_MODE_FAILED -1
+#define SFFS_GC_MODE_INLINE 0
+#define SFFS_GC_MODE_BACKGROUND 1
+
+/**
+ * Recount all pages contained in specified sector and determine sector state.
+ * Page counts are stored in the sector summary table and the state is written
+ * to sector header afterwards (if it was changed). Metadata writes use the
+ * incremental sffs_update_sector_page_state instead.
  *
  * @param fs A SFFS Filesystem.
  * @param sector Sector to update.
@@ -366,6 +1285,21 @@ int32_t sffs_update_sector_metadata(struct sffs *fs, uint32_t sector);
 #define SFFS_UPDATE_SECTOR_METADATA_OK 0
 #define SFFS_UPDATE_SECTOR_METADATA_FAILED -1
 
+/**
+ * Update sector summary after state of one page has been changed. Page counts
+ * are adjusted incrementally without reading other metadata items and the
+ * sector header is rewritten only if the sector state changes.
+ *
+ * @param fs A SFFS filesystem.
+ * @param page A page which state was changed.
+ * @param old_state Previous state of the page.
+ * @param new_state Current state of the page.
+ *
+ * @return SFFS_UPDATE_SECTOR_METADATA_OK on success or
+ *         SFFS_UPDATE_SECTOR_METADATA_FAILED otherwise.
+ */
+int32_t sffs_update_sector_page_state(struct sffs *fs, struct sffs_page *page, uint8_t old_state, uint8_t new_state);
+
 int32_t sffs_get_page_metadata(struct sffs *fs, struct sffs_page *page, struct sffs_metadata_item *item);
 #define SFFS_GET_PAGE_METADATA_OK 0
 #define SFFS_GET_PAGE_METADATA_FAILED -1
@@ -391,6 +1325,23 @@ int32_t sffs_check_file_opened(struct sffs_file *f);
 #define SFFS_CHECK_FILE_OPENED_FAILED -1
 
 
+/**
+ * Write a checkpoint of the block index and sector summary to the flash. The
+ * previous checkpoint is discarded. During the next mount, sectors not
+ * modified since the checkpoint are restored from it without reading their
+ * metadata. The checkpoint is dropped if the garbage collector moves it.
+ *
+ * @param fs Mounted SFFS filesystem with a valid block index.
+ *
+ * @return SFFS_CHECKPOINT_OK on success or
+ *         SFFS_CHECKPOINT_FAILED if the index is not available or there
+ *         is not enough erased pages.
+ */
+int32_t sffs_checkpoint(struct sffs *fs);
+#define SFFS_CHECKPOINT_OK 0
+#define SFFS_CHECKPOINT_FAILED -1
+
+
 /***************************** File manipulation functions, public API **********************************/
 
 /**
@@ -402,17 +1353,21 @@ int32_t sffs_check_file_opened(struct sffs_file *f);
  * @param f SFFS file structure.
  * @param id ID of file to be opened.
  * @param mode Mode in whit the file will be opened, allowed values are
- *             SFFS_OVERWRITE, SFFS_APPEND and SFFS_READ.
+ *             SFFS_OVERWRITE, SFFS_APPEND and SFFS_READ. SFFS_COMPRESS
+ *             can be added to create a compressed file, SFFS_EXTENT to
+ *             allocate the written pages in extents.
  *
  * @return SFFS_OPEN_ID_OK on success or
- *         SFFS_OPEN_ID_FAILED otherwise.
+ *         SFFS_OPEN_ID_FAILED otherwise (also if compression is requested,
+ *         but a span doesn't fit the write buffer or an uncompressed file
+ *         would be appended).
  */
 int32_t sffs_open_id(struct sffs *fs, struct sffs_file *f, uint32_t file_id, uint32_t mode);
 #define SFFS_OPEN_ID_OK 0
 #define SFFS_OPEN_ID_FAILED -1
 
 /**
- * Close a previously opened file.
+ * Close a previously opened file. Buffered data are written to the flash.
  *
  * @param f SFFS File to close.
  *
@@ -425,7 +1380,9 @@ int32_t sffs_close(struct sffs_file *f);
 
 /**
  * Write data buffer to an opened file at current position. Position in the file
- * is updated afterwards.
+ * is updated afterwards. Data may be kept in the file write buffer, they are
+ * not visible to other opened files until sffs_flush is called. Compressed
+ * files can be written only at their end.
  *
  * @param f SFFS file to write data to.
  * @param buf Buffer containing data to be written.
@@ -435,6 +1392,30 @@ int32_t sffs_close(struct sffs_file *f);
  */
 int32_t sffs_write(struct sffs_file *f, unsigned char *buf, uint32_t len);
 
+/**
+ * Write buffered data of an opened file to the flash.
+ *
+ * @param f SFFS file to flush.
+ *
+ * @return SFFS_FLUSH_OK on success or
+ *         SFFS_FLUSH_FAILED otherwise.
+ */
+int32_t sffs_flush(struct sffs_file *f);
+#define SFFS_FLUSH_OK 0
+#define SFFS_FLUSH_FAILED -1
+
+/**
+ * Flush all files opened on the filesystem.
+ *
+ * @param fs Mounted SFFS filesystem.
+ *
+ * @return SFFS_SYNC_OK on success or
+ *         SFFS_SYNC_FAILED if any of the files cannot be flushed.
+ */
+int32_t sffs_sync(struct sffs *fs);
+#define SFFS_SYNC_OK 0
+#define SFFS_SYNC_FAILED -1
+
 /**
  * Read up to len bytes of data from specified opened file starting at actual
  * position.
@@ -450,9 +1431,45 @@ int32_t sffs_write(struct sffs_file *f, unsigned char *buf, uint32_t len);
 int32_t sffs_read(struct sffs_file *f, unsigned char *buf, uint32_t len);
 
 /**
- * Update write/read position within an opened file.
+ * Read the next contiguous part of a file without copying. The span points
+ * to the page cache and it contains data from the current position up to the
+ * end of the current block. The position is advanced by the span length. The
+ * page stays pinned in the cache until the span is released by
+ * sffs_release_span. At most SFFS_CACHE_PAGES - 1 spans can be held at once.
+ *
+ * @param f A SFFS File.
+ * @param span Span to fill.
+ *
+ * @return SFFS_READ_SPAN_OK on success,
+ *         SFFS_READ_SPAN_EOF if no more data can be read or
+ *         SFFS_READ_SPAN_FAILED if the cache is not available, it is full
+ *         of pinned pages or the file is compressed.
+ */
+int32_t sffs_read_span(struct sffs_file *f, struct sffs_span *span);
+#define SFFS_READ_SPAN_OK 0
+#define SFFS_READ_SPAN_EOF 1
+#define SFFS_READ_SPAN_FAILED -1
+
+/**
+ * Release a span returned by sffs_read_span. Its data must not be accessed
+ * afterwards.
+ *
+ * @param f A SFFS File the span was read from.
+ * @param span Span to release.
+ *
+ * @return SFFS_RELEASE_SPAN_OK on success or
+ *         SFFS_RELEASE_SPAN_FAILED if the span is not held.
+ */
+int32_t sffs_release_span(struct sffs_file *f, struct sffs_span *span);
+#define SFFS_RELEASE_SPAN_OK 0
+#define SFFS_RELEASE_SPAN_FAILED -1
+
+/**
+ * Update write/read position within an opened file. Buffered data are flushed
+ * first. Position cannot be set beyond the end of the file.
  *
  * @param f SFFS file.
+ * @param pos New absolute position.
  *
  * @return SFFS_SEEK_OK on success or
  *         SFFS_SEEK_FAILED otherwise.
@@ -461,6 +1478,22 @@ int32_t sffs_seek(struct sffs_file *f, uint32_t pos);
 #define SFFS_SEEK_OK 0
 #define SFFS_SEEK_FAILED -1
 
+/**
+ * Update write/read position relative to the beginning of the file, current
+ * position or end of the file.
+ *
+ * @param f SFFS file.
+ * @param offset Position offset, it can be negative.
+ * @param whence One of SFFS_SEEK_SET, SFFS_SEEK_CUR or SFFS_SEEK_END.
+ *
+ * @return SFFS_SEEK_OK on success or
+ *         SFFS_SEEK_FAILED if the resulting position is not within the file.
+ */
+int32_t sffs_seek_from(struct sffs_file *f, int32_t offset, uint32_t whence);
+#define SFFS_SEEK_SET 0
+#define SFFS_SEEK_CUR 1
+#define SFFS_SEEK_END 2
+
 /**
  * Removes all blocks for file @a file_id. File should be closed during removal.
  *
@@ -475,7 +1508,24 @@ int32_t sffs_file_remove(struct sffs *fs, uint32_t file_id);
 #define SFFS_FILE_REMOVE_FAILED -1
 
 /**
- * Compute size of specified file.
+ * Remove multiple files in a single pass over sector metadata. All pages of
+ * the files are marked as old (including blocks after holes) and state of every
+ * affected sector is updated once. Files should be closed during removal.
+ *
+ * @param fs A SFFS filesystem.
+ * @param file_ids Array of file IDs to remove.
+ * @param count Number of file IDs in the array.
+ *
+ * @return SFFS_REMOVE_MANY_OK on success or
+ *         SFFS_REMOVE_MANY_FAILED otherwise.
+ */
+int32_t sffs_remove_many(struct sffs *fs, const uint32_t *file_ids, uint32_t count);
+#define SFFS_REMOVE_MANY_OK 0
+#define SFFS_REMOVE_MANY_FAILED -1
+
+/**
+ * Compute size of specified file. Size is taken from the file table if it is
+ * available, file blocks are walked otherwise.
  *
  * @param fs A SFFS Filesystem.
  * @param file_id File ID.
@@ -487,4 +1537,74 @@ int32_t sffs_file_size(struct sffs *fs, uint32_t file_id, uint32_t *size);
 #define SFFS_FILE_SIZE_OK 0
 #define SFFS_FILE_SIZE_FAILED -1
 
+
+/***************************** Directory, public API **********************************/
+
+/**
+ * Find ID of a named file. Names are looked up in the RAM name index, the
+ * directory file is searched if the index is not available.
+ *
+ * @param fs Mounted SFFS filesystem.
+ * @param name File name, at most SFFS_NAME_SIZE characters long.
+ * @param file_id ID of the file is returned here.
+ *
+ * @return SFFS_NAME_LOOKUP_OK if the file was found,
+ *         SFFS_NAME_LOOKUP_NOT_FOUND if the name doesn't exist or
+ *         SFFS_NAME_LOOKUP_FAILED if the name is not valid.
+ */
+int32_t sffs_name_lookup(struct sffs *fs, const char *name, uint32_t *file_id);
+#define SFFS_NAME_LOOKUP_OK 0
+#define SFFS_NAME_LOOKUP_NOT_FOUND 1
+#define SFFS_NAME_LOOKUP_FAILED -1
+
+/**
+ * Open a file by its name. A new name is added to the directory and a free
+ * file ID is assigned to it if the file is opened for writing.
+ *
+ * @param fs A SFFS filesystem with the file.
+ * @param f SFFS file structure.
+ * @param name File name, at most SFFS_NAME_SIZE characters long.
+ * @param mode The same as for sffs_open_id.
+ *
+ * @return SFFS_OPEN_NAME_OK on success or
+ *         SFFS_OPEN_NAME_FAILED otherwise.
+ */
+int32_t sffs_open_name(struct sffs *fs, struct sffs_file *f, const char *name, uint32_t mode);
+#define SFFS_OPEN_NAME_OK 0
+#define SFFS_OPEN_NAME_FAILED -1
+
+/**
+ * Remove a named file and its directory record.
+ *
+ * @param fs Mounted SFFS filesystem.
+ * @param name Name of the file to remove.
+ *
+ * @return SFFS_REMOVE_NAME_OK on success or
+ *         SFFS_REMOVE_NAME_FAILED if the name doesn't exist or the file cannot
+ *         be removed.
+ */
+int32_t sffs_remove_name(struct sffs *fs, const char *name);
+#define SFFS_REMOVE_NAME_OK 0
+#define SFFS_REMOVE_NAME_FAILED -1
+
+/**
+ * Enumerate named files. The RAM name index is walked without reading the
+ * flash if the name is not requested. The directory must not be modified
+ * during the enumeration.
+ *
+ * @param fs Mounted SFFS filesystem.
+ * @param pos Enumeration position, it must be set to 0 before the first call.
+ * @param file_id ID of the next file is returned here.
+ * @param name Buffer for the NUL-terminated name of the file or NULL.
+ * @param name_size Size of the name buffer.
+ *
+ * @return SFFS_DIR_NEXT_OK if a file was returned,
+ *         SFFS_DIR_NEXT_END if there are no more files or
+ *         SFFS_DIR_NEXT_FAILED if the directory cannot be read.
+ */
+int32_t sffs_dir_next(struct sffs *fs, uint32_t *pos, uint32_t *file_id, char *name, uint32_t name_size);
+#define SFFS_DIR_NEXT_OK 0
+#define SFFS_DIR_NEXT_END 1
+#define SFFS_DIR_NEXT_FAILED -1
+
 #endif